@@ -0,0 +1,307 @@
+/*
+ * ch10/10_miscdrv_kvstore/kv_bench.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * A multi-threaded benchmark for the miscdrv_kvstore driver.
+ * For store sizes of 1K, 10K, 100K, ... upto <max_keys> keys (the keys are
+ * __u64's, 0..n-1, passed as their 8 bytes): load the store (in parallel),
+ * then, for 1, 2, 4, ... upto <max_threads> threads (each pinned to a CPU,
+ * each with it's own open of the device), issue GETs of random keys - or,
+ * optionally, a mix of GETs and PUTs - for a few seconds, and report the
+ * aggregate operation rate. With GETs only, the driver takes no lock at all;
+ * the rate should scale (close to) linearly with the threads.
+ * Tip: load the driver with verbose=0.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "miscdrv_kvstore_ioctl.h"
+
+static const char *devfile;
+static volatile int running;
+static pthread_barrier_t start_barrier;
+static int put_pct;   /* % of the operations that are PUTs */
+
+struct worker {
+	pthread_t tid;
+	int cpu;
+	unsigned long long first, last;  /* load: the range of keys to PUT */
+	unsigned long long nkeys;        /* run: keys 0..nkeys-1 are present */
+	long nops, nmiss;
+	int failed;
+};
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file max_keys max_threads [seconds [put_pct]]\n"
+			" For 1K, 10K, ... upto <max_keys> keys in the store, runs 1, 2, 4, ...\n"
+			" upto <max_threads> threads issuing GETs of random keys (and <put_pct>%%\n"
+			" PUTs; default 0) for <seconds> (default 3), reporting the op rate.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A small, fast PRNG (xorshift64); one state per thread */
+static inline unsigned long long xorshift64(unsigned long long *s)
+{
+	unsigned long long x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+static int kv_put(int fd, unsigned long long key)
+{
+	char val[LKDC_KV_VALMAX];
+	struct lkdc_kv kv;
+
+	kv.key = (unsigned long)&key;
+	kv.klen = sizeof(key);
+	kv.val = (unsigned long)val;
+	kv.vlen = snprintf(val, sizeof(val), "val-%llu", key);
+	return ioctl(fd, LKDC_KV_IOC_PUT, &kv);
+}
+
+static int kv_get(int fd, unsigned long long key, char *val)
+{
+	struct lkdc_kv kv;
+
+	kv.key = (unsigned long)&key;
+	kv.klen = sizeof(key);
+	kv.val = (unsigned long)val;
+	kv.vlen = LKDC_KV_VALMAX;
+	return ioctl(fd, LKDC_KV_IOC_GET, &kv);
+}
+
+static int open_pinned(struct worker *w)
+{
+	cpu_set_t cpus;
+	int fd;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	fd = open(devfile, O_RDWR);
+	if (fd < 0) {
+		perror("worker: open");
+		w->failed = 1;
+	}
+	return fd;
+}
+
+static void *loader(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long long k;
+	int fd = open_pinned(w);
+
+	if (fd < 0)
+		return NULL;
+	for (k = w->first; k < w->last; k++) {
+		if (kv_put(fd, k) < 0) {
+			perror("loader: PUT");
+			w->failed = 1;
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long long seed = 0x9E3779B97F4A7C15ULL * (w->cpu + 1), r;
+	char val[LKDC_KV_VALMAX];
+	int fd = open_pinned(w);
+
+	pthread_barrier_wait(&start_barrier);
+	if (fd < 0)
+		return NULL;
+
+	while (running) {
+		r = xorshift64(&seed);
+		if (put_pct && (int)(r % 100) < put_pct) {
+			if (kv_put(fd, (r >> 8) % w->nkeys) < 0) {
+				perror("worker: PUT");
+				w->failed = 1;
+				break;
+			}
+		} else if (kv_get(fd, (r >> 8) % w->nkeys, val) < 0) {
+			if (errno != ENOENT) {
+				perror("worker: GET");
+				w->failed = 1;
+				break;
+			}
+			w->nmiss++;
+		}
+		w->nops++;
+	}
+	close(fd);
+	return NULL;
+}
+
+/* PUT keys [from, to) with one thread per CPU */
+static void load(unsigned long long from, unsigned long long to, int ncpus)
+{
+	struct worker *wk = calloc(ncpus, sizeof(struct worker));
+	unsigned long long per = (to - from + ncpus - 1) / ncpus;
+	double t = now_sec();
+	int i;
+
+	if (!wk) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < ncpus; i++) {
+		wk[i].cpu = i;
+		wk[i].first = from + i * per;
+		wk[i].last = wk[i].first + per;
+		if (wk[i].first > to)
+			wk[i].first = to;
+		if (wk[i].last > to)
+			wk[i].last = to;
+		if (pthread_create(&wk[i].tid, NULL, loader, &wk[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < ncpus; i++) {
+		pthread_join(wk[i].tid, NULL);
+		if (wk[i].failed)
+			exit(EXIT_FAILURE);
+	}
+	free(wk);
+	t = now_sec() - t;
+	printf(" (loaded %llu keys in %.2f s: %.0f PUTs/s)\n", to - from, t,
+		(to - from) / t);
+}
+
+/* Run 'nthrds' workers for 'secs' seconds; returns the aggregate ops/sec */
+static double run(int nthrds, int secs, int ncpus, unsigned long long nkeys)
+{
+	struct worker *wk = calloc(nthrds, sizeof(struct worker));
+	long total = 0, miss = 0;
+	double t;
+	int i;
+
+	if (!wk) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&start_barrier, NULL, nthrds + 1);
+	running = 1;
+	for (i = 0; i < nthrds; i++) {
+		wk[i].cpu = i % ncpus;
+		wk[i].nkeys = nkeys;
+		if (pthread_create(&wk[i].tid, NULL, worker, &wk[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	t = now_sec();
+	sleep(secs);
+	running = 0;
+	for (i = 0; i < nthrds; i++) {
+		pthread_join(wk[i].tid, NULL);
+		if (wk[i].failed)
+			exit(EXIT_FAILURE);
+		total += wk[i].nops;
+		miss += wk[i].nmiss;
+	}
+	t = now_sec() - t;
+	pthread_barrier_destroy(&start_barrier);
+	free(wk);
+
+	if (miss)   /* can't happen, unless someone else is DELeting keys */
+		fprintf(stderr, " warning: %ld GET misses\n", miss);
+	printf(" %10llu %7d %12.0f %14.0f", nkeys, nthrds, total / t,
+		total / t / nthrds);
+	return total / t;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long maxkeys, nkeys, loaded = 0;
+	int maxthrds, secs, ncpus, n, fd;
+	double rate, rate1 = 0;
+	struct lkdc_kv_stats st;
+
+	if (argc < 4 || argc > 6) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	devfile = argv[1];
+	maxkeys = strtoull(argv[2], NULL, 0);
+	maxthrds = atoi(argv[3]);
+	secs = (argc >= 5 ? atoi(argv[4]) : 3);
+	put_pct = (argc == 6 ? atoi(argv[5]) : 0);
+	if (!maxkeys || maxthrds <= 0 || secs <= 0 || put_pct < 0 || put_pct > 100) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("%s: %s, %d CPUs online, %d s per run, %d%% PUTs\n",
+		argv[0], devfile, ncpus, secs, put_pct);
+	printf("       keys threads        ops/s   ops/s/thread  speedup\n");
+	for (nkeys = 1000; ; nkeys *= 10) {
+		if (nkeys > maxkeys)
+			nkeys = maxkeys;
+		load(loaded, nkeys, ncpus);
+		loaded = nkeys;
+		for (n = 1; ; n *= 2) {
+			if (n > maxthrds)
+				n = maxthrds;
+			rate = run(n, secs, ncpus, nkeys);
+			if (n == 1)
+				rate1 = rate;
+			printf(" %8.2f\n", rate / rate1);
+			if (n == maxthrds)
+				break;
+		}
+		if (nkeys == maxkeys)
+			break;
+	}
+
+	if ((fd = open(devfile, O_RDONLY)) >= 0 &&
+	    ioctl(fd, LKDC_KV_IOC_STATS, &st) == 0)
+		printf("driver stats: nkeys=%llu gets=%llu (hits=%llu) puts=%llu"
+			" dels=%llu err=%llu\n",
+			(unsigned long long)st.nkeys, (unsigned long long)st.gets,
+			(unsigned long long)st.hits, (unsigned long long)st.puts,
+			(unsigned long long)st.dels, (unsigned long long)st.err);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,486 @@
+/*
+ * ch10/10_miscdrv_kvstore/miscdrv_kvstore.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * This driver is built upon our previous ch10/9_miscdrv_rdwr_rcu/ misc
+ * driver.
+ * The key difference: instead of the one (global) secret - that every client
+ * has to go through - we keep any number of them, in a key/value store. Apps
+ * get, put and delete key/value pairs via ioctl's (see miscdrv_kvstore_ioctl.h);
+ * there are no read/write methods.
+ * The store is a resizable hash table - the kernel's rhashtable:
+ * - a lookup (GET) runs entirely within an RCU read-side critical section; it
+ *   takes no lock at all, so lookups scale across cores
+ * - an update (PUT, DEL) takes only the lock of the hash bucket concerned
+ *   (within the rhashtable); updates to different buckets run in parallel.
+ *   As in the RCU driver, a value is never modified in place: a PUT builds a
+ *   new key/value object and swaps it in; the old one is freed via kfree_rcu()
+ * - the table grows (and shrinks) itself in the background as keys come and
+ *   go, again without stopping the readers.
+ * As before, the statistics are per-CPU counters.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
+#include <linux/fs.h>		// the fops structure
+
+// copy_[to|from]_user()
+#include <linux/version.h>
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4,11,0)
+#include <linux/uaccess.h>
+#else
+#include <asm/uaccess.h>
+#endif
+
+#include <linux/rhashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+#include "miscdrv_kvstore_ioctl.h"
+
+#define OURMODNAME   "miscdrv_kvstore"
+
+MODULE_AUTHOR("Kaiwan N Billimoria");
+MODULE_DESCRIPTION("LKDC book:ch10/10_miscdrv_kvstore: simple misc"
+		" char driver with an RCU / rhashtable based key/value store");
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_VERSION("0.1");
+
+static unsigned int max_keys = 16 * 1024 * 1024;
+module_param(max_keys, uint, 0444);
+MODULE_PARM_DESC(max_keys,
+ "The (approximate) max # of keys in the store; PUTs of new keys fail with"
+ " ENOSPC beyond it (default 16M)");
+
+static atomic_t ga, gb = ATOMIC_INIT(1); /* ga will be init to 0, gb to 1 */
+
+/*
+ * The key, as stored and hashed: the length and the bytes, zero-padded to
+ * the max; so, the whole structure can be hashed and compared as is.
+ */
+struct kv_key {
+	u32 len;
+	u8 data[LKDC_KV_KEYMAX];
+};
+
+/* A key/value object; a new one is allocated on every PUT */
+struct kv_obj {
+	struct rhash_head node;  // the hash table linkage
+	struct kv_key key;
+	struct rcu_head rcu;     // for kfree_rcu()
+	u32 vlen;
+	char val[];              // vlen bytes
+};
+
+static const struct rhashtable_params kv_params = {
+	.head_offset = offsetof(struct kv_obj, node),
+	.key_offset = offsetof(struct kv_obj, key),
+	.key_len = sizeof(struct kv_key),
+	.automatic_shrinking = true,
+};
+
+/* Per-CPU statistics */
+struct drv_stats {
+	u64 gets, hits, puts, dels, err;
+};
+
+/* The driver 'context' data structure;
+ * all relevant 'state info' reg the driver is here.
+ */
+struct drv_ctx {
+	struct rhashtable ht;   // the store; has it's own (per-bucket) locks
+	struct drv_stats __percpu *stats;
+};
+static struct drv_ctx *ctx;
+
+static void fold_stats(struct lkdc_kv_stats *st)
+{
+	struct drv_stats *s;
+	int cpu;
+
+	memset(st, 0, sizeof(*st));
+	/* Fold the per-CPU stats; the result is approximate, of course */
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(ctx->stats, cpu);
+		st->gets += s->gets;
+		st->hits += s->hits;
+		st->puts += s->puts;
+		st->dels += s->dels;
+		st->err += s->err;
+	}
+	st->nkeys = atomic_read(&ctx->ht.nelems);
+}
+
+static inline void display_stats(int show_stats)
+{
+	struct lkdc_kv_stats st;
+
+	if (1 != show_stats)
+		return;
+	fold_stats(&st);
+	pr_info("%s: stats: nkeys=%llu gets=%llu (hits=%llu) puts=%llu dels=%llu"
+		" err=%llu\n", OURMODNAME, st.nkeys, st.gets, st.hits, st.puts,
+		st.dels, st.err);
+}
+
+/* Copy in the key the app passed us */
+static int get_key(struct kv_key *k, const struct lkdc_kv *kv)
+{
+	if (!kv->klen || kv->klen > LKDC_KV_KEYMAX)
+		return -EINVAL;
+	memset(k, 0, sizeof(*k));
+	k->len = kv->klen;
+	if (copy_from_user(k->data, u64_to_user_ptr(kv->key), kv->klen))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * kv_get()
+ * Look up the key and copy it's value out to the app. The lookup and the
+ * snapshot of the value happen within an RCU read-side critical section:
+ * no lock, and no write to any shared memory. As we must not sleep within it,
+ * the copy_to_user() happens after, from the snapshot.
+ */
+static long kv_get(struct lkdc_kv __user *ukv, struct lkdc_kv *kv)
+{
+	char snap[LKDC_KV_VALMAX];
+	struct kv_obj *obj;
+	struct kv_key k;
+	u32 vlen = 0;
+	long ret;
+
+	this_cpu_inc(ctx->stats->gets);
+	ret = get_key(&k, kv);
+	if (ret)
+		goto out_err;
+
+	rcu_read_lock();
+	obj = rhashtable_lookup(&ctx->ht, &k, kv_params);
+	if (obj) {
+		vlen = obj->vlen;
+		memcpy(snap, obj->val, vlen);
+	}
+	rcu_read_unlock();
+
+	if (!obj)
+		return -ENOENT;   /* a miss isn't an error as such */
+	this_cpu_inc(ctx->stats->hits);
+
+	ret = -EFAULT;
+	if (put_user(vlen, &ukv->vlen))
+		goto out_err;
+	ret = -ENOSPC;
+	if (vlen > kv->vlen)
+		goto out_err;
+	ret = -EFAULT;
+	if (copy_to_user(u64_to_user_ptr(kv->val), snap, vlen))
+		goto out_err;
+	return vlen;
+
+out_err:
+	this_cpu_inc(ctx->stats->err);
+	return ret;
+}
+
+/*
+ * kv_put()
+ * Insert the key/value pair, or, if the key's present, replace it's value.
+ * We build a new object and either insert it or swap it in for the existing
+ * one; either way, only the hash bucket's lock is taken (by the rhashtable
+ * code). Should the existing object vanish meanwhile (a concurrent PUT or DEL
+ * of the same key), we simply retry. We hold the RCU read lock throughout so
+ * that the existing object can't be freed under us.
+ */
+static long kv_put(struct lkdc_kv *kv)
+{
+	struct kv_obj *new, *old;
+	long ret;
+
+	ret = -EINVAL;
+	if (!kv->vlen || kv->vlen > LKDC_KV_VALMAX)
+		goto out_err;
+	ret = -ENOMEM;
+	new = kmalloc(sizeof(struct kv_obj) + kv->vlen, GFP_KERNEL);
+	if (unlikely(!new))
+		goto out_err;
+	ret = get_key(&new->key, kv);
+	if (ret)
+		goto out_free;
+	ret = -EFAULT;
+	if (copy_from_user(new->val, u64_to_user_ptr(kv->val), kv->vlen))
+		goto out_free;
+	new->vlen = kv->vlen;
+
+	rcu_read_lock();
+	if (atomic_read(&ctx->ht.nelems) >= max_keys &&
+	    !rhashtable_lookup(&ctx->ht, &new->key, kv_params)) {
+		rcu_read_unlock();
+		ret = -ENOSPC;   /* full; only replacements are allowed */
+		goto out_free;
+	}
+	for (;;) {
+		old = rhashtable_lookup_get_insert_fast(&ctx->ht, &new->node,
+							kv_params);
+		if (!old)        /* inserted */
+			break;
+		if (IS_ERR(old)) {
+			rcu_read_unlock();
+			ret = PTR_ERR(old);
+			goto out_free;
+		}
+		if (!rhashtable_replace_fast(&ctx->ht, &old->node, &new->node,
+					     kv_params)) {
+			/* Free the old object once all current readers are
+			 * done with it */
+			kfree_rcu(old, rcu);
+			break;
+		}
+		/* -ENOENT: 'old' got replaced or deleted meanwhile; retry */
+	}
+	rcu_read_unlock();
+
+	this_cpu_inc(ctx->stats->puts);
+	return kv->vlen;
+
+out_free:
+	kfree(new);
+out_err:
+	this_cpu_inc(ctx->stats->err);
+	return ret;
+}
+
+/* kv_del(): remove the key (and it's value) */
+static long kv_del(struct lkdc_kv *kv)
+{
+	struct kv_obj *obj;
+	struct kv_key k;
+	long ret;
+
+	ret = get_key(&k, kv);
+	if (ret)
+		goto out_err;
+
+	rcu_read_lock();
+	obj = rhashtable_lookup(&ctx->ht, &k, kv_params);
+	/* Lost a race with another DEL (or PUT) of this key? Then it's gone */
+	if (!obj || rhashtable_remove_fast(&ctx->ht, &obj->node, kv_params)) {
+		rcu_read_unlock();
+		return -ENOENT;
+	}
+	rcu_read_unlock();
+	kfree_rcu(obj, rcu);
+
+	this_cpu_inc(ctx->stats->dels);
+	return 0;
+
+out_err:
+	this_cpu_inc(ctx->stats->err);
+	return ret;
+}
+
+/*--- The driver 'methods' follow ---*/
+/*
+ * open_miscdrv_kvstore()
+ * The driver's open 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is opened. Here, we simply print out some relevant info.
+ * The POSIX standard requires open() to return the file descriptor in success;
+ * note, though, that this is done within the kernel VFS (when we return). So,
+ * all we do here is return 0 indicating success.
+ */
+static int open_miscdrv_kvstore(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_inc(&ga);
+	atomic_dec(&gb);
+
+	vpr_info("%s:%s():\n"
+		" filename: \"%s\"\n"
+		" wrt open file: f_flags = 0x%x\n"
+		" ga = %d, gb = %d\n",
+	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+	       filp->f_flags,
+	       atomic_read(&ga), atomic_read(&gb));
+
+	display_stats(verbose);
+	trace_lkdc_open(OURMODNAME, filp);
+	return 0;
+}
+
+/*
+ * ioctl_miscdrv_kvstore()
+ * The driver's (unlocked) ioctl 'method'. We support these 'commands':
+ *  LKDC_KV_IOC_GET   : copy the value of the key out to the app, and it's
+ *                      length into the struct's 'vlen'; returns 0, or -ENOENT
+ *                      if the key isn't present (or -ENOSPC if the app's
+ *                      buffer is too small for the value)
+ *  LKDC_KV_IOC_PUT   : insert / replace the key's value
+ *  LKDC_KV_IOC_DEL   : remove the key; -ENOENT if it isn't present
+ *  LKDC_KV_IOC_STATS : fold the per-CPU stats and return them (as a
+ *                      struct lkdc_kv_stats) to the calling app.
+ * As with our kfifo driver, there are no printk's on these (hot) paths; use
+ * the lkdc_misc tracepoints to see the GETs (as 'reads') and PUTs (as
+ * 'writes').
+ */
+static long ioctl_miscdrv_kvstore(struct file *filp, unsigned int cmd,
+				  unsigned long arg)
+{
+	struct lkdc_kv __user *ukv = (struct lkdc_kv __user *)arg;
+	struct lkdc_kv_stats st;
+	struct lkdc_kv kv;
+	long ret;
+
+	if (cmd == LKDC_KV_IOC_STATS) {
+		fold_stats(&st);
+		if (copy_to_user((void __user *)arg, &st, sizeof(st))) {
+			pr_warn("%s:%s(): copy_to_user() failed\n",
+				OURMODNAME, __func__);
+			return -EFAULT;
+		}
+		return 0;
+	}
+
+	if (cmd != LKDC_KV_IOC_GET && cmd != LKDC_KV_IOC_PUT &&
+	    cmd != LKDC_KV_IOC_DEL)
+		return -ENOTTY;
+	if (copy_from_user(&kv, ukv, sizeof(kv))) {
+		this_cpu_inc(ctx->stats->err);
+		return -EFAULT;
+	}
+
+	switch (cmd) {
+	case LKDC_KV_IOC_GET:
+		ret = kv_get(ukv, &kv);
+		trace_lkdc_read(OURMODNAME, kv.vlen, ret);
+		return (ret < 0 ? ret : 0);
+	case LKDC_KV_IOC_PUT:
+		ret = kv_put(&kv);
+		trace_lkdc_write(OURMODNAME, kv.vlen, ret);
+		return (ret < 0 ? ret : 0);
+	default:   /* LKDC_KV_IOC_DEL */
+		return kv_del(&kv);
+	}
+}
+
+/*
+ * close_miscdrv_kvstore()
+ * The driver's close 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is closed (technically, when the file ref count drops
+ * to 0). Here, we simply print out some info, and return 0 indicating success.
+ */
+static int close_miscdrv_kvstore(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_dec(&ga);
+	atomic_inc(&gb);
+
+	vpr_info("%s:%s(): filename: \"%s\"\n"
+		" ga = %d, gb = %d\n",
+			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+			atomic_read(&ga), atomic_read(&gb));
+	display_stats(verbose);
+	trace_lkdc_release(OURMODNAME, filp);
+	return 0;
+}
+
+/* The driver 'functionality' is encoded via the fops */
+static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,   // an open fd (and so, a running ioctl) pins the module
+	.open = open_miscdrv_kvstore,
+	.unlocked_ioctl = ioctl_miscdrv_kvstore, // GET, PUT, DEL and STATS
+	.llseek = no_llseek,             // dummy, we don't support lseek(2)
+	.release = close_miscdrv_kvstore,
+};
+
+static struct miscdevice lkdc_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR, // kernel dynamically assigns a free minor#
+	.name = "lkdc_miscdrv_kvstore",
+	    // populated within /sys/class/misc/ and /sys/devices/virtual/misc/
+	.fops = &lkdc_misc_fops,     // connect to 'functionality'
+};
+
+/* Called for every remaining object when we destroy the table, on unload */
+static void kv_free(void *ptr, void *arg)
+{
+	kfree(ptr);
+}
+
+static int __init miscdrv_init_kvstore(void)
+{
+	int ret;
+
+	/* Set up the context before registering the device; once registered,
+	 * it can be opened and used right away */
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	ret = -ENOMEM;
+	ctx->stats = alloc_percpu(struct drv_stats);
+	if (unlikely(!ctx->stats)) {
+		pr_notice("%s: alloc_percpu failed! aborting\n", OURMODNAME);
+		goto out_stats;
+	}
+	ret = rhashtable_init(&ctx->ht, &kv_params);
+	if (ret) {
+		pr_notice("%s: rhashtable_init failed (%d)! aborting\n",
+			OURMODNAME, ret);
+		goto out_ht;
+	}
+
+	if ((ret = misc_register(&lkdc_miscdev))) {
+		pr_notice("%s: misc device registration failed, aborting\n",
+			       OURMODNAME);
+		goto out_misc;
+	}
+	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
+			OURMODNAME, lkdc_miscdev.minor);
+	/* For the (rather silly) way we retrieve the minor #, see the comment
+	 * in ch10/1_miscdrv_rdwr_mutexlock/ */
+	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
+	return 0;		/* success */
+
+out_misc:
+	rhashtable_destroy(&ctx->ht);
+out_ht:
+	free_percpu(ctx->stats);
+out_stats:
+	kfree(ctx);
+	return ret;
+}
+
+static void __exit miscdrv_exit_kvstore(void)
+{
+	misc_deregister(&lkdc_miscdev);
+	/* No users remain; free all the objects still in the table, and the
+	 * table itself */
+	rhashtable_free_and_destroy(&ctx->ht, kv_free, NULL);
+	/* Wait for any in-flight kfree_rcu() callbacks to run before the
+	 * module (and thus the code they may refer to) goes away */
+	rcu_barrier();
+	free_percpu(ctx->stats);
+	kzfree(ctx);
+	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
+}
+
+module_init(miscdrv_init_kvstore);
+module_exit(miscdrv_exit_kvstore);
@@ -0,0 +1,64 @@
+/*
+ * ch10/10_miscdrv_kvstore/miscdrv_kvstore_ioctl.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * The ioctl 'commands' (and their data structures) understood by the
+ * miscdrv_kvstore driver; shared by the driver and userspace apps.
+ * A key is any byte string of 1..LKDC_KV_KEYMAX bytes - a text string, or,
+ * say, a __u64 passed as it's 8 bytes; a value is a byte string of
+ * 1..LKDC_KV_VALMAX bytes.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#ifndef __MISCDRV_KVSTORE_IOCTL_H__
+#define __MISCDRV_KVSTORE_IOCTL_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* The 'magic' (or 'type') byte; it should be unique to our driver. See
+ * Documentation/ioctl/ioctl-number.txt in the kernel source tree */
+#define LKDC_KV_IOCTL_MAGIC	0xE2
+
+#define LKDC_KV_KEYMAX	32
+#define LKDC_KV_VALMAX	128
+
+/*
+ * The argument to the GET, PUT and DEL commands. (User pointers are passed as
+ * __u64's, so that the layout is the same for 32 and 64-bit apps).
+ */
+struct lkdc_kv {
+	__u64 key;      /* (user) pointer to the key */
+	__u64 val;      /* (user) pointer to the value buffer; unused by DEL */
+	__u32 klen;     /* length of the key; 1..LKDC_KV_KEYMAX */
+	__u32 vlen;     /* PUT: length of the value; 1..LKDC_KV_VALMAX
+			   GET: in: size of the value buffer, out: length of
+			   the value (if the buffer is too small for it, the
+			   GET fails with ENOSPC) */
+};
+
+/* The driver statistics, as returned by the STATS command */
+struct lkdc_kv_stats {
+	__u64 nkeys;    /* # of keys currently in the store */
+	__u64 gets;     /* # of GETs ... */
+	__u64 hits;     /* ... of which found their key */
+	__u64 puts;     /* # of successful PUTs */
+	__u64 dels;     /* # of successful DELs */
+	__u64 err;      /* # of failed requests (not counting GET misses) */
+};
+
+#define LKDC_KV_IOC_GET		_IOWR(LKDC_KV_IOCTL_MAGIC, 1, struct lkdc_kv)
+#define LKDC_KV_IOC_PUT		_IOW(LKDC_KV_IOCTL_MAGIC, 2, struct lkdc_kv)
+#define LKDC_KV_IOC_DEL		_IOW(LKDC_KV_IOCTL_MAGIC, 3, struct lkdc_kv)
+#define LKDC_KV_IOC_STATS	_IOR(LKDC_KV_IOCTL_MAGIC, 4, struct lkdc_kv_stats)
+
+#endif   /* #ifndef __MISCDRV_KVSTORE_IOCTL_H__ */
@@ -0,0 +1,489 @@
+/*
+ * ch10/11_miscdrv_rdwr_shard/miscdrv_rdwr_shard.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * This driver is built upon our previous ch10/2_miscdrv_rdwr_spinlock/ misc
+ * driver, in it's lockless (use_seqlock=1) form: readers snapshot the secret
+ * under a seqcount.
+ * The key difference: the secret can be 'sharded' - replicated - per CPU or
+ * per NUMA node (the 'sharded' module parameter):
+ * - a reader snapshots it's *local* replica, and updates only it's own CPU's
+ *   stats; so, on the read path, nothing is written to - and, in the per-CPU
+ *   case, nothing is even read from - a cache line that's shared with another
+ *   CPU; with per-node replicas, reads at least never cross the node
+ * - a writer (serialized by a spinlock) updates every replica in turn, each
+ *   under it's own seqcount; so writes get slower as the number of replicas
+ *   grows. That's the trade-off: it pays off for read-mostly data.
+ * With sharded=0 (the default), there's just the one (global) context, whose
+ * stats every reader updates under the spinlock - as with ch10/2 - for
+ * comparison. Use the ch10/2_miscdrv_rdwr_spinlock/rd_scale app to compare the
+ * read scaling of the modes.
+ * Note: the replicas are all updated, but not atomically as a whole: during an
+ * update, a reader on one CPU may already see the new secret while one on
+ * another still sees the old one (each sees one or the other, never a mix).
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
+#include <linux/fs.h>		// the fops structure
+
+// copy_[to|from]_user()
+#include <linux/version.h>
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4,11,0)
+#include <linux/uaccess.h>
+#else
+#include <asm/uaccess.h>
+#endif
+
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/percpu.h>
+#include <linux/topology.h>     // numa_node_id()
+#include <linux/atomic.h>
+#include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+
+#define OURMODNAME   "miscdrv_rdwr_shard"
+
+MODULE_AUTHOR("Kaiwan N Billimoria");
+MODULE_DESCRIPTION("LKDC book:ch10/11_miscdrv_rdwr_shard: simple misc"
+		" char driver with a per-CPU / per-node replicated secret");
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_VERSION("0.1");
+
+#define SHARD_NONE	0
+#define SHARD_CPU	1
+#define SHARD_NODE	2
+static int sharded;
+module_param(sharded, int, 0444);
+MODULE_PARM_DESC(sharded,
+ "0: a single, global context (the default); 1: the secret is replicated per"
+ " CPU; 2: per NUMA node");
+
+static atomic_t ga, gb = ATOMIC_INIT(1); /* ga will be init to 0, gb to 1 */
+
+#define MAXBYTES    128
+/* A replica of the secret; cacheline aligned, so that no two share a line */
+struct secret_replica {
+	seqcount_t seqc;     // bumped by the writer when it modifies this replica
+	int len;
+	char data[MAXBYTES];
+} ____cacheline_aligned_in_smp;
+
+struct drv_stats {
+	int tx, rx, err;
+};
+
+/* The driver 'context' data structure;
+ * all relevant 'state info' reg the driver is here.
+ */
+struct drv_ctx {
+	int myword;
+	u32 config1, config2;
+	u64 config3;
+	spinlock_t wrlock;   // serializes the writers (only); in the SHARD_NONE
+			     // mode, it also protects the (global) stats
+	/* SHARD_NONE: the one secret and the global stats */
+	struct secret_replica single;
+	struct drv_stats stats;
+	/* SHARD_CPU: a replica per CPU; SHARD_NODE: one per node */
+	struct secret_replica __percpu *cpu_rep;
+	struct secret_replica **node_rep;  // [nr_node_ids]
+	/* SHARD_CPU and SHARD_NODE: per-CPU stats */
+	struct drv_stats __percpu *pcpu_stats;
+};
+static struct drv_ctx *ctx;
+
+static inline void display_stats(int show_stats)
+{
+	int cpu, tx = 0, rx = 0, err = 0;
+	struct drv_stats *s;
+
+	if (1 != show_stats)
+		return;
+	if (sharded == SHARD_NONE) {
+		spin_lock(&ctx->wrlock);
+		tx = ctx->stats.tx;
+		rx = ctx->stats.rx;
+		err = ctx->stats.err;
+		spin_unlock(&ctx->wrlock);
+	} else {
+		/* Fold the per-CPU stats; the result is approximate, of course */
+		for_each_possible_cpu(cpu) {
+			s = per_cpu_ptr(ctx->pcpu_stats, cpu);
+			tx += s->tx;
+			rx += s->rx;
+			err += s->err;
+		}
+	}
+	pr_info("%s: stats: tx=%d, rx=%d, err=%d\n", OURMODNAME, tx, rx, err);
+}
+
+/* Account 'n' bytes to the tx (or rx) stat, or (if n < 0) an error */
+#define STATS_UPDATE(member, n) do {				\
+	if (sharded == SHARD_NONE) {				\
+		spin_lock(&ctx->wrlock);			\
+		ctx->stats.member += (n);			\
+		spin_unlock(&ctx->wrlock);			\
+	} else							\
+		this_cpu_add(ctx->pcpu_stats->member, (n));	\
+} while (0)
+
+/*
+ * snapshot_secret()
+ * The reader side: copy the local replica of the secret into the caller's
+ * buffer 'snap' (of MAXBYTES), retrying if the writer modified it meanwhile.
+ * Returns the length of the secret.
+ * We don't disable preemption: should we migrate to another CPU (or node)
+ * midway, we just end up having read a (perfectly valid) remote replica.
+ */
+static int snapshot_secret(char *snap)
+{
+	struct secret_replica *r;
+	unsigned int seq;
+	int len;
+
+	switch (sharded) {
+	case SHARD_CPU:
+		r = raw_cpu_ptr(ctx->cpu_rep);
+		break;
+	case SHARD_NODE:
+		r = ctx->node_rep[numa_node_id()];
+		break;
+	default:
+		r = &ctx->single;
+	}
+
+	do {
+		seq = read_seqcount_begin(&r->seqc);
+		len = r->len;
+		memcpy(snap, r->data, MAXBYTES);
+	} while (read_seqcount_retry(&r->seqc, seq));
+	return len;
+}
+
+/* Update one replica; the caller holds the wrlock */
+static inline void update_replica(struct secret_replica *r, const char *kbuf,
+				  size_t n)
+{
+	write_seqcount_begin(&r->seqc);
+	strlcpy(r->data, kbuf, n);
+	r->len = strlen(r->data);
+	write_seqcount_end(&r->seqc);
+}
+
+/* The writer side: update every replica of the secret */
+static void update_secret(const char *kbuf, size_t n)
+{
+	int cpu, nid;
+
+	spin_lock(&ctx->wrlock);
+	switch (sharded) {
+	case SHARD_CPU:
+		for_each_possible_cpu(cpu)
+			update_replica(per_cpu_ptr(ctx->cpu_rep, cpu), kbuf, n);
+		break;
+	case SHARD_NODE:
+		for_each_node(nid)
+			update_replica(ctx->node_rep[nid], kbuf, n);
+		break;
+	default:
+		update_replica(&ctx->single, kbuf, n);
+	}
+	spin_unlock(&ctx->wrlock);
+}
+
+/*--- The driver 'methods' follow ---*/
+/*
+ * open_miscdrv_rdwr()
+ * The driver's open 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is opened. Here, we simply print out some relevant info.
+ * The POSIX standard requires open() to return the file descriptor in success;
+ * note, though, that this is done within the kernel VFS (when we return). So,
+ * all we do here is return 0 indicating success.
+ */
+static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_inc(&ga);
+	atomic_dec(&gb);
+
+	vpr_info("%s:%s():\n"
+		" filename: \"%s\"\n"
+		" wrt open file: f_flags = 0x%x\n"
+		" ga = %d, gb = %d\n",
+	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+	       filp->f_flags,
+	       atomic_read(&ga), atomic_read(&gb));
+
+	display_stats(verbose);
+	trace_lkdc_open(OURMODNAME, filp);
+	return 0;
+}
+
+/*
+ * read_miscdrv_rdwr()
+ * The driver's read 'method'; it has effectively 'taken over' the read syscall
+ * functionality!
+ * The POSIX standard requires that the read() and write() system calls return
+ * the number of bytes read or written on success, 0 on EOF and -1 (-ve errno)
+ * on failure; here, we copy the (local replica of the) 'secret' to the
+ * userspace app.
+ */
+static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	char snap[MAXBYTES];
+	int ret, secret_len;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes\n",
+			OURMODNAME, __func__, current->comm, count);
+
+	if (count < MAXBYTES) {
+		pr_warn("%s:%s(): request # of bytes (%zu) is < required size"
+			" (%d), aborting read\n",
+				OURMODNAME, __func__, count, MAXBYTES);
+		ret = -EINVAL;
+		goto out_notok;
+	}
+
+	secret_len = snapshot_secret(snap);
+	if (secret_len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		ret = -EINVAL;
+		goto out_notok;
+	}
+	/* We copy out our private snapshot of the secret, so no lock is
+	 * required to protect the (sleepable) copy */
+	if (copy_to_user(ubuf, snap, secret_len)) {
+		pr_warn("%s:%s(): copy_to_user() failed\n", OURMODNAME, __func__);
+		ret = -EFAULT;
+		goto out_notok;
+	}
+	ret = secret_len;
+
+	// Update stats
+	STATS_UPDATE(tx, secret_len); // our 'transmit' is wrt userspace
+	vpr_info(" %d bytes read, returning...\n", secret_len);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+
+out_notok:
+	STATS_UPDATE(err, 1);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * write_miscdrv_rdwr()
+ * The driver's write 'method'; it has effectively 'taken over' the write syscall
+ * functionality!
+ * The POSIX standard requires that the read() and write() system calls return
+ * the number of bytes read or written on success, 0 on EOF and -1 (-ve errno)
+ * on failure; Here, we accept the string passed to us and make it the new
+ * 'secret', in every replica.
+ */
+static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	size_t n = (count > MAXBYTES ? MAXBYTES : count);
+	char kbuf[MAXBYTES + 1];
+	ssize_t ret;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %zu bytes\n",
+			OURMODNAME, __func__, current->comm, count);
+
+	/* We only ever keep (upto) MAXBYTES of it; so, that's all we copy in,
+	 * into a small on-stack buffer */
+	if (copy_from_user(kbuf, ubuf, n)) {
+		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
+		ret = -EFAULT;
+		goto out_notok;
+	}
+	kbuf[n] = '\0';
+
+	update_secret(kbuf, n);
+
+	// Update stats
+	STATS_UPDATE(rx, count); // our 'receive' is wrt userspace
+	vpr_info(" %zu bytes written, returning...\n", count);
+	ret = count;
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+
+out_notok:
+	STATS_UPDATE(err, 1);
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * close_miscdrv_rdwr()
+ * The driver's close 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is closed (technically, when the file ref count drops
+ * to 0). Here, we simply print out some info, and return 0 indicating success.
+ */
+static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_dec(&ga);
+	atomic_inc(&gb);
+
+	vpr_info("%s:%s(): filename: \"%s\"\n"
+		" ga = %d, gb = %d\n",
+			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+			atomic_read(&ga), atomic_read(&gb));
+	display_stats(verbose);
+	trace_lkdc_release(OURMODNAME, filp);
+	return 0;
+}
+
+/* The driver 'functionality' is encoded via the fops */
+static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,   // an open fd pins the module (and the replicas)
+	.open = open_miscdrv_rdwr,
+	.read = read_miscdrv_rdwr,
+	.write = write_miscdrv_rdwr,
+	.llseek = no_llseek,             // dummy, we don't support lseek(2)
+	.release = close_miscdrv_rdwr,
+};
+
+static struct miscdevice lkdc_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR, // kernel dynamically assigns a free minor#
+	.name = "lkdc_miscdrv_rdwr_shard",
+	    // populated within /sys/class/misc/ and /sys/devices/virtual/misc/
+	.fops = &lkdc_misc_fops,     // connect to 'functionality'
+};
+
+/* Free the replicas (and the per-CPU stats); any of them may be NULL */
+static void free_replicas(void)
+{
+	int nid;
+
+	if (ctx->node_rep) {
+		for_each_node(nid)
+			kfree(ctx->node_rep[nid]);
+		kfree(ctx->node_rep);
+	}
+	free_percpu(ctx->cpu_rep);
+	free_percpu(ctx->pcpu_stats);
+}
+
+/*
+ * Allocate the replicas of the sharded modes; the per-CPU ones come from
+ * each CPU's own per-CPU area (node-local memory, where available), the
+ * per-node ones from their own node's memory.
+ */
+static int alloc_replicas(void)
+{
+	int cpu, nid;
+
+	ctx->pcpu_stats = alloc_percpu(struct drv_stats);
+	if (!ctx->pcpu_stats)
+		return -ENOMEM;
+
+	if (sharded == SHARD_CPU) {
+		ctx->cpu_rep = alloc_percpu(struct secret_replica);
+		if (!ctx->cpu_rep)
+			return -ENOMEM;
+		for_each_possible_cpu(cpu)
+			seqcount_init(&per_cpu_ptr(ctx->cpu_rep, cpu)->seqc);
+		return 0;
+	}
+
+	/* SHARD_NODE */
+	ctx->node_rep = kcalloc(nr_node_ids, sizeof(struct secret_replica *),
+				GFP_KERNEL);
+	if (!ctx->node_rep)
+		return -ENOMEM;
+	for_each_node(nid) {
+		ctx->node_rep[nid] = kzalloc_node(sizeof(struct secret_replica),
+				GFP_KERNEL, node_state(nid, N_MEMORY) ?
+				nid : NUMA_NO_NODE);
+		if (!ctx->node_rep[nid])
+			return -ENOMEM;
+		seqcount_init(&ctx->node_rep[nid]->seqc);
+	}
+	return 0;
+}
+
+static int __init miscdrv_init_shard(void)
+{
+	int ret;
+
+	if (sharded < SHARD_NONE || sharded > SHARD_NODE) {
+		pr_notice("%s: sharded=%d invalid (must be 0, 1 or 2), aborting\n",
+			OURMODNAME, sharded);
+		return -EINVAL;
+	}
+
+	/* Set up the context before registering the device; once registered,
+	 * it can be opened and used right away */
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	spin_lock_init(&ctx->wrlock);
+	seqcount_init(&ctx->single.seqc);
+	if (sharded != SHARD_NONE) {
+		ret = alloc_replicas();
+		if (ret) {
+			pr_notice("%s: allocating the replicas failed! aborting\n",
+				OURMODNAME);
+			goto out_rep;
+		}
+	}
+	update_secret("initmsg", 8);
+
+	if ((ret = misc_register(&lkdc_miscdev))) {
+		pr_notice("%s: misc device registration failed, aborting\n",
+			       OURMODNAME);
+		goto out_rep;
+	}
+	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
+			OURMODNAME, lkdc_miscdev.minor);
+	pr_info("%s: sharded=%d (%s)\n", OURMODNAME, sharded,
+		sharded == SHARD_CPU ? "per-CPU replicas" :
+		sharded == SHARD_NODE ? "per-node replicas" : "a single context");
+	/* For the (rather silly) way we retrieve the minor #, see the comment
+	 * in ch10/1_miscdrv_rdwr_mutexlock/ */
+	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
+	return 0;		/* success */
+
+out_rep:
+	free_replicas();
+	kfree(ctx);
+	return ret;
+}
+
+static void __exit miscdrv_exit_shard(void)
+{
+	misc_deregister(&lkdc_miscdev);
+	free_replicas();
+	kzfree(ctx);
+	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
+}
+
+module_init(miscdrv_init_shard);
+module_exit(miscdrv_exit_shard);
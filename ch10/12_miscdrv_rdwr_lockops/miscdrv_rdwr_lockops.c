@@ -0,0 +1,584 @@
+/*
+ * ch10/12_miscdrv_rdwr_lockops/miscdrv_rdwr_lockops.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * The earlier ch10 drivers each hard-code one way of protecting the secret -
+ * a mutex (1_), a spinlock (2_), atomics (5_), RCU (9_), ... - and thus
+ * differ in much more than just their locking. This driver has all of them:
+ * the synchronization of the data path is behind a small 'lock ops' table,
+ * and the 'lockmode' module parameter selects which one's used, at load time:
+ *  mutex    : a mutex; readers and writers alike are serialized
+ *  spinlock : a spinlock; ditto
+ *  rwlock   : a reader-writer spinlock; readers run in parallel
+ *  rwsem    : a reader-writer semaphore; ditto (but they may sleep)
+ *  seqlock  : a seqlock; readers take no lock, retrying if a writer intervened
+ *  rcu      : RCU; readers take no lock and never retry, a writer publishes a
+ *             new copy of the secret and frees the old one after a grace period
+ *  percpu   : a replica of the secret (and a spinlock) per CPU; readers only
+ *             ever lock their own CPU's replica, a writer updates all of them
+ * Everything else - the methods, the (per-CPU) stats, the copies to and from
+ * userspace - is identical across the modes, so they can be compared
+ * apples-to-apples, with say the ch10/2_miscdrv_rdwr_spinlock/rd_scale app
+ * (built via this directory's Makefile too), and the latency histograms in
+ * debugfs (see lkdc_misc_hist.h). To switch modes, just reload the module.
+ * A reader always snapshots the secret (under the lock, or the lockless
+ * scheme) into an on-stack buffer, and copies it out to userspace afterward,
+ * so that no mode ever holds a (non-sleeping) lock across a copy_to_user().
+ * FYI, the extra cost of the indirect calls via the ops table is the same for
+ * every mode.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
+#include <linux/fs.h>		// the fops structure
+
+// copy_[to|from]_user()
+#include <linux/version.h>
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4,11,0)
+#include <linux/uaccess.h>
+#else
+#include <asm/uaccess.h>
+#endif
+
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rwlock.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/string.h>       // sysfs_streq()
+#include <linux/atomic.h>
+#include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+#include "../../lkdc_misc_hist.h"
+
+#define OURMODNAME   "miscdrv_rdwr_lockops"
+
+MODULE_AUTHOR("Kaiwan N Billimoria");
+MODULE_DESCRIPTION("LKDC book:ch10/12_miscdrv_rdwr_lockops: simple misc"
+		" char driver with a pluggable locking strategy");
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_VERSION("0.1");
+
+static char *lockmode = "mutex";
+module_param(lockmode, charp, 0444);
+MODULE_PARM_DESC(lockmode,
+ "How the secret is protected: one of mutex (the default), spinlock, rwlock,"
+ " rwsem, seqlock, rcu or percpu");
+
+static atomic_t ga, gb = ATOMIC_INIT(1); /* ga will be init to 0, gb to 1 */
+
+#define MAXBYTES    128
+struct secret {
+	int len;
+	char data[MAXBYTES];
+};
+
+/*
+ * The 'lock ops': the data path's synchronization, one set per lockmode.
+ * get() takes a consistent snapshot of the secret into 'snap'; set() makes
+ * 's' the new secret (it's the only one that can fail). init() and exit(),
+ * if present, set up and tear down the mode's (dynamic) state.
+ * Each is called from process context only, and may sleep.
+ */
+struct lkdc_lockops {
+	const char *name;
+	int (*init)(void);
+	void (*exit)(void);
+	void (*get)(struct secret *snap);
+	int (*set)(const struct secret *s);
+};
+static const struct lkdc_lockops *lops;
+
+struct drv_stats {
+	int tx, rx, err;
+};
+static struct drv_stats __percpu *pcpu_stats;  // the same for every mode
+static struct lkdc_hist hist;
+
+/*--- The lock-based modes: the one secret under the one lock ---*/
+static struct secret the_secret;
+static DEFINE_MUTEX(mtx);
+static DEFINE_SPINLOCK(splock);
+static DEFINE_RWLOCK(rwlck);
+static DECLARE_RWSEM(lk_rwsem);
+static DEFINE_SEQLOCK(seqlck);
+
+static void lk_mutex_get(struct secret *snap)
+{
+	mutex_lock(&mtx);
+	*snap = the_secret;
+	mutex_unlock(&mtx);
+}
+
+static int lk_mutex_set(const struct secret *s)
+{
+	mutex_lock(&mtx);
+	the_secret = *s;
+	mutex_unlock(&mtx);
+	return 0;
+}
+
+static void lk_spinlock_get(struct secret *snap)
+{
+	spin_lock(&splock);
+	*snap = the_secret;
+	spin_unlock(&splock);
+}
+
+static int lk_spinlock_set(const struct secret *s)
+{
+	spin_lock(&splock);
+	the_secret = *s;
+	spin_unlock(&splock);
+	return 0;
+}
+
+static void lk_rwlock_get(struct secret *snap)
+{
+	read_lock(&rwlck);
+	*snap = the_secret;
+	read_unlock(&rwlck);
+}
+
+static int lk_rwlock_set(const struct secret *s)
+{
+	write_lock(&rwlck);
+	the_secret = *s;
+	write_unlock(&rwlck);
+	return 0;
+}
+
+static void lk_rwsem_get(struct secret *snap)
+{
+	down_read(&lk_rwsem);
+	*snap = the_secret;
+	up_read(&lk_rwsem);
+}
+
+static int lk_rwsem_set(const struct secret *s)
+{
+	down_write(&lk_rwsem);
+	the_secret = *s;
+	up_write(&lk_rwsem);
+	return 0;
+}
+
+static void lk_seqlock_get(struct secret *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&seqlck);
+		*snap = the_secret;
+	} while (read_seqretry(&seqlck, seq));
+}
+
+static int lk_seqlock_set(const struct secret *s)
+{
+	write_seqlock(&seqlck);
+	the_secret = *s;
+	write_sequnlock(&seqlck);
+	return 0;
+}
+
+/*--- RCU: readers dereference the current copy, writers replace it ---*/
+struct rcu_secret {
+	struct secret s;
+	struct rcu_head rcu;
+};
+static struct rcu_secret __rcu *rcu_sec;
+static DEFINE_MUTEX(wrmtx);  // serializes the writers of the rcu and percpu modes
+
+static void lk_rcu_get(struct secret *snap)
+{
+	rcu_read_lock();
+	*snap = rcu_dereference(rcu_sec)->s;
+	rcu_read_unlock();
+}
+
+static int lk_rcu_set(const struct secret *s)
+{
+	struct rcu_secret *new, *old;
+
+	new = kmalloc(sizeof(struct rcu_secret), GFP_KERNEL);
+	if (unlikely(!new))
+		return -ENOMEM;
+	new->s = *s;
+
+	mutex_lock(&wrmtx);
+	old = rcu_dereference_protected(rcu_sec, lockdep_is_held(&wrmtx));
+	rcu_assign_pointer(rcu_sec, new);
+	mutex_unlock(&wrmtx);
+	if (old)
+		kfree_rcu(old, rcu);
+	return 0;
+}
+
+static void lk_rcu_exit(void)
+{
+	/* no readers or writers remain; wait for any pending kfree_rcu()'s */
+	kfree(rcu_dereference_protected(rcu_sec, 1));
+	rcu_barrier();
+}
+
+/*--- percpu: a replica per CPU, each under it's own spinlock ---*/
+struct pcpu_secret {
+	spinlock_t lock;
+	struct secret s;
+} ____cacheline_aligned_in_smp;
+static struct pcpu_secret __percpu *pcpu_sec;
+
+static void lk_percpu_get(struct secret *snap)
+{
+	struct pcpu_secret *p = get_cpu_ptr(pcpu_sec);
+
+	spin_lock(&p->lock);
+	*snap = p->s;
+	spin_unlock(&p->lock);
+	put_cpu_ptr(pcpu_sec);
+}
+
+static int lk_percpu_set(const struct secret *s)
+{
+	struct pcpu_secret *p;
+	int cpu;
+
+	mutex_lock(&wrmtx);
+	for_each_possible_cpu(cpu) {
+		p = per_cpu_ptr(pcpu_sec, cpu);
+		spin_lock(&p->lock);
+		p->s = *s;
+		spin_unlock(&p->lock);
+	}
+	mutex_unlock(&wrmtx);
+	return 0;
+}
+
+static int lk_percpu_init(void)
+{
+	int cpu;
+
+	pcpu_sec = alloc_percpu(struct pcpu_secret);
+	if (!pcpu_sec)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(pcpu_sec, cpu)->lock);
+	return 0;
+}
+
+static void lk_percpu_exit(void)
+{
+	free_percpu(pcpu_sec);
+}
+
+static const struct lkdc_lockops all_lockops[] = {
+	{ .name = "mutex",    .get = lk_mutex_get,    .set = lk_mutex_set },
+	{ .name = "spinlock", .get = lk_spinlock_get, .set = lk_spinlock_set },
+	{ .name = "rwlock",   .get = lk_rwlock_get,   .set = lk_rwlock_set },
+	{ .name = "rwsem",    .get = lk_rwsem_get,    .set = lk_rwsem_set },
+	{ .name = "seqlock",  .get = lk_seqlock_get,  .set = lk_seqlock_set },
+	{ .name = "rcu",      .get = lk_rcu_get,      .set = lk_rcu_set,
+	  .exit = lk_rcu_exit },
+	{ .name = "percpu",   .get = lk_percpu_get,   .set = lk_percpu_set,
+	  .init = lk_percpu_init, .exit = lk_percpu_exit },
+};
+
+static inline void display_stats(int show_stats)
+{
+	int cpu, tx = 0, rx = 0, err = 0;
+	struct drv_stats *s;
+
+	if (1 != show_stats)
+		return;
+	/* Fold the per-CPU stats; the result is approximate, of course */
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(pcpu_stats, cpu);
+		tx += s->tx;
+		rx += s->rx;
+		err += s->err;
+	}
+	pr_info("%s: [%s] stats: tx=%d, rx=%d, err=%d\n",
+		OURMODNAME, lops->name, tx, rx, err);
+}
+
+/*--- The driver 'methods' follow ---*/
+/*
+ * open_miscdrv_rdwr()
+ * The driver's open 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is opened. Here, we simply print out some relevant info.
+ * The POSIX standard requires open() to return the file descriptor in success;
+ * note, though, that this is done within the kernel VFS (when we return). So,
+ * all we do here is return 0 indicating success.
+ */
+static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	u64 t0 = lkdc_hist_start();
+
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_inc(&ga);
+	atomic_dec(&gb);
+
+	vpr_info("%s:%s():\n"
+		" filename: \"%s\"\n"
+		" wrt open file: f_flags = 0x%x\n"
+		" ga = %d, gb = %d\n",
+	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+	       filp->f_flags,
+	       atomic_read(&ga), atomic_read(&gb));
+
+	display_stats(verbose);
+	lkdc_hist_record(&hist, LKDC_H_OPEN, t0, 0);
+	trace_lkdc_open(OURMODNAME, filp);
+	return 0;
+}
+
+/*
+ * read_miscdrv_rdwr()
+ * The driver's read 'method'; it has effectively 'taken over' the read syscall
+ * functionality!
+ * The POSIX standard requires that the read() and write() system calls return
+ * the number of bytes read or written on success, 0 on EOF and -1 (-ve errno)
+ * on failure; here, we snapshot the 'secret' via the lock ops, and copy the
+ * snapshot to the userspace app.
+ */
+static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	u64 t0 = lkdc_hist_start();
+	struct secret snap;
+	int ret;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes\n",
+			OURMODNAME, __func__, current->comm, count);
+
+	if (count < MAXBYTES) {
+		pr_warn("%s:%s(): request # of bytes (%zu) is < required size"
+			" (%d), aborting read\n",
+				OURMODNAME, __func__, count, MAXBYTES);
+		ret = -EINVAL;
+		goto out_notok;
+	}
+
+	lops->get(&snap);
+	if (snap.len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		ret = -EINVAL;
+		goto out_notok;
+	}
+	/* We copy out our private snapshot of the secret, so no lock is
+	 * required to protect the (sleepable) copy */
+	if (copy_to_user(ubuf, snap.data, snap.len)) {
+		pr_warn("%s:%s(): copy_to_user() failed\n", OURMODNAME, __func__);
+		ret = -EFAULT;
+		goto out_notok;
+	}
+	ret = snap.len;
+
+	// Update stats
+	this_cpu_add(pcpu_stats->tx, snap.len); // our 'transmit' is wrt userspace
+	vpr_info(" %d bytes read, returning...\n", snap.len);
+	lkdc_hist_record(&hist, LKDC_H_READ, t0, count);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+
+out_notok:
+	this_cpu_inc(pcpu_stats->err);
+	lkdc_hist_record(&hist, LKDC_H_READ, t0, count);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * write_miscdrv_rdwr()
+ * The driver's write 'method'; it has effectively 'taken over' the write syscall
+ * functionality!
+ * The POSIX standard requires that the read() and write() system calls return
+ * the number of bytes read or written on success, 0 on EOF and -1 (-ve errno)
+ * on failure; Here, we accept the string passed to us and make it the new
+ * 'secret', via the lock ops.
+ */
+static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	u64 t0 = lkdc_hist_start();
+	size_t n = (count > MAXBYTES ? MAXBYTES : count);
+	char kbuf[MAXBYTES + 1];
+	struct secret new = { 0 };
+	ssize_t ret;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %zu bytes\n",
+			OURMODNAME, __func__, current->comm, count);
+
+	/* We only ever keep (upto) MAXBYTES of it; so, that's all we copy in,
+	 * into a small on-stack buffer */
+	if (copy_from_user(kbuf, ubuf, n)) {
+		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
+		ret = -EFAULT;
+		goto out_notok;
+	}
+	kbuf[n] = '\0';
+
+	/* As with our other drivers, a 0-byte write leaves the secret as is */
+	if (!n)
+		goto out_ok;
+	strlcpy(new.data, kbuf, n);
+	new.len = strnlen(new.data, MAXBYTES);
+	ret = lops->set(&new);
+	if (ret < 0) {
+		pr_warn("%s:%s(): [%s] updating the secret failed (%zd)\n",
+			OURMODNAME, __func__, lops->name, ret);
+		goto out_notok;
+	}
+
+out_ok:
+	// Update stats
+	this_cpu_add(pcpu_stats->rx, count); // our 'receive' is wrt userspace
+	vpr_info(" %zu bytes written, returning...\n", count);
+	ret = count;
+	lkdc_hist_record(&hist, LKDC_H_WRITE, t0, count);
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+
+out_notok:
+	this_cpu_inc(pcpu_stats->err);
+	lkdc_hist_record(&hist, LKDC_H_WRITE, t0, count);
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * close_miscdrv_rdwr()
+ * The driver's close 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is closed (technically, when the file ref count drops
+ * to 0). Here, we simply print out some info, and return 0 indicating success.
+ */
+static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	u64 t0 = lkdc_hist_start();
+
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_dec(&ga);
+	atomic_inc(&gb);
+
+	vpr_info("%s:%s(): filename: \"%s\"\n"
+		" ga = %d, gb = %d\n",
+			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+			atomic_read(&ga), atomic_read(&gb));
+	display_stats(verbose);
+	lkdc_hist_record(&hist, LKDC_H_RELEASE, t0, 0);
+	trace_lkdc_release(OURMODNAME, filp);
+	return 0;
+}
+
+/* The driver 'functionality' is encoded via the fops */
+static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,
+	.open = open_miscdrv_rdwr,
+	.read = read_miscdrv_rdwr,
+	.write = write_miscdrv_rdwr,
+	.llseek = no_llseek,             // dummy, we don't support lseek(2)
+	.release = close_miscdrv_rdwr,
+};
+
+static struct miscdevice lkdc_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR, // kernel dynamically assigns a free minor#
+	.name = "lkdc_miscdrv_rdwr_lockops",
+	    // populated within /sys/class/misc/ and /sys/devices/virtual/misc/
+	.fops = &lkdc_misc_fops,     // connect to 'functionality'
+};
+
+static int __init miscdrv_init_lockops(void)
+{
+	struct secret initial = { .len = 7, .data = "initmsg" };
+	int ret, i;
+
+	for (i = 0; i < ARRAY_SIZE(all_lockops); i++) {
+		if (sysfs_streq(lockmode, all_lockops[i].name)) {
+			lops = &all_lockops[i];
+			break;
+		}
+	}
+	if (!lops) {
+		pr_notice("%s: lockmode \"%s\" invalid (must be one of mutex,"
+			" spinlock, rwlock, rwsem, seqlock, rcu or percpu), aborting\n",
+			OURMODNAME, lockmode);
+		return -EINVAL;
+	}
+
+	/* Set up everything before registering the device; once registered,
+	 * it can be opened and used right away */
+	pcpu_stats = alloc_percpu(struct drv_stats);
+	if (!pcpu_stats)
+		return -ENOMEM;
+	if (lops->init) {
+		ret = lops->init();
+		if (ret) {
+			pr_notice("%s: [%s] init failed! aborting\n",
+				OURMODNAME, lops->name);
+			goto out_init;
+		}
+	}
+	ret = lops->set(&initial);
+	if (ret)
+		goto out_set;
+	ret = lkdc_hist_init(&hist, OURMODNAME);
+	if (ret)
+		goto out_set;
+
+	if ((ret = misc_register(&lkdc_miscdev))) {
+		pr_notice("%s: misc device registration failed, aborting\n",
+			       OURMODNAME);
+		goto out_reg;
+	}
+	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
+			OURMODNAME, lkdc_miscdev.minor);
+	pr_info("%s: lockmode=%s\n", OURMODNAME, lops->name);
+	/* For the (rather silly) way we retrieve the minor #, see the comment
+	 * in ch10/1_miscdrv_rdwr_mutexlock/ */
+	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
+	return 0;		/* success */
+
+out_reg:
+	lkdc_hist_exit(&hist);
+out_set:
+	if (lops->exit)
+		lops->exit();
+out_init:
+	free_percpu(pcpu_stats);
+	return ret;
+}
+
+static void __exit miscdrv_exit_lockops(void)
+{
+	misc_deregister(&lkdc_miscdev);
+	lkdc_hist_exit(&hist);
+	if (lops->exit)
+		lops->exit();
+	free_percpu(pcpu_stats);
+	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
+}
+
+module_init(miscdrv_init_lockops);
+module_exit(miscdrv_exit_lockops);
@@ -0,0 +1,117 @@
+#!/bin/bash
+# run_suite.sh
+# Part of the LKDC book's source: ch10/13_lock_bench_suite
+#
+# A cross-variant benchmark suite for the ch10 misc drivers: builds each
+# driver variant, loads it in turn (with verbose=0 where it has that param;
+# the trylock variant with it's adaptive policy, trylock_policy=1),
+# creates it's device node (via it's cr8devnode.sh) and runs the *identical*
+# workload matrix against it - every combination of:
+#  WRPCTS   : the % of ops that are writes            (default: 0 10 50)
+#  THREADS  : the # of worker threads, pinned per CPU (default: 1 2 4 8)
+#  PAYLOADS : the payload size, bytes                 (default: 128 4096)
+# each for SECS seconds (default: 3) - using the load generator mode of the
+# ch9/miscdrv/rdwr_test app. Finally, it prints one comparative table: per
+# workload, each variant's throughput, latency percentiles and the CPU time
+# it took per op (the driver code runs in the context of the worker threads,
+# so this includes it). The raw results are also kept in a file.
+# Override any of the above (and VARIANTS) via the environment, f.e.
+#  THREADS="1 4" SECS=5 ./run_suite.sh
+# Needs root (via sudo) to load and unload the modules; run it on an otherwise
+# idle box.
+name=$(basename $0)
+TOP=$(cd $(dirname $0)/../.. && pwd)
+
+# The variants: <dir, relative to the repo top>:<module name>
+VARIANTS=${VARIANTS:-"\
+ch10/1_miscdrv_rdwr_mutexlock:miscdrv_rdwr_mutexlock \
+ch10/2_miscdrv_rdwr_spinlock:miscdrv_rdwr_spinlock \
+ch10/3_miscdrv_rdwr_spinlock_pvtdata:miscdrv_rdwr_spinlock_pvtdata \
+ch10/5_miscdrv_rdwr_atomicint:miscdrv_rdwr_atomicint \
+solutions_to_assgn/ch10/miscdrv_rdwr_mutextrylock:miscdrv_rdwr_mutextrylock"}
+WRPCTS=${WRPCTS:-"0 10 50"}
+THREADS=${THREADS:-"1 2 4 8"}
+PAYLOADS=${PAYLOADS:-"128 4096"}
+SECS=${SECS:-3}
+DEV=/dev/miscdrv
+RDWR_TEST=${TOP}/ch9/miscdrv/rdwr_test
+RESULTS=${RESULTS:-$(pwd)/results_$(date +%Y%m%d_%H%M%S).txt}
+
+die()
+{
+  echo "${name}: $@" 1>&2
+  exit 1
+}
+
+# Unload all the variants (any that's loaded) and remove the device node(s)
+unload_all()
+{
+  local v
+  for v in ${VARIANTS} ; do
+    lsmod |grep -q "^${v#*:} " && sudo rmmod ${v#*:}
+  done
+  sudo rm -f ${DEV} ${DEV}[0-9]*
+}
+
+# Parameter(s): the dir and the module name of the variant
+load_variant()
+{
+  local dir=${TOP}/$1 mod=$2 params=""
+
+  make -C ${dir} >/dev/null 2>&1 || die "building ${mod} failed (in ${dir})"
+  modinfo -p ${dir}/${mod}.ko |grep -q "^verbose:" && params="verbose=0"
+  # The trylock variant's classic policy 'works' (printk's) between tries,
+  # by design; the adaptive one doesn't, so that's the one we compare
+  modinfo -p ${dir}/${mod}.ko |grep -q "^trylock_policy:" && \
+    params="${params} trylock_policy=1"
+  sudo insmod ${dir}/${mod}.ko ${params} || die "insmod ${mod} failed"
+  # cr8devnode.sh looks up the minor # in the kernel log (the last load's,
+  # so we needn't clear the log)
+  (cd ${dir} && ./cr8devnode.sh >/dev/null) || die "creating ${DEV} failed"
+  sudo chmod 0666 ${DEV}
+}
+
+### "main" here
+[ $(id -u) -eq 0 ] || which sudo >/dev/null || die "need root (or sudo)"
+make -C ${TOP}/ch9/miscdrv rdwr_test >/dev/null || die "building rdwr_test failed"
+
+unalias dmesg 2>/dev/null
+# don't let the printk's of the (non-verbose-param) variants hit the console
+CONSOLE_LVL=$(awk '{print $1}' /proc/sys/kernel/printk)
+sudo dmesg -n 1
+trap 'unload_all ; sudo dmesg -n ${CONSOLE_LVL}' EXIT
+
+echo "${name}: ${SECS} s per run; writes%: ${WRPCTS}; threads: ${THREADS};" \
+  "payloads: ${PAYLOADS}; raw results in ${RESULTS}"
+> ${RESULTS}
+for v in ${VARIANTS} ; do
+  mod=${v#*:}
+  unload_all
+  load_variant ${v%%:*} ${mod}
+  echo "--- ${mod}"
+  for w in ${WRPCTS} ; do
+    for t in ${THREADS} ; do
+      for p in ${PAYLOADS} ; do
+        res=$(${RDWR_TEST} 3 ${DEV} ${SECS} -t ${t} -w ${w} -s ${p} -c -q) || {
+          echo " [!] wr%=${w} threads=${t} payload=${p}: run failed, skipping"
+          continue
+        }
+        echo " wr%=${w} threads=${t} payload=${p}: ${res}"
+        echo "${w} ${t} ${p} ${mod} ${res}" >> ${RESULTS}
+      done
+    done
+  done
+done
+unload_all
+
+# The comparative table: grouped by workload, the variants one below the other
+# (fastest first)
+echo
+printf "%4s %7s %7s  %-30s %10s %9s %9s %9s %10s %8s %9s %6s\n" "wr%" "threads" \
+  "payload" "variant" "ops/s" "p50(us)" "p99(us)" "p99.9(us)" "max(us)" "cpu(s)" \
+  "cpu/op(us)" "errors"
+sort -k1,1n -k2,2n -k3,3n -k5,5nr ${RESULTS} |awk -v secs=${SECS} '
+  $1 != w || $2 != t || $3 != p { if (NR > 1) print ""; w = $1; t = $2; p = $3 }
+  { printf("%4s %7s %7s  %-30s %10s %9s %9s %9s %10s %8s %9.2f %6s\n", $1, $2, $3,
+      $4, $5, $6, $7, $8, $9, $10, ($5 > 0 ? $10 * 1e6 / ($5 * secs) : 0), $11) }'
+exit 0
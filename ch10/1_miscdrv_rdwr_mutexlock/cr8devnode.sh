@@ -7,7 +7,8 @@ OURMODNAME="miscdrv_rdwr_mutexlock"
 
 MAJOR=10   # misc class is always major # 10
 unalias dmesg 2>/dev/null
-MINOR=$(dmesg |grep "${OURMODNAME}\:minor\=" |cut -d"=" -f2)
+# the kernel log may hold earlier loads too; the last one is ours
+MINOR=$(dmesg |grep "${OURMODNAME}\:minor\=" |tail -1 |cut -d"=" -f2)
 [ -z "${MINOR}" ] && {
   echo "${name}: failed to retreive the minor #, aborting ..."
   exit 1
@@ -0,0 +1,101 @@
+/*
+ * ch10/1_miscdrv_rdwr_mutexlock/miscdrv_rdwr_ioctl.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * The ioctl 'commands' (and their data structures) understood by the
+ * miscdrv_rdwr_mutexlock driver; shared by the driver and userspace apps.
+ * GETSTATS returns the driver statistics; BATCH runs a whole array of
+ * get/set/stats operations in one go; NOTIFY registers an eventfd that's
+ * signalled on every update of the secret. The statistics are also available
+ * via an mmap-able page (struct lkdc_stats_page).
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#ifndef __MISCDRV_RDWR_IOCTL_H__
+#define __MISCDRV_RDWR_IOCTL_H__
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* The 'magic' (or 'type') byte; it should be unique to our driver. See
+ * Documentation/ioctl/ioctl-number.txt in the kernel source tree */
+#define LKDC_IOCTL_MAGIC	0xE1
+
+/* The driver statistics, as returned by the GETSTATS command */
+struct lkdc_stats {
+	__u64 tx;   /* # of bytes 'transmitted' (read by userspace) */
+	__u64 rx;   /* # of bytes 'received' (written by userspace) */
+	__u64 err;  /* # of failed read/write requests */
+};
+
+#define LKDC_IOC_GETSTATS	_IOR(LKDC_IOCTL_MAGIC, 1, struct lkdc_stats)
+
+/*
+ * The BATCH command: run an array of get / set / stats operations within a
+ * single ioctl(2), i.e., a single kernel entry (and lock round-trip), instead
+ * of one syscall each. The operations run in array order; each one's result
+ * is written back into it's 'status' member. (User pointers are passed as
+ * __u64's, so that the layout is the same for 32 and 64-bit apps).
+ */
+#define LKDC_OP_GET	1	/* copy the secret into buf; len >= 128 (MAXBYTES) */
+#define LKDC_OP_SET	2	/* buf[0..len) becomes the new secret (truncated
+				   to 127 bytes, as with the write(2)) */
+#define LKDC_OP_STATS	3	/* copy a struct lkdc_stats into buf */
+
+struct lkdc_op {
+	__u32 op;       /* LKDC_OP_xxx */
+	__u32 len;      /* size of buf */
+	__u64 buf;      /* (user) buffer */
+	__s64 status;   /* out: # of bytes transferred, or a -ve errno */
+};
+
+#define LKDC_BATCH_MAX	1024	/* max # of operations per BATCH ioctl */
+struct lkdc_batch {
+	__u64 ops;      /* (user) pointer to an array of struct lkdc_op */
+	__u32 nops;     /* # of entries in it; 1..LKDC_BATCH_MAX */
+	__u32 nerr;     /* out: # of operations that failed */
+};
+
+#define LKDC_IOC_BATCH		_IOWR(LKDC_IOCTL_MAGIC, 2, struct lkdc_batch)
+
+/*
+ * The NOTIFY command: register an eventfd(2) - pass a pointer to it's fd -
+ * with the device; every successful update of the secret (a write(2), a
+ * writev(2), a BATCH with a SET in it) then signals it, i.e., adds 1 to it's
+ * count. So, apps can wait for changes to the secret with poll/epoll (along
+ * with their other fds) instead of re-reading it in a loop. A registration
+ * belongs to the open file it's made on; it's dropped when that's closed, or
+ * explicitly, by passing an fd of -1 (this drops all of them).
+ */
+#define LKDC_NOTIFY_MAX	64	/* max # of eventfd's registered (in all) */
+#define LKDC_IOC_NOTIFY		_IOW(LKDC_IOCTL_MAGIC, 3, __s32)
+
+/*
+ * The statistics page. The driver allows userspace to mmap() it (read-only,
+ * a single page at offset 0); while it's mapped, the driver republishes the
+ * stats into it every stats_interval_ms milliseconds (a module parameter). A
+ * monitor can thus poll the stats with plain memory loads, without entering
+ * the kernel at all.
+ * 'seq' is a sequence count: the driver makes it odd just before it updates
+ * the page and even again once it's done. Thus, a consistent snapshot is had
+ * by:
+ *  read seq; if odd, retry; copy the stats; re-read seq; if changed, retry.
+ * (Much like the kernel's own seqcount; of course, there's no lock here).
+ */
+struct lkdc_stats_page {
+	__u32 seq;
+	__s32 ga, gb;   /* # of opens (ga) and it's 'inverse' (gb = 1 - ga) */
+	__u32 pad;
+	struct lkdc_stats st;
+};
+
+#endif   /* #ifndef __MISCDRV_RDWR_IOCTL_H__ */
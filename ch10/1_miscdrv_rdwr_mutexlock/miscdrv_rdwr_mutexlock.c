@@ -18,6 +18,18 @@
  * by using the mutex lock to protect the critical sections - the places in the
  * code where we access global / shared writeable data.
  * The functionality (the get and set of the 'secret') remains identical.
+ * The statistics (tx, rx, err) are kept per-CPU, so counting bytes on the data
+ * path takes no shared lock; they're folded (summed) only when an app asks
+ * for them via the GETSTATS ioctl (see miscdrv_rdwr_ioctl.h).
+ * The BATCH ioctl lets an app run many gets/sets (and stats queries) in a
+ * single syscall.
+ * Monitors can also mmap() a read-only statistics page; while it's mapped, a
+ * delayed work folds the per-CPU stats into it periodically, bracketed by a
+ * sequence count, so that the stats can be polled with no kernel entry.
+ * Apps that need to react to changes of the secret can register an eventfd
+ * (the NOTIFY ioctl); every successful update signals all registered ones.
+ * The methods record their latency (and the request sizes) in per-CPU
+ * histograms, viewable via debugfs (see lkdc_misc_hist.h).
  *
  * For details, please refer the book, Ch 10.
  */
@@ -25,8 +37,9 @@
 #include <linux/module.h>
 #include <linux/miscdevice.h>
 #include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
-#include <linux/mm.h>           // kvmalloc()
 #include <linux/fs.h>		// the fops structure
+#include <linux/mm.h>           // remap_pfn_range()
+#include <linux/uio.h>		// struct iov_iter, copy_[to|from]_iter()
 
 // copy_[to|from]_user()
 #include <linux/version.h>
@@ -37,7 +50,19 @@
 #endif
 
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/eventfd.h>
+#include <linux/list.h>
 #include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+#include "../../lkdc_misc_iter.h"
+#include "../../lkdc_misc_hist.h"
+#include "miscdrv_rdwr_ioctl.h"
 
 #define OURMODNAME   "miscdrv_rdwr_mutexlock"
 
@@ -46,6 +71,12 @@ MODULE_DESCRIPTION("LKDC book:ch10/1_miscdrv_rdwr_mutexlock: simple misc char dr
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_VERSION("0.1");
 
+static unsigned int stats_interval_ms = 1;
+module_param(stats_interval_ms, uint, 0644);
+MODULE_PARM_DESC(stats_interval_ms,
+ "While the stats page is mmap-ed, republish the stats into it every this many"
+ " milliseconds (rounded up to a jiffy; default 1)");
+
 static int ga, gb = 1;
 DEFINE_MUTEX(lock1); // this mutex lock protects the global integers ga and gb
 
@@ -53,14 +84,136 @@ DEFINE_MUTEX(lock1); // this mutex lock protects the global integers ga and gb
  * all relevant 'state info' reg the driver is here.
  */
 struct drv_ctx {
-	int tx, rx, err, myword;
+	int myword;
 	u32 config1, config2;
 	u64 config3;
 #define MAXBYTES    128
 	char oursecret[MAXBYTES];
-	struct mutex lock;  // this mutex protects this data structure
+	struct mutex lock;  // this mutex protects this data structure ...
+	/* ... except for the stats; every CPU updates only it's own copy (with
+	 * preemption-safe this_cpu_*() ops), so they need no lock at all */
+	struct lkdc_stats __percpu *stats;
+	/* The mmap-able stats page; only the stats_work function writes it */
+	struct lkdc_stats_page *statpage;
+	struct delayed_work stats_work;
+	atomic_t nmaps;     // # of mappings of the stats page
+	/* The eventfd's to signal on an update of the secret */
+	struct list_head notify_list;
+	int nnotify;
+	spinlock_t notify_lock;  // protects the list and the count
 };
 static struct drv_ctx *ctx;
+/* Method latency and request size histograms; see lkdc_misc_hist.h */
+static struct lkdc_hist hist;
+
+/* A registered eventfd, and the open file it was registered on */
+struct notify_ent {
+	struct list_head list;
+	struct eventfd_ctx *evctx;
+	struct file *filp;
+};
+
+#define STATS_ADD(member, n)	this_cpu_add(ctx->stats->member, (n))
+#define STATS_INC_ERR()		this_cpu_inc(ctx->stats->err)
+
+/* Fold (sum) the per-CPU stats into 'st' */
+static void fold_stats(struct lkdc_stats *st)
+{
+	const struct lkdc_stats *pcs;
+	int cpu;
+
+	memset(st, 0, sizeof(*st));
+	for_each_possible_cpu(cpu) {
+		pcs = per_cpu_ptr(ctx->stats, cpu);
+		st->tx += READ_ONCE(pcs->tx);
+		st->rx += READ_ONCE(pcs->rx);
+		st->err += READ_ONCE(pcs->err);
+	}
+}
+
+/*
+ * publish_stats()
+ * The stats_work function: fold the stats and publish them - and the open
+ * count - in the stats page, as per the 'seq' protocol (see
+ * miscdrv_rdwr_ioctl.h). As this is the one and only writer of the page, it
+ * needs no lock. It re-arms itself for as long as the page remains mapped.
+ */
+static void publish_stats(struct work_struct *work)
+{
+	struct lkdc_stats_page *sp = ctx->statpage;
+	struct lkdc_stats st;
+
+	fold_stats(&st);
+
+	WRITE_ONCE(sp->seq, sp->seq + 1);  /* odd: update in progress */
+	smp_wmb();
+	sp->st = st;
+	sp->ga = READ_ONCE(ga); // a dirty read's fine; it's a snapshot anyway
+	sp->gb = READ_ONCE(gb);
+	smp_wmb();
+	WRITE_ONCE(sp->seq, sp->seq + 1);  /* even: stable */
+
+	if (atomic_read(&ctx->nmaps))
+		schedule_delayed_work(&ctx->stats_work,
+			msecs_to_jiffies(stats_interval_ms) ? : 1);
+}
+
+/*
+ * notify_update()
+ * Signal all the registered eventfd's; called after every successful update
+ * of the secret, outside the mutex. eventfd_signal() merely bumps a counter
+ * and wakes up the waiters (if any); it doesn't sleep, so a spinlock will do.
+ */
+static void notify_update(void)
+{
+	struct notify_ent *ne;
+
+	/* The common case - no one's registered - costs just this check; a
+	 * registration racing with it just misses this one update */
+	if (list_empty(&ctx->notify_list))
+		return;
+	spin_lock(&ctx->notify_lock);
+	list_for_each_entry(ne, &ctx->notify_list, list)
+		eventfd_signal(ne->evctx, 1);
+	spin_unlock(&ctx->notify_lock);
+}
+
+/* Drop all the eventfd's registered on the given open file */
+static void notify_drop(struct file *filp)
+{
+	struct notify_ent *ne, *tmp;
+	LIST_HEAD(dropped);
+
+	spin_lock(&ctx->notify_lock);
+	list_for_each_entry_safe(ne, tmp, &ctx->notify_list, list) {
+		if (ne->filp == filp) {
+			list_move(&ne->list, &dropped);
+			ctx->nnotify--;
+		}
+	}
+	spin_unlock(&ctx->notify_lock);
+
+	list_for_each_entry_safe(ne, tmp, &dropped, list) {
+		eventfd_ctx_put(ne->evctx);
+		kfree(ne);
+	}
+}
+
+/* Track the mappings of the stats page (fork(2) copies them, for example) */
+static void stats_vm_open(struct vm_area_struct *vma)
+{
+	atomic_inc(&ctx->nmaps);
+}
+
+static void stats_vm_close(struct vm_area_struct *vma)
+{
+	atomic_dec(&ctx->nmaps);
+}
+
+static const struct vm_operations_struct stats_vm_ops = {
+	.open = stats_vm_open,
+	.close = stats_vm_close,
+};
 
 /*--- The driver 'methods' follow ---*/
 /*
@@ -73,19 +226,23 @@ static struct drv_ctx *ctx;
  */
 static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-	PRINT_CTX(); // displays process (or intr) context info
+	u64 t0 = lkdc_hist_start();
+
+	VPRINT_CTX(); // displays process (or intr) context info
 
 	mutex_lock(&lock1);
 	ga ++; gb --;
 	mutex_unlock(&lock1);
 
-	pr_info("%s:%s():\n"
+	vpr_info("%s:%s():\n"
 		" filename: \"%s\"\n"
 		" wrt open file: f_flags = 0x%x\n"
 		" ga = %d, gb = %d\n",
 	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 	       filp->f_flags, ga, gb);
 
+	lkdc_hist_record(&hist, LKDC_H_OPEN, t0, 0);
+	trace_lkdc_open(OURMODNAME, filp);
 	return 0;
 }
 
@@ -101,14 +258,15 @@ static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 				size_t count, loff_t *off)
 {
+	u64 t0 = lkdc_hist_start();
 	int ret = count, secret_len;
 
 	mutex_lock(&ctx->lock);
 	secret_len = strlen(ctx->oursecret);
 	mutex_unlock(&ctx->lock);
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
 	ret = -EINVAL;
@@ -116,12 +274,14 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 		pr_warn("%s:%s(): request # of bytes (%ld) is < required size"
 			" (%d), aborting read\n",
 				OURMODNAME, __func__, count, MAXBYTES);
+		STATS_INC_ERR();
 		goto out_notok;
 	}
 	if (secret_len <= 0) {
 		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
 			" available..; aborting read\n",
 			OURMODNAME, __func__);
+		STATS_INC_ERR();
 		goto out_notok;
 	}
 
@@ -140,17 +300,19 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 	mutex_lock(&ctx->lock);
 	if (copy_to_user(ubuf, ctx->oursecret, secret_len)) {
 		pr_warn("%s:%s(): copy_to_user() failed\n", OURMODNAME, __func__);
-		goto out_ctu;
+		mutex_unlock(&ctx->lock);
+		STATS_INC_ERR();
+		goto out_notok;
 	}
+	mutex_unlock(&ctx->lock);
 	ret = secret_len;
 
-	// Update stats
-	ctx->tx += secret_len; // our 'transmit' is wrt this driver
-	pr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
-			secret_len, ctx->tx, ctx->rx);
-out_ctu:
-	mutex_unlock(&ctx->lock);
+	// Update stats; outside the lock, it's per-CPU
+	STATS_ADD(tx, secret_len); // our 'transmit' is wrt this driver
+	vpr_info(" %d bytes read, returning...\n", secret_len);
 out_notok:
+	lkdc_hist_record(&hist, LKDC_H_READ, t0, count);
+	trace_lkdc_read(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -166,33 +328,32 @@ out_notok:
 static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 				size_t count, loff_t *off)
 {
+	u64 t0 = lkdc_hist_start();
 	int ret;
-	void *kbuf = NULL;
+	size_t n = (count > MAXBYTES ? MAXBYTES : count);
+	char kbuf[MAXBYTES + 1];
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to write %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
-	ret = -ENOMEM;
-	kbuf = kvmalloc(count, GFP_KERNEL);
-	if (unlikely(!kbuf)) {
-		pr_warn("%s:%s(): kvmalloc() failed!\n", OURMODNAME, __func__);
-		goto out_nomem;
-	}
-	memset(kbuf, 0, count);
-
 	/* Copy in the user supplied buffer 'ubuf' - the data content to write -
 	 * via the copy_from_user() macro.
 	 * (FYI, the copy_from_user() macro is the *right* way to copy data from
 	 * userspace to kernel-space; the parameters are:
 	 *  'to-buffer', 'from-buffer', count
 	 *  Returns 0 on success, i.e., non-zero return implies an I/O fault).
+	 * We only ever keep (upto) MAXBYTES of it; so, that's all we copy in,
+	 * into a small on-stack buffer - there's no need to allocate (and free)
+	 * memory on every write.
 	 */
 	ret = -EFAULT;
-	if (copy_from_user(kbuf, ubuf, count)) {
+	if (copy_from_user(kbuf, ubuf, n)) {
 		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
+		STATS_INC_ERR();
 		goto out_cfu;
 	}
+	kbuf[n] = '\0';
 
 	/* In a 'real' driver, we would now actually write (for 'count' bytes)
 	 * the content of the 'ubuf' buffer to the device hardware (or whatever),
@@ -201,22 +362,108 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	 * new 'secret' into our driver 'context' structure, and unlock.
 	 */
 	mutex_lock(&ctx->lock);
-	strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+	strlcpy(ctx->oursecret, kbuf, n);
 #if 0
 	print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
 				ctx, sizeof(struct drv_ctx));
 #endif
-	// Update stats
-	ctx->rx += count; // our 'receive' is wrt userspace
+	mutex_unlock(&ctx->lock);
+
+	// Update stats; outside the lock, it's per-CPU
+	STATS_ADD(rx, count); // our 'receive' is wrt userspace
+	notify_update();
 
 	ret = count;
-	pr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
-		count, ctx->tx, ctx->rx);
-	mutex_unlock(&ctx->lock);
+	vpr_info(" %ld bytes written, returning...\n", count);
 
 out_cfu:
-	kvfree(kbuf);
-out_nomem:
+	lkdc_hist_record(&hist, LKDC_H_WRITE, t0, count);
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * read_iter_miscdrv_rdwr()
+ * The vectored read; as in ch9/miscdrv_rdwr (which see): each segment is a
+ * separate read request. Here, the mutex is held across all the segments, so
+ * that a single syscall costs a single lock round-trip.
+ */
+static ssize_t read_iter_miscdrv_rdwr(struct kiocb *iocb, struct iov_iter *to)
+{
+	u64 t0 = lkdc_hist_start();
+	size_t count = iov_iter_count(to);
+	ssize_t ret = -EINVAL;
+	int secret_len;
+	bool aborted;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, to->nr_segs);
+
+	mutex_lock(&ctx->lock);
+	secret_len = strlen(ctx->oursecret);
+	if (secret_len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		goto out_unlock;
+	}
+
+	ret = lkdc_iter_read(to, ctx->oursecret, secret_len, MAXBYTES,
+			     OURMODNAME, &aborted);
+out_unlock:
+	mutex_unlock(&ctx->lock);
+
+	if (ret > 0) {
+		// Update stats; outside the lock, it's per-CPU
+		STATS_ADD(tx, ret); // our 'transmit' is wrt userspace
+		vpr_info(" %zd bytes read, returning...\n", ret);
+	} else if (ret < 0)
+		STATS_INC_ERR();
+	lkdc_hist_record(&hist, LKDC_H_READ, t0, count);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/* write_iter: the lkdc_iter_write() callback; with ctx->lock held */
+static void set_secret_seg(void *arg, const char *kbuf, size_t n, size_t seglen)
+{
+	strlcpy(ctx->oursecret, kbuf, n);
+}
+
+/*
+ * write_iter_miscdrv_rdwr()
+ * The vectored write; as in ch9/miscdrv_rdwr (which see): each segment in turn
+ * becomes the secret (truncated to MAXBYTES). Here, under the one mutex
+ * round-trip, with the stats and the update notification after it.
+ */
+static ssize_t write_iter_miscdrv_rdwr(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	u64 t0 = lkdc_hist_start();
+	size_t count = iov_iter_count(from);
+	char kbuf[MAXBYTES + 1];
+	ssize_t ret;
+	bool aborted;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, from->nr_segs);
+
+	mutex_lock(&ctx->lock);
+	ret = lkdc_iter_write(from, kbuf, MAXBYTES, set_secret_seg, NULL,
+			      OURMODNAME, &aborted);
+	mutex_unlock(&ctx->lock);
+
+	if (ret > 0) {
+		// Update stats; outside the lock, it's per-CPU
+		STATS_ADD(rx, ret); // our 'receive' is wrt userspace
+		notify_update();
+		vpr_info(" %zd bytes written, returning...\n", ret);
+	} else if (ret < 0)
+		STATS_INC_ERR();
+	lkdc_hist_record(&hist, LKDC_H_WRITE, t0, count);
+	trace_lkdc_write(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -228,31 +475,252 @@ out_nomem:
  */
 static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-        PRINT_CTX(); // displays process (or intr) context info
+	u64 t0 = lkdc_hist_start();
+
+        VPRINT_CTX(); // displays process (or intr) context info
 
 	mutex_lock(&lock1);
 	ga --; gb ++;
 	mutex_unlock(&lock1);
 
-        pr_info("%s:%s(): filename: \"%s\"\n"
+        vpr_info("%s:%s(): filename: \"%s\"\n"
 		" ga = %d, gb = %d\n",
 			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 			ga, gb);
+	notify_drop(filp);
+	lkdc_hist_record(&hist, LKDC_H_RELEASE, t0, 0);
+        trace_lkdc_release(OURMODNAME, filp);
         return 0;
 }
 
+/*
+ * mmap_miscdrv_rdwr()
+ * The driver's mmap 'method': map the (single, read-only) stats page into the
+ * caller's address space. The first mapping kicks off the periodic publishing
+ * of the stats into it; it stops once the last mapping goes away.
+ */
+static int mmap_miscdrv_rdwr(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long len = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (vma->vm_pgoff || len > PAGE_SIZE) {
+		pr_warn("%s:%s(): only a single page at offset 0 can be mapped\n",
+			OURMODNAME, __func__);
+		return -EINVAL;
+	}
+	/* Only the driver writes the stats; disallow writable mappings, now or
+	 * later (via mprotect(2)) */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(ctx->statpage) >> PAGE_SHIFT,
+			len, vma->vm_page_prot);
+	if (ret)
+		return ret;
+	vma->vm_ops = &stats_vm_ops;
+	if (atomic_inc_return(&ctx->nmaps) == 1)
+		schedule_delayed_work(&ctx->stats_work, 0);
+	return 0;
+}
+
+/*
+ * do_batch_op()
+ * Run a single operation of a BATCH; the caller holds the mutex. Returns the
+ * # of bytes transferred or a -ve errno (this becomes the op's status).
+ */
+static long do_batch_op(const struct lkdc_op *op)
+{
+	void __user *ubuf = u64_to_user_ptr(op->buf);
+	char kbuf[MAXBYTES + 1];
+	struct lkdc_stats st;
+	int secret_len;
+	size_t n;
+
+	switch (op->op) {
+	case LKDC_OP_GET:   // just as with the read(2)
+		if (op->len < MAXBYTES)
+			return -EINVAL;
+		secret_len = strlen(ctx->oursecret);
+		if (secret_len <= 0)
+			return -EINVAL;
+		if (copy_to_user(ubuf, ctx->oursecret, secret_len))
+			return -EFAULT;
+		return secret_len;
+	case LKDC_OP_SET:   // just as with the write(2)
+		n = (op->len > MAXBYTES ? MAXBYTES : op->len);
+		if (copy_from_user(kbuf, ubuf, n))
+			return -EFAULT;
+		kbuf[n] = '\0';
+		strlcpy(ctx->oursecret, kbuf, n);
+		return op->len;
+	case LKDC_OP_STATS:
+		if (op->len < sizeof(st))
+			return -EINVAL;
+		fold_stats(&st);
+		if (copy_to_user(ubuf, &st, sizeof(st)))
+			return -EFAULT;
+		return sizeof(st);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * ioctl_batch()
+ * The BATCH command. We copy in the app's operations a chunk at a time, run
+ * the chunk with the mutex taken just once, and copy the chunk (now with the
+ * status of each op filled in) back out. The stats are updated just once, at
+ * the end. So, N small gets/sets cost one syscall and N/BATCH_CHUNK lock
+ * round-trips, instead of N of each.
+ * A failing op doesn't stop the batch; the return value is 0 unless the
+ * batch itself is bad (or it's op array can't be accessed).
+ */
+#define BATCH_CHUNK	16	/* # of ops we copy in (and out) at a time */
+static long ioctl_batch(struct lkdc_batch __user *ubatch)
+{
+	struct lkdc_op ops[BATCH_CHUNK];
+	struct lkdc_op __user *uops;
+	struct lkdc_batch batch;
+	u32 i, j, n, nerr = 0;
+	u64 ntx = 0, nrx = 0;
+	long ret = 0;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (!batch.nops || batch.nops > LKDC_BATCH_MAX)
+		return -EINVAL;
+	uops = u64_to_user_ptr(batch.ops);
+	vpr_info("%s:%s(): %s: batch of %u op(s)\n",
+		OURMODNAME, __func__, current->comm, batch.nops);
+
+	for (i = 0; i < batch.nops; i += n) {
+		n = min_t(u32, batch.nops - i, BATCH_CHUNK);
+		if (copy_from_user(ops, uops + i, n * sizeof(*ops))) {
+			ret = -EFAULT;
+			break;
+		}
+		mutex_lock(&ctx->lock);
+		for (j = 0; j < n; j++) {
+			ops[j].status = do_batch_op(&ops[j]);
+			if (ops[j].status < 0)
+				nerr++;
+			else if (ops[j].op == LKDC_OP_GET)
+				ntx += ops[j].status;
+			else if (ops[j].op == LKDC_OP_SET)
+				nrx += ops[j].status;
+		}
+		mutex_unlock(&ctx->lock);
+		if (copy_to_user(uops + i, ops, n * sizeof(*ops))) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+
+	// Update stats; once per batch
+	STATS_ADD(tx, ntx);
+	STATS_ADD(rx, nrx);
+	STATS_ADD(err, nerr);
+	if (nrx)   // the secret was updated (at least once)
+		notify_update();
+	if (ret)
+		return ret;
+	if (put_user(nerr, &ubatch->nerr))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * ioctl_notify()
+ * The NOTIFY command. We take a reference on the eventfd (so that it stays
+ * valid even if the app closes it's fd) and add it to the list; it's dropped
+ * when the open file it was registered on is closed (or on an fd of -1).
+ */
+static long ioctl_notify(struct file *filp, int __user *uarg)
+{
+	struct eventfd_ctx *evctx;
+	struct notify_ent *ne;
+	int fd;
+
+	if (get_user(fd, uarg))
+		return -EFAULT;
+	if (fd < 0) {
+		notify_drop(filp);
+		return 0;
+	}
+	evctx = eventfd_ctx_fdget(fd);
+	if (IS_ERR(evctx))
+		return PTR_ERR(evctx);
+	ne = kmalloc(sizeof(*ne), GFP_KERNEL);
+	if (unlikely(!ne)) {
+		eventfd_ctx_put(evctx);
+		return -ENOMEM;
+	}
+	ne->evctx = evctx;
+	ne->filp = filp;
+
+	spin_lock(&ctx->notify_lock);
+	if (ctx->nnotify >= LKDC_NOTIFY_MAX) {
+		spin_unlock(&ctx->notify_lock);
+		eventfd_ctx_put(evctx);
+		kfree(ne);
+		return -ENOSPC;
+	}
+	list_add_tail(&ne->list, &ctx->notify_list);
+	ctx->nnotify++;
+	spin_unlock(&ctx->notify_lock);
+	vpr_info("%s:%s(): %s: eventfd %d registered\n",
+		OURMODNAME, __func__, current->comm, fd);
+	return 0;
+}
+
+/*
+ * ioctl_miscdrv_rdwr()
+ * The driver's (unlocked) ioctl 'method'. We support these 'commands':
+ *  LKDC_IOC_GETSTATS : fold the per-CPU stats and return them (as a
+ *                      struct lkdc_stats) to the calling app.
+ *  LKDC_IOC_BATCH    : run an array of get/set/stats operations in one go;
+ *                      see ioctl_batch().
+ *  LKDC_IOC_NOTIFY   : register an eventfd to signal on updates of the
+ *                      secret (or drop them all); see ioctl_notify().
+ */
+static long ioctl_miscdrv_rdwr(struct file *filp, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct lkdc_stats st;
+
+	switch (cmd) {
+	case LKDC_IOC_GETSTATS:
+		fold_stats(&st);
+		if (copy_to_user((void __user *)arg, &st, sizeof(st))) {
+			pr_warn("%s:%s(): copy_to_user() failed\n",
+				OURMODNAME, __func__);
+			return -EFAULT;
+		}
+		return 0;
+	case LKDC_IOC_BATCH:
+		return ioctl_batch((struct lkdc_batch __user *)arg);
+	case LKDC_IOC_NOTIFY:
+		return ioctl_notify(filp, (int __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,   // a mapping of the stats page pins the module
 	.open = open_miscdrv_rdwr,
 	.read = read_miscdrv_rdwr,
 	.write = write_miscdrv_rdwr,
+	.read_iter = read_iter_miscdrv_rdwr,
+	.write_iter = write_iter_miscdrv_rdwr,
+	.unlocked_ioctl = ioctl_miscdrv_rdwr, // GETSTATS, BATCH and NOTIFY
+	.mmap = mmap_miscdrv_rdwr,       // the (read-only) stats page
 	.llseek = no_llseek,             // dummy, we don't support lseek(2)
 	.release = close_miscdrv_rdwr,
-	/* As you learn more reg device drivers, you'll realize that the
-	 * ioctl() would be a very useful method here. As an exercise,
-	 * implement an ioctl method; when issued with the 'GETSTATS' 'command',
-	 * it should return the statistics (tx, rx, errors) to the calling app
-	 */
 };
 
 static struct miscdevice lkdc_miscdev = {
@@ -264,12 +732,50 @@ static struct miscdevice lkdc_miscdev = {
 
 static int __init miscdrv_init_mutexlock(void)
 {
-	int ret;
+	int ret = -ENOMEM;
+
+	/* Set up the context - all of it - before registering the device; once
+	 * registered, it can be opened (and mmap-ed, written to, ...) right away */
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	ctx->stats = alloc_percpu(struct lkdc_stats);
+	if (unlikely(!ctx->stats)) {
+		pr_notice("%s: alloc_percpu failed! aborting\n", OURMODNAME);
+		goto out_stats;
+	}
+	/* A whole page, as that's the unit of mapping; it must not share the
+	 * page with anything else, lest that get exposed to userspace */
+	ctx->statpage = (struct lkdc_stats_page *)get_zeroed_page(GFP_KERNEL);
+	if (unlikely(!ctx->statpage)) {
+		pr_notice("%s: get_zeroed_page failed! aborting\n", OURMODNAME);
+		goto out_page;
+	}
+	ret = lkdc_hist_init(&hist, OURMODNAME);
+	if (ret) {
+		pr_notice("%s: lkdc_hist_init failed! aborting\n", OURMODNAME);
+		goto out_hist;
+	}
+	INIT_DELAYED_WORK(&ctx->stats_work, publish_stats);
+	atomic_set(&ctx->nmaps, 0);
+	INIT_LIST_HEAD(&ctx->notify_list);
+	spin_lock_init(&ctx->notify_lock);
+	mutex_init(&ctx->lock);
+	strlcpy(ctx->oursecret, "initmsg", 8);
+		/* Why don't we protect the above strlcpy() with the mutex lock?
+		 * It's working on shared writable data, yes?
+		 * No; this is the init code; it's guaranteed to run in exactly
+		 * one context (typically the insmod(8) process), thus there is
+		 * no concurrency possible here (the device isn't registered yet).
+		 * The same goes for the cleanup code path.
+		 */
 
 	if ((ret = misc_register(&lkdc_miscdev))) {
 		pr_notice("%s: misc device registration failed, aborting\n",
 			       OURMODNAME);
-		return ret;
+		goto out_reg;
 	}
 	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
 			OURMODNAME, lkdc_miscdev.minor);
@@ -288,30 +794,33 @@ static int __init miscdrv_init_mutexlock(void)
 	 */
 	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
 
-	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
-	if (unlikely(!ctx)) {
-		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
-		return -ENOMEM;
-	}
-	mutex_init(&ctx->lock);
-	strlcpy(ctx->oursecret, "initmsg", 8);
-		/* Why don't we protect the above strlcpy() with the mutex lock?
-		 * It's working on shared writable data, yes?
-		 * No; this is the init code; it's guaranteed to run in exactly
-		 * one context (typically the insmod(8) process), thus there is
-		 * no concurrency possible here. The same goes for the cleanup
-		 * code path.
-		 */
-
 	return 0;		/* success */
+
+out_reg:
+	mutex_destroy(&ctx->lock);
+	lkdc_hist_exit(&hist);
+out_hist:
+	free_page((unsigned long)ctx->statpage);
+out_page:
+	free_percpu(ctx->stats);
+out_stats:
+	kfree(ctx);
+	return ret;
 }
 
 static void __exit miscdrv_exit_mutexlock(void)
 {
+	/* Deregister first: no new opens from here on */
+	misc_deregister(&lkdc_miscdev);
 	mutex_destroy(&lock1);
 	mutex_destroy(&ctx->lock);
+	/* No mappings remain (they'd hold a module reference); the work may
+	 * still be pending though */
+	cancel_delayed_work_sync(&ctx->stats_work);
+	free_page((unsigned long)ctx->statpage);
+	lkdc_hist_exit(&hist);
+	free_percpu(ctx->stats);
 	kzfree(ctx);
-	misc_deregister(&lkdc_miscdev);
 	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
 }
 
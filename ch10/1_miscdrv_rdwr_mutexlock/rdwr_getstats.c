@@ -0,0 +1,54 @@
+/*
+ * ch10/1_miscdrv_rdwr_mutexlock/rdwr_getstats.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * A small userspace app to retrieve the driver statistics (tx, rx, err) from
+ * the miscdrv_rdwr_mutexlock driver, via it's GETSTATS ioctl.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "miscdrv_rdwr_ioctl.h"
+
+int main(int argc, char **argv)
+{
+	struct lkdc_stats st;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s device_file\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((fd = open(argv[1], O_RDONLY, 0)) == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[1]);
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	if (ioctl(fd, LKDC_IOC_GETSTATS, &st) < 0) {
+		perror("ioctl GETSTATS failed");
+		fprintf(stderr, "Tip: see kernel log\n");
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	printf("%s: stats: tx=%llu, rx=%llu, err=%llu\n", argv[1],
+		(unsigned long long)st.tx, (unsigned long long)st.rx,
+		(unsigned long long)st.err);
+
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
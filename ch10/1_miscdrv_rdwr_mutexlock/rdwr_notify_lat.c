@@ -0,0 +1,163 @@
+/*
+ * ch10/1_miscdrv_rdwr_mutexlock/rdwr_notify_lat.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * Measures the change notification latency of the miscdrv_rdwr_mutexlock
+ * driver: a waiter thread registers an eventfd with the device (the NOTIFY
+ * ioctl) and sleeps on it in epoll_wait(2); the main thread then updates the
+ * secret via write(2), <count> times, and we record the time from (just
+ * before) the write(2) to the waiter being woken up. The latencies are
+ * reported as the median, 99th percentile and max (in us).
+ * Tip: load the driver with verbose=0, else the printk's dominate.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "miscdrv_rdwr_ioctl.h"
+
+static int devfd, efd;
+static volatile double t_wake;   /* set by the waiter on every wakeup */
+static volatile int waiting, done;
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file [count]\n"
+			" Updates the secret <count> times (default 1000), measuring the time\n"
+			" from the write(2) to an epoll_wait(2)-ing thread's wakeup.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *waiter(void *arg)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	uint64_t cnt;
+	int epfd;
+
+	epfd = epoll_create1(0);
+	if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) < 0) {
+		perror("waiter: epoll");
+		exit(EXIT_FAILURE);
+	}
+	while (!done) {
+		waiting = 1;
+		if (epoll_wait(epfd, &ev, 1, 100) <= 0)
+			continue;   /* timed out; check if we're done */
+		t_wake = now_sec();
+		waiting = 0;
+		if (read(efd, &cnt, sizeof(cnt)) != sizeof(cnt)) {
+			perror("waiter: read eventfd");
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(epfd);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t tid;
+	double *lat, t0;
+	long count, i;
+	char msg[32];
+	int n;
+
+	if (argc < 2 || argc > 3) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	count = (argc == 3 ? atol(argv[2]) : 1000);
+	if (count <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	lat = malloc(count * sizeof(double));
+	if (!lat) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((devfd = open(argv[1], O_RDWR, 0)) == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[1]);
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0) {
+		perror("eventfd");
+		exit(EXIT_FAILURE);
+	}
+	if (ioctl(devfd, LKDC_IOC_NOTIFY, &efd) < 0) {
+		perror("ioctl NOTIFY failed");
+		exit(EXIT_FAILURE);
+	}
+	if (pthread_create(&tid, NULL, waiter, NULL)) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < count; i++) {
+		/* let the waiter get to sleep in epoll_wait() */
+		while (!waiting)
+			;
+		usleep(1000);
+		t_wake = 0;
+		n = snprintf(msg, sizeof(msg), "secret-%ld", i);
+		t0 = now_sec();
+		if (write(devfd, msg, n) < 0) {
+			perror("write failed");
+			exit(EXIT_FAILURE);
+		}
+		while (!t_wake)
+			;
+		lat[i] = (t_wake - t0) * 1e6;
+	}
+	done = 1;
+	pthread_join(tid, NULL);
+
+	qsort(lat, count, sizeof(double), cmp_double);
+	printf("%s: %ld notifications; write(2) -> wakeup latency (us):"
+		" p50 %.1f  p99 %.1f  max %.1f\n", argv[0], count,
+		lat[count / 2], lat[(count * 99) / 100], lat[count - 1]);
+
+	free(lat);
+	close(efd);
+	close(devfd);
+	exit(EXIT_SUCCESS);
+}
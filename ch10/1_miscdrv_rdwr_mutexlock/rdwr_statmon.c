@@ -0,0 +1,137 @@
+/*
+ * ch10/1_miscdrv_rdwr_mutexlock/rdwr_statmon.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * A stats monitor for the miscdrv_rdwr_mutexlock driver: it mmap()s the
+ * driver's (read-only) stats page and polls it - with plain memory loads,
+ * no syscalls - every <interval_ms>, printing the stats and their rates.
+ * To begin with, it compares the cost of a snapshot of the page with that of
+ * a GETSTATS ioctl(2).
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include "miscdrv_rdwr_ioctl.h"
+
+#define NLOOPS	1000000
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file [interval_ms [count]]\n"
+			" Polls the driver's mmap-ed stats page every <interval_ms> (default\n"
+			" 1000) and prints the stats, <count> times (default: forever).\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Take a consistent snapshot of the stats page; see miscdrv_rdwr_ioctl.h */
+static void snapshot(const volatile struct lkdc_stats_page *sp,
+		     struct lkdc_stats_page *snap)
+{
+	__u32 seq;
+
+	do {
+		while ((seq = sp->seq) & 1)
+			;   /* an update's in progress */
+		__sync_synchronize();
+		snap->ga = sp->ga;
+		snap->gb = sp->gb;
+		snap->st.tx = sp->st.tx;
+		snap->st.rx = sp->st.rx;
+		snap->st.err = sp->st.err;
+		__sync_synchronize();
+	} while (sp->seq != seq);
+	snap->seq = seq;
+}
+
+int main(int argc, char **argv)
+{
+	struct lkdc_stats_page *sp, snap, prev;
+	struct lkdc_stats st;
+	long interval_ms, count, i;
+	double t;
+	int fd;
+
+	if (argc < 2 || argc > 4) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	interval_ms = (argc >= 3 ? atol(argv[2]) : 1000);
+	count = (argc == 4 ? atol(argv[3]) : -1);
+	if (interval_ms <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if ((fd = open(argv[1], O_RDONLY, 0)) == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[1]);
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	sp = mmap(NULL, sizeof(*sp), PROT_READ, MAP_SHARED, fd, 0);
+	if (sp == MAP_FAILED) {
+		perror("mmap failed");
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	/* The driver publishes the first snapshot right away */
+	usleep(100 * 1000);
+
+	t = now_sec();
+	for (i = 0; i < NLOOPS; i++)
+		snapshot(sp, &snap);
+	t = now_sec() - t;
+	printf("%s: stats page snapshot: %8.1f ns", argv[0], t / NLOOPS * 1e9);
+	t = now_sec();
+	for (i = 0; i < NLOOPS / 10; i++) {
+		if (ioctl(fd, LKDC_IOC_GETSTATS, &st) < 0) {
+			perror("ioctl GETSTATS failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+	t = now_sec() - t;
+	printf("   GETSTATS ioctl: %8.1f ns\n", t / (NLOOPS / 10) * 1e9);
+
+	snapshot(sp, &prev);
+	printf("        seq   ga   gb             tx             rx        err"
+		"     tx/s     rx/s\n");
+	for (i = 0; count < 0 || i < count; i++) {
+		usleep(interval_ms * 1000);
+		snapshot(sp, &snap);
+		printf(" %10u %4d %4d %14llu %14llu %10llu %8.0f %8.0f\n",
+			snap.seq, snap.ga, snap.gb,
+			(unsigned long long)snap.st.tx,
+			(unsigned long long)snap.st.rx,
+			(unsigned long long)snap.st.err,
+			(snap.st.tx - prev.st.tx) * 1000.0 / interval_ms,
+			(snap.st.rx - prev.st.rx) * 1000.0 / interval_ms);
+		prev = snap;
+	}
+
+	munmap(sp, sizeof(*sp));
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
@@ -15,6 +15,13 @@
  * misc driver.
  * The key difference: we use spinlocks in place of the mutex locks. This isn't
  * the case everywhere though..
+ * Optionally (module parameter use_seqlock=1), the read paths become lockless:
+ * readers snapshot the secret into a local buffer under a seqcount, retrying
+ * if a writer got in concurrently, and then copy the snapshot to userspace;
+ * so, readers no longer serialize on the spinlock and mutex (they account
+ * their tx stat per-CPU, too).
+ * The methods record their latency (and the request sizes) in per-CPU
+ * histograms, viewable via debugfs (see lkdc_misc_hist.h).
  *
  * For details, please refer the book, Ch 10.
  */
@@ -22,8 +29,8 @@
 #include <linux/module.h>
 #include <linux/miscdevice.h>
 #include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
-#include <linux/mm.h>           // kvmalloc()
 #include <linux/fs.h>		// the fops structure
+#include <linux/uio.h>		// struct iov_iter, copy_[to|from]_iter()
 
 // copy_[to|from]_user()
 #include <linux/version.h>
@@ -35,7 +42,14 @@
 
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/percpu.h>
 #include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+#include "../../lkdc_misc_iter.h"
+#include "../../lkdc_misc_hist.h"
 
 #define OURMODNAME   "miscdrv_rdwr_spinlock"
 
@@ -50,6 +64,11 @@ module_param(buggy, int, 0600);
 MODULE_PARM_DESC(buggy,
  "If 1, cause an error by issuing a blocking call within a spinlock critical section");
 
+static int use_seqlock;
+module_param(use_seqlock, int, 0444);
+MODULE_PARM_DESC(use_seqlock,
+ "If 1, readers snapshot the secret locklessly via a seqcount (default 0)");
+
 static int ga, gb = 1;
 DEFINE_SPINLOCK(lock1); // this spinlock protects the global integers ga and gb
 
@@ -64,17 +83,52 @@ struct drv_ctx {
 	char oursecret[MAXBYTES];
 	struct mutex mutex;  // this mutex protects this data structure
 	spinlock_t spinlock; // ...so does this spinlock
+	seqcount_t seqc;     // bumped by writers (under the spinlock) when they
+			     // modify the secret; for the lockless readers
+	int __percpu *pcpu_tx; // use_seqlock=1: the readers account tx here,
+			       // per-CPU, so they take no lock at all
 };
 static struct drv_ctx *ctx;
+/* Method latency and request size histograms; see lkdc_misc_hist.h */
+static struct lkdc_hist hist;
+
+/*
+ * snapshot_secret()
+ * The lockless (use_seqlock=1) reader side: copy the secret into the caller's
+ * buffer 'snap' (of MAXBYTES), retrying if a writer modified it meanwhile.
+ * Returns the length of the secret.
+ * Writers are serialized by the spinlock, and preemption is disabled within
+ * it; so, the plain seqcount (rather than a full seqlock_t) suffices.
+ */
+static int snapshot_secret(char *snap)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&ctx->seqc);
+		memcpy(snap, ctx->oursecret, MAXBYTES);
+	} while (read_seqcount_retry(&ctx->seqc, seq));
+
+	/* A torn copy is never used, but be paranoid reg the terminator */
+	snap[MAXBYTES - 1] = '\0';
+	return strlen(snap);
+}
 
 static inline void display_stats(int show_stats)
 {
-	if (1 == show_stats) {
-		spin_lock(&ctx->spinlock);
-		pr_info("%s: stats: tx=%d, rx=%d\n",
-			OURMODNAME, ctx->tx, ctx->rx);
-		spin_unlock(&ctx->spinlock);
+	int cpu, tx;
+
+	if (1 != show_stats)
+		return;
+	spin_lock(&ctx->spinlock);
+	tx = ctx->tx;
+	if (use_seqlock) {
+		/* Fold in the per-CPU tx; the result is approximate, of course */
+		for_each_possible_cpu(cpu)
+			tx += *per_cpu_ptr(ctx->pcpu_tx, cpu);
 	}
+	pr_info("%s: stats: tx=%d, rx=%d\n", OURMODNAME, tx, ctx->rx);
+	spin_unlock(&ctx->spinlock);
 }
 
 /*--- The driver 'methods' follow ---*/
@@ -88,20 +142,24 @@ static inline void display_stats(int show_stats)
  */
 static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-	PRINT_CTX(); // displays process (or intr) context info
+	u64 t0 = lkdc_hist_start();
+
+	VPRINT_CTX(); // displays process (or intr) context info
 
 	spin_lock(&lock1);
 	ga ++; gb --;
 	spin_unlock(&lock1);
 
-	pr_info("%s:%s():\n"
+	vpr_info("%s:%s():\n"
 		" filename: \"%s\"\n"
 		" wrt open file: f_flags = 0x%x\n"
 		" ga = %d, gb = %d\n",
 	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 	       filp->f_flags, ga, gb);
 
-	display_stats(1);
+	display_stats(verbose);
+	lkdc_hist_record(&hist, LKDC_H_OPEN, t0, 0);
+	trace_lkdc_open(OURMODNAME, filp);
 	return 0;
 }
 
@@ -117,14 +175,20 @@ static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 				size_t count, loff_t *off)
 {
+	u64 t0 = lkdc_hist_start();
 	int ret = count, secret_len, err_path = 0;
+	char snap[MAXBYTES];
 
-	spin_lock(&ctx->spinlock);
-	secret_len = strlen(ctx->oursecret);
-	spin_unlock(&ctx->spinlock);
+	if (use_seqlock)
+		secret_len = snapshot_secret(snap);
+	else {
+		spin_lock(&ctx->spinlock);
+		secret_len = strlen(ctx->oursecret);
+		spin_unlock(&ctx->spinlock);
+	}
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
 	ret = -EINVAL;
@@ -155,6 +219,23 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 	 * member to userspace.
 	 */
 	ret = -EFAULT;
+	if (use_seqlock) {
+		/* Lockless: we copy out our private snapshot of the secret, so
+		 * no lock is required to protect the (sleepable) copy */
+		if (copy_to_user(ubuf, snap, secret_len)) {
+			pr_warn("%s:%s(): copy_to_user() failed\n",
+				OURMODNAME, __func__);
+			err_path = 1;
+			goto out_notok;
+		}
+		ret = secret_len;
+
+		// Update stats; per-CPU, so no lock here either
+		this_cpu_add(*ctx->pcpu_tx, secret_len);
+		vpr_info(" %d bytes read (lockless), returning...\n", secret_len);
+		goto out_notok;
+	}
+
 	mutex_lock(&ctx->mutex);
 	/* Why don't we just use the spinlock??
 	 * Because - v imp! - remember that the spinlock can only be used when
@@ -171,12 +252,14 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 
 	// Update stats
 	ctx->tx += secret_len; // our 'transmit' is wrt this driver
-	pr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
+	vpr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
 			secret_len, ctx->tx, ctx->rx);
 out_ctu:
 	mutex_unlock(&ctx->mutex);
 	display_stats(err_path);
 out_notok:
+	lkdc_hist_record(&hist, LKDC_H_READ, t0, count);
+	trace_lkdc_read(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -192,35 +275,32 @@ out_notok:
 static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 				size_t count, loff_t *off)
 {
+	u64 t0 = lkdc_hist_start();
 	int ret, err_path = 0;
-	void *kbuf = NULL;
+	size_t n = (count > MAXBYTES ? MAXBYTES : count);
+	char kbuf[MAXBYTES + 1];
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to write %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
-	ret = -ENOMEM;
-	kbuf = kvmalloc(count, GFP_KERNEL);
-	if (unlikely(!kbuf)) {
-		pr_warn("%s:%s(): kvmalloc() failed!\n", OURMODNAME, __func__);
-		err_path = 1;
-		goto out_nomem;
-	}
-	memset(kbuf, 0, count);
-
 	/* Copy in the user supplied buffer 'ubuf' - the data content to write -
 	 * via the copy_from_user() macro.
 	 * (FYI, the copy_from_user() macro is the *right* way to copy data from
 	 * kernel-space to userspace; the parameters are:
 	 *  'to-buffer', 'from-buffer', count
 	 *  Returns 0 on success, i.e., non-zero return implies an I/O fault).
+	 * We only ever keep (upto) MAXBYTES of it; so, that's all we copy in,
+	 * into a small on-stack buffer - there's no need to allocate (and free)
+	 * memory on every write.
 	 */
 	ret = -EFAULT;
-	if (copy_from_user(kbuf, ubuf, count)) {
+	if (copy_from_user(kbuf, ubuf, n)) {
 		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
 		err_path = 1;
 		goto out_cfu;
 	}
+	kbuf[n] = '\0';
 
 	/* In a 'real' driver, we would now actually write (for 'count' bytes)
 	 * the content of the 'ubuf' buffer to the device hardware (or whatever),
@@ -229,7 +309,9 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	 * new 'secret' into our driver 'context' structure, and unlock.
 	 */
 	spin_lock(&ctx->spinlock);
-	strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+	write_seqcount_begin(&ctx->seqc);
+	strlcpy(ctx->oursecret, kbuf, n);
+	write_seqcount_end(&ctx->seqc);
 #if 0
 	print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
 				ctx, sizeof(struct drv_ctx));
@@ -238,7 +320,7 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	ctx->rx += count; // our 'receive' is wrt userspace
 
 	ret = count;
-	pr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
+	vpr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
 		count, ctx->tx, ctx->rx);
 
 	if (1 == buggy) {
@@ -250,9 +332,110 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 
 	spin_unlock(&ctx->spinlock);
 out_cfu:
-	kvfree(kbuf);
 	display_stats(err_path);
-out_nomem:
+	lkdc_hist_record(&hist, LKDC_H_WRITE, t0, count);
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * read_iter_miscdrv_rdwr()
+ * The vectored read; as in ch9/miscdrv_rdwr (which see): each segment is a
+ * separate read request. Here, the mutex is held across all the segments
+ * (copy_to_iter() may sleep) - or, with use_seqlock=1, we copy out a lockless
+ * snapshot of the secret instead.
+ */
+static ssize_t read_iter_miscdrv_rdwr(struct kiocb *iocb, struct iov_iter *to)
+{
+	u64 t0 = lkdc_hist_start();
+	size_t count = iov_iter_count(to);
+	ssize_t ret = -EINVAL;
+	int secret_len, err_path = 0;
+	bool aborted;
+	const char *src = ctx->oursecret;
+	char snap[MAXBYTES];
+
+	if (use_seqlock) {
+		secret_len = snapshot_secret(snap);
+		src = snap;
+	} else {
+		spin_lock(&ctx->spinlock);
+		secret_len = strlen(ctx->oursecret);
+		spin_unlock(&ctx->spinlock);
+	}
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, to->nr_segs);
+
+	if (secret_len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		err_path = 1;
+		goto out_notok;
+	}
+
+	if (!use_seqlock)
+		mutex_lock(&ctx->mutex); /* copy_to_iter() may sleep */
+	ret = lkdc_iter_read(to, src, secret_len, MAXBYTES, OURMODNAME, &aborted);
+	err_path = aborted;
+	if (ret > 0) {
+		// Update stats
+		if (use_seqlock)
+			this_cpu_add(*ctx->pcpu_tx, ret);
+		else
+			ctx->tx += ret; // our 'transmit' is wrt userspace
+		vpr_info(" %zd bytes read, returning...\n", ret);
+	}
+	if (!use_seqlock)
+		mutex_unlock(&ctx->mutex);
+	display_stats(err_path);
+out_notok:
+	lkdc_hist_record(&hist, LKDC_H_READ, t0, count);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/* write_iter: the lkdc_iter_write() callback; install a segment's secret */
+static void set_secret_seg(void *arg, const char *kbuf, size_t n, size_t seglen)
+{
+	spin_lock(&ctx->spinlock);
+	write_seqcount_begin(&ctx->seqc);
+	strlcpy(ctx->oursecret, kbuf, n);
+	write_seqcount_end(&ctx->seqc);
+	ctx->rx += seglen; // our 'receive' is wrt userspace
+	spin_unlock(&ctx->spinlock);
+}
+
+/*
+ * write_iter_miscdrv_rdwr()
+ * The vectored write; as in ch9/miscdrv_rdwr (which see): each segment in turn
+ * becomes the secret (truncated to MAXBYTES). Here, it's copied in outside
+ * the lock and installed under the spinlock (bumping the seqcount).
+ */
+static ssize_t write_iter_miscdrv_rdwr(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	u64 t0 = lkdc_hist_start();
+	size_t count = iov_iter_count(from);
+	char kbuf[MAXBYTES + 1];
+	ssize_t ret;
+	int err_path;
+	bool aborted;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, from->nr_segs);
+
+	ret = lkdc_iter_write(from, kbuf, MAXBYTES, set_secret_seg, NULL,
+			      OURMODNAME, &aborted);
+	err_path = aborted;
+	if (ret > 0)
+		vpr_info(" %zd bytes written, returning...\n", ret);
+	display_stats(err_path);
+	lkdc_hist_record(&hist, LKDC_H_WRITE, t0, count);
+	trace_lkdc_write(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -264,25 +447,32 @@ out_nomem:
  */
 static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-        PRINT_CTX(); // displays process (or intr) context info
+	u64 t0 = lkdc_hist_start();
+
+        VPRINT_CTX(); // displays process (or intr) context info
 
 	spin_lock(&lock1);
 	ga --; gb ++;
 	spin_unlock(&lock1);
 
-        pr_info("%s:%s(): filename: \"%s\"\n"
+        vpr_info("%s:%s(): filename: \"%s\"\n"
 		" ga = %d, gb = %d\n",
 			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 			ga, gb);
-	display_stats(1);
+	display_stats(verbose);
+	lkdc_hist_record(&hist, LKDC_H_RELEASE, t0, 0);
+        trace_lkdc_release(OURMODNAME, filp);
         return 0;
 }
 
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,
 	.open = open_miscdrv_rdwr,
 	.read = read_miscdrv_rdwr,
 	.write = write_miscdrv_rdwr,
+	.read_iter = read_iter_miscdrv_rdwr,
+	.write_iter = write_iter_miscdrv_rdwr,
 	.llseek = no_llseek,             // dummy, we don't support lseek(2)
 	.release = close_miscdrv_rdwr,
 	/* As you learn more reg device drivers, you'll realize that the
@@ -301,12 +491,43 @@ static struct miscdevice lkdc_miscdev = {
 
 static int __init miscdrv_init_spinlock(void)
 {
-	int ret;
+	int ret = -ENOMEM;
+
+	/* Set up the context fully before registering; once registered, the
+	 * device can be opened right away */
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	if (use_seqlock) {
+		ctx->pcpu_tx = alloc_percpu(int);
+		if (unlikely(!ctx->pcpu_tx)) {
+			pr_notice("%s: alloc_percpu failed! aborting\n", OURMODNAME);
+			goto out_pcpu;
+		}
+	}
+	ret = lkdc_hist_init(&hist, OURMODNAME);
+	if (ret) {
+		pr_notice("%s: lkdc_hist_init failed! aborting\n", OURMODNAME);
+		goto out_hist;
+	}
+	mutex_init(&ctx->mutex);
+	spin_lock_init(&ctx->spinlock);
+	seqcount_init(&ctx->seqc);
+	strlcpy(ctx->oursecret, "initmsg", 8);
+		/* Why don't we protect the above strlcpy() with the mutex lock?
+		 * It's working on shared writable data, yes?
+		 * No; this is the init code; it's guaranteed to run in exactly
+		 * one context (typically the insmod(8) process), thus there is
+		 * no concurrency possible here (the device isn't registered yet).
+		 * The same goes for the cleanup code path.
+		 */
 
 	if ((ret = misc_register(&lkdc_miscdev))) {
 		pr_notice("%s: misc device registration failed, aborting\n",
 			       OURMODNAME);
-		return ret;
+		goto out_reg;
 	}
 	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
 			OURMODNAME, lkdc_miscdev.minor);
@@ -325,30 +546,26 @@ static int __init miscdrv_init_spinlock(void)
 	 */
 	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
 
-	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
-	if (unlikely(!ctx)) {
-		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
-		return -ENOMEM;
-	}
-	mutex_init(&ctx->mutex);
-	spin_lock_init(&ctx->spinlock);
-	strlcpy(ctx->oursecret, "initmsg", 8);
-		/* Why don't we protect the above strlcpy() with the mutex lock?
-		 * It's working on shared writable data, yes?
-		 * No; this is the init code; it's guaranteed to run in exactly
-		 * one context (typically the insmod(8) process), thus there is
-		 * no concurrency possible here. The same goes for the cleanup
-		 * code path.
-		 */
-
 	return 0;		/* success */
+
+out_reg:
+	mutex_destroy(&ctx->mutex);
+	lkdc_hist_exit(&hist);
+out_hist:
+	free_percpu(ctx->pcpu_tx);
+out_pcpu:
+	kfree(ctx);
+	return ret;
 }
 
 static void __exit miscdrv_exit_spinlock(void)
 {
+	/* Deregister first: no new opens from here on */
+	misc_deregister(&lkdc_miscdev);
 	mutex_destroy(&ctx->mutex);
+	lkdc_hist_exit(&hist);
+	free_percpu(ctx->pcpu_tx);
 	kzfree(ctx);
-	misc_deregister(&lkdc_miscdev);
 	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
 }
 
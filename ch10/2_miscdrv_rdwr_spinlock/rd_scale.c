@@ -0,0 +1,268 @@
+/*
+ * ch10/2_miscdrv_rdwr_spinlock/rd_scale.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * A reader-scaling benchmark for our misc drivers: for 1, 2, 4, ... upto
+ * <max_threads> reader threads (each pinned to a CPU, each with it's own open
+ * of the device), hammer the device with read(2)s of the secret for a few
+ * seconds and report the aggregate read rate.
+ * Run it once with the driver loaded normally and once with it loaded with
+ * use_seqlock=1, to compare the spinlock+mutex scheme with the lockless one.
+ * (The RCU variant, ch10/9_miscdrv_rdwr_rcu, builds and uses this app too, as
+ * does the sharded one, ch10/11_miscdrv_rdwr_shard: run it once per 'sharded'
+ * mode there; likewise, once per 'lockmode' with ch10/12_miscdrv_rdwr_lockops.)
+ * Optionally, a writer thread updates the secret every <write_interval_us>
+ * microseconds while the readers run; the latency of it's write(2)s is
+ * reported (median, 99th percentile and max), showing what the readers cost
+ * the writer under each scheme.
+ * Tip: the drivers printk on every read; for meaningful numbers, make sure
+ * the console loglevel is such that these don't hit the console.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define MAXBYTES    128   /* Must match the driver */
+
+static const char *devfile;
+static volatile int running;
+static pthread_barrier_t start_barrier;
+static long wr_interval_us;   /* 0 => no writer thread */
+
+#define MAX_WR_SAMPLES	(1 << 20)
+struct writer {
+	pthread_t tid;
+	long nsamples;
+	double *lat_us;
+	int failed;
+};
+
+struct reader {
+	pthread_t tid;
+	int cpu;
+	long nreads;
+	int failed;
+};
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file max_threads [seconds]\n"
+			" Reads the secret in a loop from 1, 2, 4, ... upto <max_threads>\n"
+			" reader threads, each for <seconds> (default 3), reporting the read rate.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *reader(void *arg)
+{
+	struct reader *r = arg;
+	char buf[MAXBYTES];
+	cpu_set_t cpus;
+	int fd;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(r->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	fd = open(devfile, O_RDONLY);
+	if (fd < 0) {
+		perror("reader: open");
+		r->failed = 1;
+	}
+	pthread_barrier_wait(&start_barrier);
+	if (fd < 0)
+		return NULL;
+
+	while (running) {
+		if (read(fd, buf, MAXBYTES) < 0) {
+			perror("reader: read");
+			r->failed = 1;
+			break;
+		}
+		r->nreads++;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct writer *w = arg;
+	char msg[32];
+	double t;
+	int fd, n;
+
+	fd = open(devfile, O_WRONLY);
+	if (fd < 0) {
+		perror("writer: open");
+		w->failed = 1;
+	}
+	pthread_barrier_wait(&start_barrier);
+	if (fd < 0)
+		return NULL;
+
+	while (running) {
+		n = snprintf(msg, sizeof(msg), "secret-%ld", w->nsamples);
+		t = now_sec();
+		if (write(fd, msg, n) < 0) {
+			perror("writer: write");
+			w->failed = 1;
+			break;
+		}
+		t = now_sec() - t;
+		if (w->nsamples < MAX_WR_SAMPLES)
+			w->lat_us[w->nsamples++] = t * 1e6;
+		usleep(wr_interval_us);
+	}
+	close(fd);
+	return NULL;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Print the writer's latency percentiles (in us) */
+static void report_writer(struct writer *w)
+{
+	if (!w->nsamples) {
+		printf("        -");
+		return;
+	}
+	qsort(w->lat_us, w->nsamples, sizeof(double), cmp_double);
+	printf(" %8ld %8.1f %8.1f %8.1f", w->nsamples,
+		w->lat_us[w->nsamples / 2],
+		w->lat_us[(w->nsamples * 99) / 100],
+		w->lat_us[w->nsamples - 1]);
+}
+
+/* Run 'nthrds' readers for 'secs' seconds; returns the aggregate reads/sec */
+static double run(int nthrds, int secs, int ncpus)
+{
+	struct reader *rd = calloc(nthrds, sizeof(struct reader));
+	struct writer wr = { 0 };
+	long total = 0;
+	double t;
+	int i;
+
+	if (!rd) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	if (wr_interval_us) {
+		wr.lat_us = malloc(MAX_WR_SAMPLES * sizeof(double));
+		if (!wr.lat_us) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_init(&start_barrier, NULL,
+			nthrds + 1 + (wr_interval_us ? 1 : 0));
+	running = 1;
+	if (wr_interval_us && pthread_create(&wr.tid, NULL, writer, &wr)) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < nthrds; i++) {
+		rd[i].cpu = i % ncpus;
+		if (pthread_create(&rd[i].tid, NULL, reader, &rd[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	t = now_sec();
+	sleep(secs);
+	running = 0;
+	for (i = 0; i < nthrds; i++) {
+		pthread_join(rd[i].tid, NULL);
+		if (rd[i].failed)
+			exit(EXIT_FAILURE);
+		total += rd[i].nreads;
+	}
+	t = now_sec() - t;
+	if (wr_interval_us) {
+		pthread_join(wr.tid, NULL);
+		if (wr.failed)
+			exit(EXIT_FAILURE);
+	}
+	pthread_barrier_destroy(&start_barrier);
+	free(rd);
+
+	printf(" %7d %12.0f %16.0f", nthrds, total / t, total / t / nthrds);
+	if (wr_interval_us) {
+		report_writer(&wr);
+		free(wr.lat_us);
+	}
+	return total / t;
+}
+
+int main(int argc, char **argv)
+{
+	int maxthrds, secs, ncpus, n;
+	double rate, rate1 = 0;
+
+	if (argc < 3 || argc > 5) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	devfile = argv[1];
+	maxthrds = atoi(argv[2]);
+	secs = (argc >= 4 ? atoi(argv[3]) : 3);
+	wr_interval_us = (argc == 5 ? atol(argv[4]) : 0);
+	if (maxthrds <= 0 || secs <= 0 || wr_interval_us < 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("%s: %s, %d CPUs online, %d s per run\n",
+		argv[0], devfile, ncpus, secs);
+	if (wr_interval_us)
+		printf(" writer: one write every %ld us; latencies in us\n",
+			wr_interval_us);
+	printf(" readers      reads/s   reads/s/thread");
+	if (wr_interval_us)
+		printf("   writes      p50      p99      max");
+	printf("  speedup\n");
+	for (n = 1; ; n *= 2) {
+		if (n > maxthrds)
+			n = maxthrds;
+		rate = run(n, secs, ncpus);
+		if (n == 1)
+			rate1 = rate;
+		printf(" %8.2f\n", rate / rate1);
+		if (n == maxthrds)
+			break;
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,237 @@
+/*
+ * ch10/3_miscdrv_rdwr_spinlock_pvtdata/fork_fanout.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * A fork-fanout scaling test for our 'semi-lockless' pvtdata driver: for 1,
+ * 2, 4, ... upto <max_procs> processes (hundreds, if you like), all running
+ * concurrently, each repeatedly opens the device, does <nops> write(2)s and
+ * read(2)s of it's (private) secret, and closes it, for a few seconds.
+ * Per process count, we report the aggregate rate of each kind of op - open,
+ * write, read and close - and it's mean latency; the speedup column is that of
+ * the whole open-operate-close 'sessions', wrt a single process.
+ * As each open gets it's own context, the reads and writes should scale (until
+ * we run out of CPUs); the open and close, though, still go through the global
+ * ga/gb spinlock (lock1) - and the VFS / misc core - so this shows where (and
+ * how much) that serializes.
+ * Tip: load the driver with verbose=0, else the printk's dominate.
+ * (To just read or write the secret once, use ch9/miscdrv_rdwr/rdwr_drv_secret;
+ * this one, like openclose_bench, exercises what's particular to this driver -
+ * a private context per open - and so lives alongside it.)
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MAXBYTES    128   /* Must match the driver */
+
+enum { OP_OPEN, OP_WRITE, OP_READ, OP_CLOSE, NR_OPS };
+static const char *opname[NR_OPS] = { "open", "write", "read", "close" };
+
+struct proc_res {
+	long nops[NR_OPS];
+	double secs[NR_OPS];   /* total time spent in each kind of op */
+	long nsessions;
+	int failed;
+};
+
+/* Shared (MAP_SHARED) between the parent and all the children */
+struct shared {
+	volatile int running;
+	pthread_barrier_t start_barrier;
+	struct proc_res res[];
+};
+
+static const char *devfile;
+static int nops = 1;   /* # of write+read pairs per open */
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file max_procs [seconds [nops]]\n"
+			" From 1, 2, 4, ... upto <max_procs> concurrent processes, each one\n"
+			" repeatedly opens the device, does <nops> (default 1) write+read pairs\n"
+			" and closes it, for <seconds> (default 3); reports the rate and latency\n"
+			" of each kind of op.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Account an op of kind 'op' that began at 't0'; returns the time now */
+static inline double account(struct proc_res *r, int op, double t0)
+{
+	double t = now_sec();
+
+	r->nops[op]++;
+	r->secs[op] += t - t0;
+	return t;
+}
+
+static void child(struct shared *sh, int id)
+{
+	struct proc_res *r = &sh->res[id];
+	char buf[MAXBYTES], msg[32];
+	int fd, i, n;
+	double t;
+
+	n = snprintf(msg, sizeof(msg), "secret-of-%d", getpid());
+	pthread_barrier_wait(&sh->start_barrier);
+
+	while (sh->running) {
+		t = now_sec();
+		fd = open(devfile, O_RDWR);
+		if (fd < 0) {
+			perror("child: open");
+			r->failed = 1;
+			break;
+		}
+		t = account(r, OP_OPEN, t);
+		for (i = 0; i < nops; i++) {
+			if (write(fd, msg, n) < 0) {
+				perror("child: write");
+				r->failed = 1;
+				break;
+			}
+			t = account(r, OP_WRITE, t);
+			if (read(fd, buf, MAXBYTES) < 0) {
+				perror("child: read");
+				r->failed = 1;
+				break;
+			}
+			t = account(r, OP_READ, t);
+		}
+		close(fd);
+		account(r, OP_CLOSE, t);
+		if (r->failed)
+			break;
+		r->nsessions++;
+	}
+}
+
+/* Run 'nprocs' processes for 'secs' seconds; returns the sessions/sec */
+static double run(int nprocs, int secs)
+{
+	size_t shsz = sizeof(struct shared) + nprocs * sizeof(struct proc_res);
+	double t, rate, mean_us, secs_op[NR_OPS] = { 0 };
+	long nops_all[NR_OPS] = { 0 }, nsessions = 0;
+	pthread_barrierattr_t battr;
+	struct shared *sh;
+	pid_t *pids;
+	int i, op;
+
+	sh = mmap(NULL, shsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		  -1, 0);
+	pids = calloc(nprocs, sizeof(pid_t));
+	if (sh == MAP_FAILED || !pids) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrierattr_init(&battr);
+	pthread_barrierattr_setpshared(&battr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&sh->start_barrier, &battr, nprocs + 1);
+	sh->running = 1;
+
+	for (i = 0; i < nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			exit(EXIT_FAILURE);
+		}
+		if (!pids[i]) {
+			child(sh, i);
+			_exit(0);
+		}
+	}
+	pthread_barrier_wait(&sh->start_barrier);
+	t = now_sec();
+	sleep(secs);
+	sh->running = 0;
+	for (i = 0; i < nprocs; i++)
+		waitpid(pids[i], NULL, 0);
+	t = now_sec() - t;
+
+	for (i = 0; i < nprocs; i++) {
+		if (sh->res[i].failed) {
+			fprintf(stderr, " process #%d failed; Tip: see kernel log\n", i);
+			exit(EXIT_FAILURE);
+		}
+		nsessions += sh->res[i].nsessions;
+		for (op = 0; op < NR_OPS; op++) {
+			nops_all[op] += sh->res[i].nops[op];
+			secs_op[op] += sh->res[i].secs[op];
+		}
+	}
+	pthread_barrier_destroy(&sh->start_barrier);
+	munmap(sh, shsz);
+	free(pids);
+
+	rate = nsessions / t;
+	printf(" %6d %12.0f", nprocs, rate);
+	for (op = 0; op < NR_OPS; op++) {
+		mean_us = (nops_all[op] ? secs_op[op] / nops_all[op] * 1e6 : 0);
+		printf(" %10.0f %7.2f", nops_all[op] / t, mean_us);
+	}
+	return rate;
+}
+
+int main(int argc, char **argv)
+{
+	int maxprocs, secs, n, op;
+	double rate, rate1 = 0;
+
+	if (argc < 3 || argc > 5) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	devfile = argv[1];
+	maxprocs = atoi(argv[2]);
+	secs = (argc >= 4 ? atoi(argv[3]) : 3);
+	nops = (argc == 5 ? atoi(argv[4]) : 1);
+	if (maxprocs <= 0 || secs <= 0 || nops <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%s: %s, %ld CPUs online, %d s per run, %d write+read pair(s) per open\n",
+		argv[0], devfile, sysconf(_SC_NPROCESSORS_ONLN), secs, nops);
+	printf("  procs   sessions/s");
+	for (op = 0; op < NR_OPS; op++)
+		printf(" %8s/s %7s", opname[op], "us/op");
+	printf("  speedup\n");
+	for (n = 1; ; n *= 2) {
+		if (n > maxprocs)
+			n = maxprocs;
+		rate = run(n, secs);
+		if (n == 1)
+			rate1 = rate;
+		printf(" %8.2f\n", rate / rate1);
+		if (n == maxprocs)
+			break;
+	}
+	exit(EXIT_SUCCESS);
+}
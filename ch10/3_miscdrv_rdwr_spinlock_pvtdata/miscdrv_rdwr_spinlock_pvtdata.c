@@ -19,15 +19,19 @@
  * The functionality (the get and set of the 'secret') remains identical,
  * except that we now (more correctly) count the statistics on a per-process
  * basis (rather then cumulatively for all processes that use the driver).
+ * As the context is allocated on every open and freed on every close, it
+ * comes from a dedicated slab cache: cacheline aligned, and with a constructor
+ * that pre-initializes it; so, the open path need not memset the structure
+ * nor set up the initial secret (see the use_cache module parameter).
  *
  * For details, please refer the book, Ch 10.
  */
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/miscdevice.h>
-#include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
-#include <linux/mm.h>           // kvmalloc()
+#include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), kmem_cache_*()
 #include <linux/fs.h>		// the fops structure
+#include <linux/uio.h>		// struct iov_iter, copy_[to|from]_iter()
 
 // copy_[to|from]_user()
 #include <linux/version.h>
@@ -39,6 +43,10 @@
 
 #include <linux/spinlock.h>
 #include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+#include "../../lkdc_misc_iter.h"
 
 #define OURMODNAME   "miscdrv_rdwr_spinlock_pvtdata"
 
@@ -48,6 +56,12 @@ MODULE_DESCRIPTION("LKDC book:ch10/3_miscdrv_rdwr_spinlock_pvtdata: simple "
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_VERSION("0.1");
 
+static bool use_cache = true;
+module_param(use_cache, bool, 0444);
+MODULE_PARM_DESC(use_cache,
+ "If 1 (the default), allocate the per-open context from our own slab cache;"
+ " if 0, from the generic kzalloc() (to compare the two)");
+
 static int ga, gb = 1;
 DEFINE_SPINLOCK(lock1); // this spinlock protects the global integers ga and gb
 
@@ -58,6 +72,7 @@ DEFINE_SPINLOCK(lock1); // this spinlock protects the global integers ga and gb
  * (a 'semi-lockless' design).
  * We allocate it in the open method, and free it in the release method.
  */
+#define INITMSG	"initmsg"
 struct drv_ctx {
 	int tx, rx, err, myword;
 	u32 config1, config2;
@@ -66,6 +81,53 @@ struct drv_ctx {
 	char oursecret[MAXBYTES];
 };
 
+/*
+ * Our dedicated slab cache for the per-open driver context. The slab layer
+ * runs the constructor only when it populates a new slab, not on every
+ * allocation; so, the contract is that an object is back in it's 'constructed'
+ * state when freed - see ctx_free().
+ */
+static struct kmem_cache *ctx_cachep;
+
+static void ctx_ctor(void *obj)
+{
+	struct drv_ctx *ctx = obj;
+
+	memset(ctx, 0, sizeof(struct drv_ctx));
+	strlcpy(ctx->oursecret, INITMSG, sizeof(INITMSG));
+}
+
+static struct drv_ctx *ctx_alloc(void)
+{
+	struct drv_ctx *ctx;
+
+	if (use_cache)
+		return kmem_cache_alloc(ctx_cachep, GFP_KERNEL);
+
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (ctx)
+		strlcpy(ctx->oursecret, INITMSG, sizeof(INITMSG));
+	return ctx;
+}
+
+static void ctx_free(struct drv_ctx *ctx)
+{
+	if (!use_cache) {
+		kfree(ctx);
+		return;
+	}
+	/* Restore the constructed state; only the stats and (if it was ever
+	 * written to) the secret can have changed. Clearing the whole of the old
+	 * secret also ensures that it doesn't linger in the cache. */
+	ctx->tx = ctx->err = 0;
+	if (ctx->rx) {
+		ctx->rx = 0;
+		memset(ctx->oursecret, 0, MAXBYTES);
+		strlcpy(ctx->oursecret, INITMSG, sizeof(INITMSG));
+	}
+	kmem_cache_free(ctx_cachep, ctx);
+}
+
 static inline void display_stats(int show_stats, struct drv_ctx *ctx)
 {
 	if (1 == show_stats)
@@ -83,16 +145,16 @@ static inline void display_stats(int show_stats, struct drv_ctx *ctx)
  */
 static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-	struct drv_ctx *ctx = (struct drv_ctx *)filp->private_data;
+	struct drv_ctx *ctx;
 
-	PRINT_CTX(); // displays process (or intr) context info
+	VPRINT_CTX(); // displays process (or intr) context info
 
 	spin_lock(&lock1);
 	ga ++; gb --;
 	spin_unlock(&lock1);
 
 	spin_lock(&filp->f_lock);	// (see comment below)
-	pr_info("%s:%s():\n"
+	vpr_info("%s:%s():\n"
 		" filename: \"%s\"\n"
 		" wrt open file: f_flags = 0x%x\n"
 		" ga = %d, gb = %d\n",
@@ -104,20 +166,20 @@ static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 	spin_unlock(&filp->f_lock);
 
 	/* 'Lock-Free' architecture: allocate a private instance of the driver
-	 * 'context' data structure and use it */
-	filp->private_data = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	 * 'context' data structure and use it; it arrives already initialized,
+	 * with the secret set to INITMSG */
+	ctx = ctx_alloc();
 	if (!ctx) {
-		pr_notice("%s:%s():%d: kzalloc failed! aborting\n",
+		pr_notice("%s:%s():%d: ctx alloc failed! aborting\n",
 			OURMODNAME, __func__, __LINE__);
 		return -ENOMEM;
 	}
-	ctx = filp->private_data;
-	pr_info(" ** kzalloc ctx for pid %d, ctx = 0x%llx\n",
+	filp->private_data = ctx;
+	vpr_info(" ** alloc ctx for pid %d, ctx = 0x%llx\n",
 		current->pid, (long long unsigned int)ctx);
 
-	strlcpy(ctx->oursecret, "initmsg", 8);
-		/* This time, why don't we protect the above strlcpy() with
-		 * a mutex or spinlock? It's working on shared writable data, yes?
+		/* This time, why don't we protect the initialization of the
+		 * secret with a mutex or spinlock? It's shared writable data, yes?
 		 * No; every single process that 'opens' the device gets a
 		 * *private* instance of the driver context structure; thus, no
 		 * locking is required (it's 'lockless'!).
@@ -127,7 +189,8 @@ static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 		 * is the job of the application developer who spawned those
 		 * threads, not our job!
 		 */
-	display_stats(1, ctx);
+	display_stats(verbose, ctx);
+	trace_lkdc_open(OURMODNAME, filp);
 	return 0;
 }
 
@@ -146,9 +209,9 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 	struct drv_ctx *ctx = (struct drv_ctx *)filp->private_data;
 	int ret = count, secret_len = strlen(ctx->oursecret), err_path = 0;
 
-	pr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
+	vpr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
-	pr_info(" pid %d, ctx = 0x%llx\n",
+	vpr_info(" pid %d, ctx = 0x%llx\n",
 		current->pid, (long long unsigned int)ctx);
 
 	ret = -EINVAL;
@@ -188,10 +251,11 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 
 	// Update stats
 	ctx->tx += secret_len; // our 'transmit' is wrt userspace
-	pr_info(" %d bytes read, returning...\n", secret_len);
+	vpr_info(" %d bytes read, returning...\n", secret_len);
 out_ctu:
 	display_stats(err_path, ctx);
 out_notok:
+	trace_lkdc_read(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -209,41 +273,37 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 {
 	struct drv_ctx *ctx = (struct drv_ctx *)filp->private_data;
 	int ret, err_path = 0;
-	void *kbuf = NULL;
+	size_t n = (count > MAXBYTES ? MAXBYTES : count);
+	char kbuf[MAXBYTES + 1];
 
-	pr_info("%s:%s():\n %s wants to write %ld bytes\n",
+	vpr_info("%s:%s():\n %s wants to write %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
-	pr_info(" pid %d, ctx = 0x%llx\n",
+	vpr_info(" pid %d, ctx = 0x%llx\n",
 		current->pid, (long long unsigned int)ctx);
 
-	ret = -ENOMEM;
-	kbuf = kvmalloc(count, GFP_KERNEL);
-	if (unlikely(!kbuf)) {
-		pr_warn("%s:%s(): kvmalloc() failed!\n", OURMODNAME, __func__);
-		err_path = 1;
-		goto out_nomem;
-	}
-	memset(kbuf, 0, count);
-
 	/* Copy in the user supplied buffer 'ubuf' - the data content to write -
 	 * via the copy_from_user() macro.
 	 * (FYI, the copy_from_user() macro is the *right* way to copy data from
 	 * kernel-space to userspace; the parameters are:
 	 *  'to-buffer', 'from-buffer', count
 	 *  Returns 0 on success, i.e., non-zero return implies an I/O fault).
+	 * We only ever keep (upto) MAXBYTES of it; so, that's all we copy in,
+	 * into a small on-stack buffer - there's no need to allocate (and free)
+	 * memory on every write.
 	 */
 	ret = -EFAULT;
-	if (copy_from_user(kbuf, ubuf, count)) {
+	if (copy_from_user(kbuf, ubuf, n)) {
 		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
 		err_path = 1;
 		goto out_cfu;
 	}
+	kbuf[n] = '\0';
 
 	/* In a 'real' driver, we would now actually write (for 'count' bytes)
 	 * the content of the 'ubuf' buffer to the device hardware (or whatever),
 	 * and then return.
 	 */
-	strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+	strlcpy(ctx->oursecret, kbuf, n);
 #if 0
 	print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
 				ctx, sizeof(struct drv_ctx));
@@ -252,12 +312,87 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	ctx->rx += count; // our 'receive' is wrt userspace
 
 	ret = count;
-	pr_info(" %ld bytes written, returning...\n", count);
+	vpr_info(" %ld bytes written, returning...\n", count);
 
 out_cfu:
-	kvfree(kbuf);
 	display_stats(err_path, ctx);
-out_nomem:
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * read_iter_miscdrv_rdwr()
+ * The vectored read; as in ch9/miscdrv_rdwr (which see): each segment is a
+ * separate read request. Here, of this open's private secret, so no lock.
+ */
+static ssize_t read_iter_miscdrv_rdwr(struct kiocb *iocb, struct iov_iter *to)
+{
+	size_t count = iov_iter_count(to);
+	struct drv_ctx *ctx = (struct drv_ctx *)iocb->ki_filp->private_data;
+	ssize_t ret = -EINVAL;
+	int secret_len, err_path = 0;
+	bool aborted;
+
+	secret_len = strlen(ctx->oursecret);
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, to->nr_segs);
+
+	if (secret_len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		err_path = 1;
+		goto out_notok;
+	}
+
+	ret = lkdc_iter_read(to, ctx->oursecret, secret_len, MAXBYTES,
+			     OURMODNAME, &aborted);
+	err_path = aborted;
+	if (ret > 0) {
+		// Update stats
+		ctx->tx += ret; // our 'transmit' is wrt userspace
+		vpr_info(" %zd bytes read, returning...\n", ret);
+	}
+	display_stats(err_path, ctx);
+out_notok:
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/* write_iter: the lkdc_iter_write() callback; install a segment's secret */
+static void set_secret_seg(void *arg, const char *kbuf, size_t n, size_t seglen)
+{
+	struct drv_ctx *ctx = arg;
+
+	strlcpy(ctx->oursecret, kbuf, n);
+	ctx->rx += seglen; // our 'receive' is wrt userspace
+}
+
+/*
+ * write_iter_miscdrv_rdwr()
+ * The vectored write; as in ch9/miscdrv_rdwr (which see): each segment in turn
+ * becomes the secret (truncated to MAXBYTES). Here, this open's private one.
+ */
+static ssize_t write_iter_miscdrv_rdwr(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	size_t count = iov_iter_count(from);
+	struct drv_ctx *ctx = (struct drv_ctx *)iocb->ki_filp->private_data;
+	char kbuf[MAXBYTES + 1];
+	ssize_t ret = 0;
+	int err_path;
+	bool aborted;
+
+	vpr_info("%s:%s():\n %s wants to write %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, from->nr_segs);
+
+	ret = lkdc_iter_write(from, kbuf, MAXBYTES, set_secret_seg, ctx,
+			      OURMODNAME, &aborted);
+	err_path = aborted;
+	if (ret > 0)
+		vpr_info(" %zd bytes written, returning...\n", ret);
+	display_stats(err_path, ctx);
+	trace_lkdc_write(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -271,30 +406,34 @@ static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
 	struct drv_ctx *ctx = (struct drv_ctx *)filp->private_data;
 
-	PRINT_CTX(); // displays process (or intr) context info
+	VPRINT_CTX(); // displays process (or intr) context info
 
 	spin_lock(&lock1);
 	ga --; gb ++;
 	spin_unlock(&lock1);
 
-        pr_info("%s:%s(): filename: \"%s\"\n"
+        vpr_info("%s:%s(): filename: \"%s\"\n"
 		" ga = %d, gb = %d\n",
 		OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 		ga, gb); // potential bug; unprotected / dirty reads on ga, gb!
 
-	display_stats(1, ctx);
-	pr_info(" ** kfree ctx for pid %d, ctx=0x%llx\n",
+	display_stats(verbose, ctx);
+	vpr_info(" ** free ctx for pid %d, ctx=0x%llx\n",
 		current->pid, (long long unsigned int)ctx);
-	kfree(ctx);
+	ctx_free(ctx);
 
+	trace_lkdc_release(OURMODNAME, filp);
 	return 0;
 }
 
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,   // open files hold ctx_cachep objects; pin the module
 	.open = open_miscdrv_rdwr,
 	.read = read_miscdrv_rdwr,
 	.write = write_miscdrv_rdwr,
+	.read_iter = read_iter_miscdrv_rdwr,
+	.write_iter = write_iter_miscdrv_rdwr,
 	.llseek = no_llseek,             // dummy, we don't support lseek(2)
 	.release = close_miscdrv_rdwr,
 	/* As you learn more reg device drivers, you'll realize that the
@@ -315,9 +454,18 @@ static int __init miscdrv_init_spinlock_pvtdata(void)
 {
 	int ret;
 
+	/* Must be ready before the device is, i.e., before misc_register() */
+	ctx_cachep = kmem_cache_create("lkdc_drv_ctx", sizeof(struct drv_ctx),
+			0, SLAB_HWCACHE_ALIGN, ctx_ctor);
+	if (!ctx_cachep) {
+		pr_notice("%s: kmem_cache_create failed, aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+
 	if ((ret = misc_register(&lkdc_miscdev))) {
 		pr_notice("%s: misc device registration failed, aborting\n",
 			       OURMODNAME);
+		kmem_cache_destroy(ctx_cachep);
 		return ret;
 	}
 	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
@@ -344,6 +492,7 @@ static int __init miscdrv_init_spinlock_pvtdata(void)
 static void __exit miscdrv_exit_spinlock_pvtdata(void)
 {
 	misc_deregister(&lkdc_miscdev);
+	kmem_cache_destroy(ctx_cachep);
 	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
 }
 
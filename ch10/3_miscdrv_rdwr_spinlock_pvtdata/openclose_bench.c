@@ -0,0 +1,173 @@
+/*
+ * ch10/3_miscdrv_rdwr_spinlock_pvtdata/openclose_bench.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * An open/close rate benchmark: for 1, 2, 4, ... upto <max_threads> threads
+ * (each pinned to a CPU), open(2) and close(2) the device in a tight loop for
+ * a few seconds and report the aggregate opens per second. Optionally, each
+ * open also does a read(2) of the secret (as a typical client would).
+ * Our pvtdata driver allocates a context on every open and frees it on every
+ * close; run this once with the driver loaded with use_cache=0 (generic
+ * kzalloc) and once with use_cache=1 (it's dedicated slab cache, the default),
+ * to compare the two.
+ * Tip: load the driver with verbose=0, else the printk's dominate.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define MAXBYTES    128   /* Must match the driver */
+
+static const char *devfile;
+static volatile int running;
+static int do_read;
+static pthread_barrier_t start_barrier;
+
+struct opener {
+	pthread_t tid;
+	int cpu;
+	long nopens;
+	int failed;
+};
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file max_threads [seconds [read]]\n"
+			" open(2)s and close(2)s the device in a loop from 1, 2, 4, ... upto\n"
+			" <max_threads> threads, each for <seconds> (default 3), reporting the\n"
+			" open rate. If <read> is 1, each open also reads the secret once.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *opener(void *arg)
+{
+	struct opener *o = arg;
+	char buf[MAXBYTES];
+	cpu_set_t cpus;
+	int fd;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(o->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	pthread_barrier_wait(&start_barrier);
+	while (running) {
+		fd = open(devfile, O_RDONLY);
+		if (fd < 0) {
+			perror("opener: open");
+			o->failed = 1;
+			break;
+		}
+		if (do_read && read(fd, buf, MAXBYTES) < 0) {
+			perror("opener: read");
+			o->failed = 1;
+			close(fd);
+			break;
+		}
+		close(fd);
+		o->nopens++;
+	}
+	return NULL;
+}
+
+/* Run 'nthrds' openers for 'secs' seconds; returns the aggregate opens/sec */
+static double run(int nthrds, int secs, int ncpus)
+{
+	struct opener *op = calloc(nthrds, sizeof(struct opener));
+	long total = 0;
+	double t;
+	int i;
+
+	if (!op) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&start_barrier, NULL, nthrds + 1);
+	running = 1;
+	for (i = 0; i < nthrds; i++) {
+		op[i].cpu = i % ncpus;
+		if (pthread_create(&op[i].tid, NULL, opener, &op[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	t = now_sec();
+	sleep(secs);
+	running = 0;
+	for (i = 0; i < nthrds; i++) {
+		pthread_join(op[i].tid, NULL);
+		if (op[i].failed)
+			exit(EXIT_FAILURE);
+		total += op[i].nopens;
+	}
+	t = now_sec() - t;
+	pthread_barrier_destroy(&start_barrier);
+	free(op);
+
+	printf(" %7d %12.0f %16.0f", nthrds, total / t, total / t / nthrds);
+	return total / t;
+}
+
+int main(int argc, char **argv)
+{
+	int maxthrds, secs, ncpus, n;
+	double rate, rate1 = 0;
+
+	if (argc < 3 || argc > 5) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	devfile = argv[1];
+	maxthrds = atoi(argv[2]);
+	secs = (argc >= 4 ? atoi(argv[3]) : 3);
+	do_read = (argc == 5 ? atoi(argv[4]) : 0);
+	if (maxthrds <= 0 || secs <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("%s: %s, %d CPUs online, %d s per run%s\n",
+		argv[0], devfile, ncpus, secs,
+		do_read ? ", one read(2) per open" : "");
+	printf(" threads      opens/s   opens/s/thread  speedup\n");
+	for (n = 1; ; n *= 2) {
+		if (n > maxthrds)
+			n = maxthrds;
+		rate = run(n, secs, ncpus);
+		if (n == 1)
+			rate1 = rate;
+		printf(" %8.2f\n", rate / rate1);
+		if (n == maxthrds)
+			break;
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -1,20 +1,29 @@
 #!/bin/bash
 # cr8devnode.sh
-# Simple utility script to create the device node for the miscdrv_rdwr 'misc'
-# class device driver
+# Simple utility script to create the device node(s) for the miscdrv_rdwr
+# 'misc' class device driver; one per device instance (module param ndevs):
+# /dev/miscdrv0, /dev/miscdrv1, ... (and /dev/miscdrv is instance 0)
 name=$(basename $0)
 OURMODNAME="miscdrv_rdwr_atomicint"
 
 MAJOR=10   # misc class is always major # 10
 unalias dmesg 2>/dev/null
-MINOR=$(dmesg |grep "${OURMODNAME}\:minor\=" |cut -d"=" -f2)
-[ -z "${MINOR}" ] && {
+# Only consider the most recent load of the module
+LINES=$(dmesg |grep "${OURMODNAME}\:dev[0-9]*\:minor\=")
+NDEVS=$(echo "${LINES}" |grep -c "\:dev0\:")
+[ -z "${LINES}" -o ${NDEVS} -eq 0 ] && {
   echo "${name}: failed to retreive the minor #, aborting ..."
   exit 1
 }
-echo "minor number is ${MINOR}"
+LINES=$(echo "${LINES}" |awk -v n=${NDEVS} '/:dev0:/ { c++ } c == n')
 
-sudo rm -f /dev/miscdrv   # rm any stale instance
-sudo mknod /dev/miscdrv c ${MAJOR} ${MINOR}
-ls -l /dev/miscdrv
+sudo rm -f /dev/miscdrv /dev/miscdrv[0-9]*   # rm any stale instances
+echo "${LINES}" | while read line ; do
+  DEV=$(echo "${line}" |sed 's/.*\:dev\([0-9]*\)\:minor=.*/\1/')
+  MINOR=$(echo "${line}" |cut -d"=" -f2)
+  echo "dev ${DEV}: minor number is ${MINOR}"
+  sudo mknod /dev/miscdrv${DEV} c ${MAJOR} ${MINOR}
+done
+sudo ln -s /dev/miscdrv0 /dev/miscdrv
+ls -l /dev/miscdrv*
 exit 0
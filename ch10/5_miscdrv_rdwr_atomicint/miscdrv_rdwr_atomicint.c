@@ -18,14 +18,23 @@
  * of with the spinlock.
  * The rest of the code remains identical.
  *
+ * Multiple instances: the module parameter ndevs (default 1) has the driver
+ * register that many misc devices, named lkdc_miscdrv_rdwr_atomicint<n>.
+ * Each instance has it's own context - secret, mutex, spinlock and stats -
+ * so clients of different instances never contend on a lock or share a cache
+ * line (only the global atomics ga and gb are common to all). The context of
+ * an instance is found via the miscdevice embedded in it (the misc core has
+ * filp->private_data point to the miscdevice when our open method runs); we
+ * then keep the context pointer in filp->private_data for the other methods.
+ *
  * For details, please refer the book, Ch 10.
  */
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/miscdevice.h>
 #include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
-#include <linux/mm.h>           // kvmalloc()
 #include <linux/fs.h>		// the fops structure
+#include <linux/uio.h>		// struct iov_iter, copy_[to|from]_iter()
 
 // copy_[to|from]_user()
 #include <linux/version.h>
@@ -39,6 +48,10 @@
 #include <linux/spinlock.h>
 #include <linux/atomic.h>
 #include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+#include "../../lkdc_misc_iter.h"
 
 #define OURMODNAME   "miscdrv_rdwr_atomicint"
 
@@ -53,6 +66,13 @@ module_param(buggy, int, 0600);
 MODULE_PARM_DESC(buggy,
  "If 1, cause an error by issuing a blocking call within a spinlock critical section");
 
+#define LKDC_MAXDEVS	64
+static uint ndevs = 1;
+module_param(ndevs, uint, 0444);
+MODULE_PARM_DESC(ndevs,
+ "Number of device instances to register (1-64, default 1); each has it's own"
+ " context: secret, locks and stats");
+
 static atomic_t ga, gb = ATOMIC_INIT(1); /* ga will be init to 0, gb to 1 */
 
 /* The driver 'context' data structure;
@@ -66,15 +86,17 @@ struct drv_ctx {
 	char oursecret[MAXBYTES];
 	struct mutex mutex;  // this mutex protects this data structure
 	spinlock_t spinlock; // ...so does this spinlock
-};
-static struct drv_ctx *ctx;
+	struct miscdevice mdev;  // this instance's misc device
+	char name[48];
+} ____cacheline_aligned;  // instances don't share a cache line
+static struct drv_ctx *ctxs;  // the array of 'ndevs' instances
 
-static inline void display_stats(int show_stats)
+static inline void display_stats(struct drv_ctx *ctx, int show_stats)
 {
 	if (1 == show_stats) {
 		spin_lock(&ctx->spinlock);
-		pr_info("%s: stats: tx=%d, rx=%d\n",
-			OURMODNAME, ctx->tx, ctx->rx);
+		pr_info("%s: %s: stats: tx=%d, rx=%d\n",
+			OURMODNAME, ctx->name, ctx->tx, ctx->rx);
 		spin_unlock(&ctx->spinlock);
 	}
 }
@@ -83,19 +105,24 @@ static inline void display_stats(int show_stats)
 /*
  * open_miscdrv_rdwr()
  * The driver's open 'method'; this 'hook' will get invoked by the kernel VFS
- * when the device file is opened. Here, we simply print out some relevant info.
+ * when the device file is opened. Here, we look up the instance's context,
+ * save it in the file structure's private_data, and print out some info.
  * The POSIX standard requires open() to return the file descriptor in success;
  * note, though, that this is done within the kernel VFS (when we return). So,
  * all we do here is return 0 indicating success.
  */
 static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-	PRINT_CTX(); // displays process (or intr) context info
+	struct drv_ctx *ctx = container_of(filp->private_data,
+					   struct drv_ctx, mdev);
+
+	VPRINT_CTX(); // displays process (or intr) context info
+	filp->private_data = ctx;
 
 	atomic_inc(&ga);
 	atomic_dec(&gb);
 
-	pr_info("%s:%s():\n"
+	vpr_info("%s:%s():\n"
 		" filename: \"%s\"\n"
 		" wrt open file: f_flags = 0x%x\n"
 		" ga = %d, gb = %d\n",
@@ -103,7 +130,8 @@ static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 	       filp->f_flags,
 	       atomic_read(&ga), atomic_read(&gb));
 
-	display_stats(1);
+	display_stats(ctx, verbose);
+	trace_lkdc_open(OURMODNAME, filp);
 	return 0;
 }
 
@@ -119,14 +147,15 @@ static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 				size_t count, loff_t *off)
 {
+	struct drv_ctx *ctx = filp->private_data;
 	int ret = count, secret_len, err_path = 0;
 
 	spin_lock(&ctx->spinlock);
 	secret_len = strlen(ctx->oursecret);
 	spin_unlock(&ctx->spinlock);
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
 	ret = -EINVAL;
@@ -173,12 +202,13 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 
 	// Update stats
 	ctx->tx += secret_len; // our 'transmit' is wrt this driver
-	pr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
+	vpr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
 			secret_len, ctx->tx, ctx->rx);
 out_ctu:
 	mutex_unlock(&ctx->mutex);
-	display_stats(err_path);
+	display_stats(ctx, err_path);
 out_notok:
+	trace_lkdc_read(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -194,35 +224,32 @@ out_notok:
 static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 				size_t count, loff_t *off)
 {
+	struct drv_ctx *ctx = filp->private_data;
 	int ret, err_path = 0;
-	void *kbuf = NULL;
+	size_t n = (count > MAXBYTES ? MAXBYTES : count);
+	char kbuf[MAXBYTES + 1];
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to write %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
-	ret = -ENOMEM;
-	kbuf = kvmalloc(count, GFP_KERNEL);
-	if (unlikely(!kbuf)) {
-		pr_warn("%s:%s(): kvmalloc() failed!\n", OURMODNAME, __func__);
-		err_path = 1;
-		goto out_nomem;
-	}
-	memset(kbuf, 0, count);
-
 	/* Copy in the user supplied buffer 'ubuf' - the data content to write -
 	 * via the copy_from_user() macro.
 	 * (FYI, the copy_from_user() macro is the *right* way to copy data from
 	 * kernel-space to userspace; the parameters are:
 	 *  'to-buffer', 'from-buffer', count
 	 *  Returns 0 on success, i.e., non-zero return implies an I/O fault).
+	 * We only ever keep (upto) MAXBYTES of it; so, that's all we copy in,
+	 * into a small on-stack buffer - there's no need to allocate (and free)
+	 * memory on every write.
 	 */
 	ret = -EFAULT;
-	if (copy_from_user(kbuf, ubuf, count)) {
+	if (copy_from_user(kbuf, ubuf, n)) {
 		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
 		err_path = 1;
 		goto out_cfu;
 	}
+	kbuf[n] = '\0';
 
 	/* In a 'real' driver, we would now actually write (for 'count' bytes)
 	 * the content of the 'ubuf' buffer to the device hardware (or whatever),
@@ -231,7 +258,7 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	 * new 'secret' into our driver 'context' structure, and unlock.
 	 */
 	spin_lock(&ctx->spinlock);
-	strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+	strlcpy(ctx->oursecret, kbuf, n);
 #if 0
 	print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
 				ctx, sizeof(struct drv_ctx));
@@ -240,7 +267,7 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	ctx->rx += count; // our 'receive' is wrt userspace
 
 	ret = count;
-	pr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
+	vpr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
 		count, ctx->tx, ctx->rx);
 
 	if (1 == buggy) {
@@ -252,9 +279,95 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 
 	spin_unlock(&ctx->spinlock);
 out_cfu:
-	kvfree(kbuf);
-	display_stats(err_path);
-out_nomem:
+	display_stats(ctx, err_path);
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * read_iter_miscdrv_rdwr()
+ * The vectored read; as in ch9/miscdrv_rdwr (which see): each segment is a
+ * separate read request. Here, of this device instance's secret, with the
+ * instance's mutex held across all the segments.
+ */
+static ssize_t read_iter_miscdrv_rdwr(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct drv_ctx *ctx = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(to);
+	ssize_t ret = -EINVAL;
+	int secret_len, err_path = 0;
+	bool aborted;
+
+	spin_lock(&ctx->spinlock);
+	secret_len = strlen(ctx->oursecret);
+	spin_unlock(&ctx->spinlock);
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, to->nr_segs);
+
+	if (secret_len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		err_path = 1;
+		goto out_notok;
+	}
+
+	mutex_lock(&ctx->mutex); /* copy_to_iter() may sleep */
+	ret = lkdc_iter_read(to, ctx->oursecret, secret_len, MAXBYTES,
+			     OURMODNAME, &aborted);
+	err_path = aborted;
+	if (ret > 0) {
+		// Update stats
+		ctx->tx += ret; // our 'transmit' is wrt userspace
+		vpr_info(" %zd bytes read, returning...\n", ret);
+	}
+	mutex_unlock(&ctx->mutex);
+	display_stats(ctx, err_path);
+out_notok:
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/* write_iter: the lkdc_iter_write() callback; install a segment's secret */
+static void set_secret_seg(void *arg, const char *kbuf, size_t n, size_t seglen)
+{
+	struct drv_ctx *ctx = arg;
+
+	spin_lock(&ctx->spinlock);
+	strlcpy(ctx->oursecret, kbuf, n);
+	ctx->rx += seglen; // our 'receive' is wrt userspace
+	spin_unlock(&ctx->spinlock);
+}
+
+/*
+ * write_iter_miscdrv_rdwr()
+ * The vectored write; as in ch9/miscdrv_rdwr (which see): each segment in turn
+ * becomes the secret (truncated to MAXBYTES). Here, this device instance's,
+ * installed under it's spinlock.
+ */
+static ssize_t write_iter_miscdrv_rdwr(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	struct drv_ctx *ctx = iocb->ki_filp->private_data;
+	size_t count = iov_iter_count(from);
+	char kbuf[MAXBYTES + 1];
+	ssize_t ret = 0;
+	int err_path;
+	bool aborted;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, from->nr_segs);
+
+	ret = lkdc_iter_write(from, kbuf, MAXBYTES, set_secret_seg, ctx,
+			      OURMODNAME, &aborted);
+	err_path = aborted;
+	if (ret > 0)
+		vpr_info(" %zd bytes written, returning...\n", ret);
+	display_stats(ctx, err_path);
+	trace_lkdc_write(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -266,24 +379,30 @@ out_nomem:
  */
 static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-        PRINT_CTX(); // displays process (or intr) context info
+	struct drv_ctx *ctx = filp->private_data;
+
+        VPRINT_CTX(); // displays process (or intr) context info
 
 	atomic_dec(&ga);
 	atomic_inc(&gb);
 
-        pr_info("%s:%s(): filename: \"%s\"\n"
+        vpr_info("%s:%s(): filename: \"%s\"\n"
 		" ga = %d, gb = %d\n",
 			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 			atomic_read(&ga), atomic_read(&gb));
-	display_stats(1);
+	display_stats(ctx, verbose);
+        trace_lkdc_release(OURMODNAME, filp);
         return 0;
 }
 
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,  // pin the module while any instance is open
 	.open = open_miscdrv_rdwr,
 	.read = read_miscdrv_rdwr,
 	.write = write_miscdrv_rdwr,
+	.read_iter = read_iter_miscdrv_rdwr,
+	.write_iter = write_iter_miscdrv_rdwr,
 	.llseek = no_llseek,             // dummy, we don't support lseek(2)
 	.release = close_miscdrv_rdwr,
 	/* As you learn more reg device drivers, you'll realize that the
@@ -293,63 +412,84 @@ static const struct file_operations lkdc_misc_fops = {
 	 */
 };
 
-static struct miscdevice lkdc_miscdev = {
-	.minor = MISC_DYNAMIC_MINOR, // kernel dynamically assigns a free minor#
-	.name = "lkdc_miscdrv_rdwr_spinlock",
-	    // populated within /sys/class/misc/ and /sys/devices/virtual/misc/
-	.fops = &lkdc_misc_fops,     // connect to 'functionality'
-};
-
 static int __init miscdrv_init_spinlock(void)
 {
-	int ret;
+	struct drv_ctx *ctx;
+	int ret, i;
 
-	if ((ret = misc_register(&lkdc_miscdev))) {
-		pr_notice("%s: misc device registration failed, aborting\n",
-			       OURMODNAME);
-		return ret;
+	if (!ndevs || ndevs > LKDC_MAXDEVS) {
+		pr_warn("%s: invalid ndevs (%u), must be in [1..%d]\n",
+			OURMODNAME, ndevs, LKDC_MAXDEVS);
+		return -EINVAL;
 	}
-	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
-			OURMODNAME, lkdc_miscdev.minor);
-
-	/* Now, for the purpose of creating the device node (file), we require
-	 * both the major and minor numbers. The major number will always be 10
-	 * (it's reserved for all 'misc' class devices). Reg the minor number's
-	 * retrieval, here's one (rather silly) technique:
-	 * Write the minor # into the kernel log in an easily grep-able way (so
-	 * that we can do a
-	 *  MINOR=$(dmesg |grep "^miscdrv_rdwr\:minor=" |cut -d"=" -f2)
-	 * from a shell script!). Of course, this approach is silly; in the
-	 * real world, superior techniques (typically 'udev') are used.
-	 * Here, we do provide a utility script (cr8devnode.sh) to do this and create the
-	 * device node.
-	 */
-	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
-
-	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
-	if (unlikely(!ctx)) {
-		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+	ctxs = kcalloc(ndevs, sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctxs)) {
+		pr_notice("%s: kcalloc failed! aborting\n", OURMODNAME);
 		return -ENOMEM;
 	}
-	mutex_init(&ctx->mutex);
-	spin_lock_init(&ctx->spinlock);
-	strlcpy(ctx->oursecret, "initmsg", 8);
+
+	for (i = 0; i < ndevs; i++) {
+		ctx = &ctxs[i];
+		mutex_init(&ctx->mutex);
+		spin_lock_init(&ctx->spinlock);
+		strlcpy(ctx->oursecret, "initmsg", 8);
 		/* Why don't we protect the above strlcpy() with the mutex lock?
 		 * It's working on shared writable data, yes?
 		 * No; this is the init code; it's guaranteed to run in exactly
 		 * one context (typically the insmod(8) process), thus there is
 		 * no concurrency possible here. The same goes for the cleanup
-		 * code path.
+		 * code path. (Also, the instance's context is set up before it's
+		 * device is registered, so no open can see it half-done.)
+		 */
+		snprintf(ctx->name, sizeof(ctx->name),
+			 "lkdc_miscdrv_rdwr_atomicint%d", i);
+		ctx->mdev.minor = MISC_DYNAMIC_MINOR; // kernel dynamically assigns a free minor#
+		ctx->mdev.name = ctx->name;
+		    // populated within /sys/class/misc/ and /sys/devices/virtual/misc/
+		ctx->mdev.fops = &lkdc_misc_fops;     // connect to 'functionality'
+
+		if ((ret = misc_register(&ctx->mdev))) {
+			pr_notice("%s: misc device %d registration failed, aborting\n",
+				       OURMODNAME, i);
+			goto out_unreg;
+		}
+		pr_info("%s: LKDC misc device %s (major # 10) registered, minor# = %d\n",
+				OURMODNAME, ctx->name, ctx->mdev.minor);
+
+		/* Now, for the purpose of creating the device node (file), we require
+		 * both the major and minor numbers. The major number will always be 10
+		 * (it's reserved for all 'misc' class devices). Reg the minor number's
+		 * retrieval, here's one (rather silly) technique:
+		 * Write the minor # into the kernel log in an easily grep-able way (so
+		 * that we can do a
+		 *  MINOR=$(dmesg |grep "^miscdrv_rdwr_atomicint\:dev0\:minor=" |cut -d"=" -f2)
+		 * from a shell script!). Of course, this approach is silly; in the
+		 * real world, superior techniques (typically 'udev') are used.
+		 * Here, we do provide a utility script (cr8devnode.sh) to do this and create the
+		 * device node(s).
 		 */
+		pr_info("%s:dev%d:minor=%d\n", OURMODNAME, i, ctx->mdev.minor);
+	}
 
 	return 0;		/* success */
+out_unreg:
+	while (--i >= 0)
+		misc_deregister(&ctxs[i].mdev);
+	for (i = 0; i < ndevs; i++)
+		mutex_destroy(&ctxs[i].mutex);
+	kzfree(ctxs);
+	return ret;
 }
 
 static void __exit miscdrv_exit_spinlock(void)
 {
-	mutex_destroy(&ctx->mutex);
-	kzfree(ctx);
-	misc_deregister(&lkdc_miscdev);
+	int i;
+
+	for (i = 0; i < ndevs; i++)
+		misc_deregister(&ctxs[i].mdev);
+	for (i = 0; i < ndevs; i++)
+		mutex_destroy(&ctxs[i].mutex);
+	kzfree(ctxs);
 	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
 }
 
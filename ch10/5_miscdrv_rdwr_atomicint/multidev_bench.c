@@ -0,0 +1,177 @@
+/*
+ * ch10/5_miscdrv_rdwr_atomicint/multidev_bench.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * Measures how the miscdrv_rdwr_atomicint driver's aggregate throughput
+ * scales with the number of device instances in use (load it with, say,
+ * ndevs=8 and create the device nodes with cr8devnode.sh).
+ * A fixed number of threads (each pinned to a CPU, each with it's own open)
+ * write and then read the secret in a loop, for a few seconds; thread t uses
+ * instance t % n, for n = 1, 2, 4, ... upto <ndevs> instances. With one
+ * instance, all the threads contend on it's locks; as the instances increase,
+ * the load spreads out and the aggregate rate should go up.
+ * Tip: load the driver with verbose=0, else the printk's dominate.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define MAXBYTES	128   /* must match the driver */
+
+static const char *devprefix;
+static volatile int running;
+static pthread_barrier_t start_barrier;
+
+struct worker {
+	pthread_t tid;
+	int cpu, dev;
+	long nops;
+	int failed;
+};
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file_prefix ndevs nthreads [seconds]\n"
+			" e.g. %s /dev/miscdrv 8 16\n"
+			" Runs <nthreads> threads doing write+read on 1, 2, 4, ... upto <ndevs>\n"
+			" device instances (<prefix>0, <prefix>1, ...) for <seconds> (default 3)\n"
+			" each, and reports the aggregate rate.\n",
+		       prg, prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	char path[256], buf[MAXBYTES], msg[32];
+	cpu_set_t cpus;
+	int fd, n;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	snprintf(path, sizeof(path), "%s%d", devprefix, w->dev);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror("worker: open");
+		w->failed = 1;
+	}
+	n = snprintf(msg, sizeof(msg), "secret-%d", w->cpu);
+	pthread_barrier_wait(&start_barrier);
+	if (fd < 0)
+		return NULL;
+
+	while (running) {
+		if (write(fd, msg, n) < 0 || read(fd, buf, MAXBYTES) < 0) {
+			perror("worker: write/read");
+			w->failed = 1;
+			break;
+		}
+		w->nops++;
+	}
+	close(fd);
+	return NULL;
+}
+
+/* Run 'nthrds' workers over 'ndevs' instances for 'secs' seconds;
+ * returns the aggregate (write+read) ops/sec
+ */
+static double run(int nthrds, int ndevs, int secs, int ncpus)
+{
+	struct worker *wk = calloc(nthrds, sizeof(struct worker));
+	long total = 0;
+	double t;
+	int i;
+
+	if (!wk) {
+		fprintf(stderr, "out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&start_barrier, NULL, nthrds + 1);
+	running = 1;
+	for (i = 0; i < nthrds; i++) {
+		wk[i].cpu = i % ncpus;
+		wk[i].dev = i % ndevs;
+		if (pthread_create(&wk[i].tid, NULL, worker, &wk[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	t = now_sec();
+	sleep(secs);
+	running = 0;
+	for (i = 0; i < nthrds; i++) {
+		pthread_join(wk[i].tid, NULL);
+		if (wk[i].failed)
+			exit(EXIT_FAILURE);
+		total += wk[i].nops;
+	}
+	t = now_sec() - t;
+	pthread_barrier_destroy(&start_barrier);
+	free(wk);
+	return total / t;
+}
+
+int main(int argc, char **argv)
+{
+	int maxdevs, nthrds, secs, ncpus, n;
+	double rate, rate1 = 0;
+
+	if (argc < 4 || argc > 5) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	devprefix = argv[1];
+	maxdevs = atoi(argv[2]);
+	nthrds = atoi(argv[3]);
+	secs = (argc == 5 ? atoi(argv[4]) : 3);
+	if (maxdevs <= 0 || nthrds <= 0 || secs <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("%s: %s0..%d, %d threads, %d CPUs online, %d s per run\n",
+		argv[0], devprefix, maxdevs - 1, nthrds, ncpus, secs);
+	printf(" instances   wr+rd ops/s   ops/s/instance  speedup\n");
+	for (n = 1; ; n *= 2) {
+		if (n > maxdevs)
+			n = maxdevs;
+		rate = run(nthrds, n, secs, ncpus);
+		if (n == 1)
+			rate1 = rate;
+		printf(" %9d %13.0f %16.0f %8.2f\n", n, rate, rate / n,
+			rate / rate1);
+		if (n == maxdevs)
+			break;
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,376 @@
+/*
+ * ch10/8_miscdrv_rdwr_kfifo/miscdrv_rdwr_kfifo.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * This driver is built upon our previous ch10/2_miscdrv_rdwr_spinlock/
+ * misc driver.
+ * The key difference: instead of a single 'secret' (where every write simply
+ * overwrites the previous one), we now have a message queue - a ring buffer of
+ * 'ring_depth' messages (a power of two; we use the kernel's kfifo). A write
+ * enqueues a message (of upto MAXBYTES), a read dequeues the oldest one.
+ * A reader of an empty queue (or a writer to a full one) blocks on a wait
+ * queue, unless the file was opened with O_NONBLOCK, in which case it gets
+ * -EAGAIN. We also implement the poll method; so, a consumer can sit in
+ * poll(2)/select(2)/epoll_wait(2), consuming no CPU, until a message arrives.
+ *
+ * The kfifo is lock-free when there's exactly one producer and one consumer;
+ * to allow many of each, we serialize the producers with a spinlock and the
+ * consumers with a mutex (so that a producer never contends with a consumer).
+ * The consumers' lock is a mutex as a reader copies the message to userspace
+ * - which may sleep - before it dequeues it; so, a faulting copy_to_user()
+ * leaves the message queued for the next reader, rather than losing it.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
+#include <linux/fs.h>		// the fops structure
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+
+// copy_[to|from]_user()
+#include <linux/version.h>
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4,11,0)
+#include <linux/uaccess.h>
+#else
+#include <asm/uaccess.h>
+#endif
+
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+
+#define OURMODNAME   "miscdrv_rdwr_kfifo"
+
+MODULE_AUTHOR("Kaiwan N Billimoria");
+MODULE_DESCRIPTION("LKDC book:ch10/8_miscdrv_rdwr_kfifo: simple misc"
+		" char driver with a kfifo message queue and poll support");
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_VERSION("0.1");
+
+#define RING_DEPTH_MAX	65536
+static int ring_depth = 64;
+module_param(ring_depth, int, 0444);
+MODULE_PARM_DESC(ring_depth,
+ "Max # of messages the queue holds (rounded up to a power of 2; default 64)");
+
+static int ga, gb = 1;
+DEFINE_SPINLOCK(lock1); // this spinlock protects the global integers ga and gb
+
+/* A message; it's what each element of the ring buffer holds */
+#define MAXBYTES    128
+struct lkdc_msg {
+	u32 len;
+	char data[MAXBYTES];
+};
+
+/* The driver 'context' data structure;
+ * all relevant 'state info' reg the driver is here.
+ */
+struct drv_ctx {
+	int tx, rx, err, myword;
+	u32 config1, config2;
+	u64 config3;
+	DECLARE_KFIFO_PTR(ring, struct lkdc_msg); // the message queue
+	spinlock_t wlock;  // serializes the producers (and protects rx)
+	struct mutex rlock; // serializes the consumers (and protects tx)
+	wait_queue_head_t readq;   // readers wait here for a message
+	wait_queue_head_t writeq;  // writers wait here for space
+};
+static struct drv_ctx *ctx;
+
+static inline void display_stats(int show_stats)
+{
+	if (1 == show_stats)
+		pr_info("%s: stats: tx=%d, rx=%d; %u message(s) queued\n",
+			OURMODNAME, ctx->tx, ctx->rx, kfifo_len(&ctx->ring));
+}
+
+/*--- The driver 'methods' follow ---*/
+/*
+ * open_miscdrv_rdwr()
+ * The driver's open 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is opened. Here, we simply print out some relevant info.
+ * The POSIX standard requires open() to return the file descriptor in success;
+ * note, though, that this is done within the kernel VFS (when we return). So,
+ * all we do here is return 0 indicating success.
+ */
+static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	spin_lock(&lock1);
+	ga ++; gb --;
+	spin_unlock(&lock1);
+
+	vpr_info("%s:%s():\n"
+		" filename: \"%s\"\n"
+		" wrt open file: f_flags = 0x%x\n"
+		" ga = %d, gb = %d\n",
+	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+	       filp->f_flags, ga, gb);
+	display_stats(verbose);
+
+	trace_lkdc_open(OURMODNAME, filp);
+	return 0;
+}
+
+/*
+ * read_miscdrv_rdwr()
+ * The driver's read 'method'; we dequeue the oldest message and copy it to
+ * the userspace app. If the queue's empty, we block until a writer enqueues
+ * something (or return -EAGAIN if the file is in non-blocking mode).
+ * Note: unlike our earlier drivers, we don't printk anything on the 'hot'
+ * paths (read and write) besides errors; at the message rates this driver is
+ * meant for, the printk's would very much dominate the cost. The lkdc_read
+ * and lkdc_write tracepoints are there instead.
+ */
+static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	struct lkdc_msg msg;
+	unsigned int got;
+	int ret;
+
+	if (count < MAXBYTES) {
+		pr_warn("%s:%s(): request # of bytes (%zu) is < required size"
+			" (%d), aborting read\n",
+				OURMODNAME, __func__, count, MAXBYTES);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Another consumer might beat us to the message that woke us up; so,
+	 * we loop until we actually manage to dequeue one */
+	do {
+		if (kfifo_is_empty(&ctx->ring)) {
+			ret = -EAGAIN;
+			if (filp->f_flags & O_NONBLOCK)
+				goto out;
+			ret = wait_event_interruptible(ctx->readq,
+					!kfifo_is_empty(&ctx->ring));
+			if (ret)
+				goto out;	/* -ERESTARTSYS; a signal */
+		}
+		if (mutex_lock_interruptible(&ctx->rlock)) {
+			ret = -ERESTARTSYS;
+			goto out;
+		}
+		/* Peek (copy) the oldest message, copy it out and only then
+		 * dequeue it: if the copy_to_user() fails, it stays queued */
+		got = kfifo_peek(&ctx->ring, &msg);
+		if (got) {
+			if (copy_to_user(ubuf, msg.data, msg.len)) {
+				mutex_unlock(&ctx->rlock);
+				pr_warn("%s:%s(): copy_to_user() failed\n",
+					OURMODNAME, __func__);
+				ret = -EFAULT;
+				goto out;
+			}
+			kfifo_skip(&ctx->ring);
+			ctx->tx += msg.len; // our 'transmit' is wrt userspace
+		}
+		mutex_unlock(&ctx->rlock);
+	} while (!got);
+
+	/* There's space now; let a (possibly) waiting writer in */
+	wake_up_interruptible(&ctx->writeq);
+	ret = msg.len;
+out:
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * write_miscdrv_rdwr()
+ * The driver's write 'method'; we enqueue the message passed to us. If the
+ * queue's full, we block until a reader makes space (or return -EAGAIN if the
+ * file is in non-blocking mode).
+ */
+static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	struct lkdc_msg msg;
+	unsigned int put;
+	int ret;
+
+	if (unlikely(!count || count > MAXBYTES)) {
+		pr_warn("%s:%s(): message size %zu invalid (must be 1..%d),"
+			" aborting write\n", OURMODNAME, __func__, count, MAXBYTES);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* Copy in the message first; copy_from_user() may sleep, so it must be
+	 * done outside the spinlock */
+	if (copy_from_user(msg.data, ubuf, count)) {
+		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
+		ret = -EFAULT;
+		goto out;
+	}
+	msg.len = count;
+
+	do {
+		if (kfifo_is_full(&ctx->ring)) {
+			ret = -EAGAIN;
+			if (filp->f_flags & O_NONBLOCK)
+				goto out;
+			ret = wait_event_interruptible(ctx->writeq,
+					!kfifo_is_full(&ctx->ring));
+			if (ret)
+				goto out;	/* -ERESTARTSYS; a signal */
+		}
+		spin_lock(&ctx->wlock);
+		put = kfifo_put(&ctx->ring, msg);
+		if (put)
+			ctx->rx += count; // our 'receive' is wrt userspace
+		spin_unlock(&ctx->wlock);
+	} while (!put);
+
+	/* There's a message now; wake up a (possibly) waiting reader */
+	wake_up_interruptible(&ctx->readq);
+	ret = count;
+out:
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * poll_miscdrv_rdwr()
+ * The driver's poll 'method'; it backs the poll(2), select(2) and epoll(7)
+ * syscalls. We register with both our wait queues (the VFS doesn't put the
+ * caller to sleep here; it does so, if required, once we return) and report
+ * whether a read and/or a write can proceed right now without blocking.
+ */
+static __poll_t poll_miscdrv_rdwr(struct file *filp, poll_table *wait)
+{
+	__poll_t mask = 0;
+
+	poll_wait(filp, &ctx->readq, wait);
+	poll_wait(filp, &ctx->writeq, wait);
+
+	if (!kfifo_is_empty(&ctx->ring))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (!kfifo_is_full(&ctx->ring))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+/*
+ * close_miscdrv_rdwr()
+ * The driver's close 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is closed (technically, when the file ref count drops
+ * to 0). Here, we simply print out some info, and return 0 indicating success.
+ */
+static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	spin_lock(&lock1);
+	ga --; gb ++;
+	spin_unlock(&lock1);
+
+	vpr_info("%s:%s(): filename: \"%s\"\n"
+		" ga = %d, gb = %d\n",
+			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+			ga, gb);
+	display_stats(verbose);
+	trace_lkdc_release(OURMODNAME, filp);
+	return 0;
+}
+
+/* The driver 'functionality' is encoded via the fops */
+static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,   // sleepers on readq / writeq pin the module
+	.open = open_miscdrv_rdwr,
+	.read = read_miscdrv_rdwr,
+	.write = write_miscdrv_rdwr,
+	.poll = poll_miscdrv_rdwr,
+	.llseek = no_llseek,             // dummy, we don't support lseek(2)
+	.release = close_miscdrv_rdwr,
+};
+
+static struct miscdevice lkdc_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR, // kernel dynamically assigns a free minor#
+	.name = "lkdc_miscdrv_rdwr_kfifo",
+	    // populated within /sys/class/misc/ and /sys/devices/virtual/misc/
+	.fops = &lkdc_misc_fops,     // connect to 'functionality'
+};
+
+static int __init miscdrv_init_kfifo(void)
+{
+	int ret;
+
+	if (ring_depth < 2 || ring_depth > RING_DEPTH_MAX) {
+		pr_warn("%s: ring_depth %d invalid (must be 2..%d), aborting\n",
+			OURMODNAME, ring_depth, RING_DEPTH_MAX);
+		return -EINVAL;
+	}
+
+	/* Set up the context (and the queue) before registering the device;
+	 * once registered, it can be opened and used right away */
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	/* kfifo_alloc() rounds the # of elements up to a power of 2 */
+	ret = kfifo_alloc(&ctx->ring, ring_depth, GFP_KERNEL);
+	if (ret) {
+		pr_notice("%s: kfifo_alloc failed! aborting\n", OURMODNAME);
+		goto out_kfifo;
+	}
+	spin_lock_init(&ctx->wlock);
+	mutex_init(&ctx->rlock);
+	init_waitqueue_head(&ctx->readq);
+	init_waitqueue_head(&ctx->writeq);
+
+	if ((ret = misc_register(&lkdc_miscdev))) {
+		pr_notice("%s: misc device registration failed, aborting\n",
+			       OURMODNAME);
+		goto out_misc;
+	}
+	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n"
+		" message queue: %u messages of upto %d bytes\n",
+			OURMODNAME, lkdc_miscdev.minor,
+			kfifo_size(&ctx->ring), MAXBYTES);
+
+	/* For the (rather silly) way we retrieve the minor #, see the comment
+	 * in ch10/1_miscdrv_rdwr_mutexlock/ */
+	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
+	return 0;		/* success */
+
+out_misc:
+	mutex_destroy(&ctx->rlock);
+	kfifo_free(&ctx->ring);
+out_kfifo:
+	kfree(ctx);
+	return ret;
+}
+
+static void __exit miscdrv_exit_kfifo(void)
+{
+	misc_deregister(&lkdc_miscdev);
+	mutex_destroy(&ctx->rlock);
+	kfifo_free(&ctx->ring);
+	kzfree(ctx);
+	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
+}
+
+module_init(miscdrv_init_kfifo);
+module_exit(miscdrv_exit_kfifo);
@@ -0,0 +1,197 @@
+/*
+ * ch10/8_miscdrv_rdwr_kfifo/msgq_bench.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * A small benchmark for the miscdrv_rdwr_kfifo message queue driver.
+ * A single consumer sits in epoll_wait(2) on the (non-blocking) device and
+ * drains messages as they arrive, while producer threads (each with it's own
+ * open of the device) write messages into it as fast as they can (blocking
+ * when the queue's full). We run it first with a single producer and then
+ * with the given number of producers, and report the messages/sec achieved.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define MAXBYTES    128   /* Must match the driver */
+
+static const char *devfile;
+static long msgs_per_producer;
+static size_t msgsz;
+static int nprod_done;   /* # of producers that have finished (or failed) */
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file num_producers [msgs_per_producer] [msg_size]\n"
+			" Runs a single-producer and then a <num_producers> producer test against\n"
+			" the message queue driver; one epoll-driven consumer drains the queue.\n"
+			" Defaults: 100000 messages per producer, of 64 bytes (max %d)\n",
+		       prg, MAXBYTES);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer(void *arg)
+{
+	char msg[MAXBYTES];
+	void *ret = NULL;
+	long i;
+	int fd;
+
+	fd = open(devfile, O_WRONLY);
+	if (fd < 0) {
+		perror("producer: open");
+		ret = (void *)-1;
+		goto out;
+	}
+	memset(msg, 'm', msgsz);
+	for (i = 0; i < msgs_per_producer; i++) {
+		if (write(fd, msg, msgsz) < 0) {
+			perror("producer: write");
+			ret = (void *)-1;
+			break;
+		}
+	}
+	close(fd);
+out:
+	/* Let the consumer know, so that it doesn't wait forever for messages
+	 * that a failed producer will never send */
+	__atomic_add_fetch(&nprod_done, 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+/* Returns the # of messages/sec achieved with 'nprod' producers, or -1 */
+static double run(int nprod)
+{
+	long total = nprod * msgs_per_producer, got = 0;
+	struct epoll_event ev = { .events = EPOLLIN };
+	pthread_t *tids;
+	char buf[MAXBYTES];
+	double t;
+	int fd, efd, i, done;
+
+	fd = open(devfile, O_RDONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror("consumer: open");
+		return -1;
+	}
+	efd = epoll_create1(0);
+	if (efd < 0 || epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll");
+		close(fd);
+		return -1;
+	}
+	/* Drain anything left over from a previous run */
+	while (read(fd, buf, MAXBYTES) > 0)
+		;
+
+	tids = calloc(nprod, sizeof(pthread_t));
+	if (!tids) {
+		fprintf(stderr, "out of memory!\n");
+		close(efd); close(fd);
+		return -1;
+	}
+
+	nprod_done = 0;
+	t = now_sec();
+	for (i = 0; i < nprod; i++) {
+		if (pthread_create(&tids[i], NULL, producer, NULL)) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	while (got < total) {
+		/* Once all the producers are done, whatever's left is already
+		 * queued; so, after one more (final) drain, we stop */
+		done = (__atomic_load_n(&nprod_done, __ATOMIC_ACQUIRE) == nprod);
+		/* A timeout, so that we notice the producers being done even
+		 * if (having failed) they never send another message */
+		if (!done && epoll_wait(efd, &ev, 1, 100) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+		/* drain the queue; the fd's non-blocking */
+		while (read(fd, buf, MAXBYTES) > 0)
+			got++;
+		if (errno != EAGAIN) {
+			perror("consumer: read");
+			break;
+		}
+		if (done)
+			break;
+	}
+	t = now_sec() - t;
+	for (i = 0; i < nprod; i++)
+		pthread_join(tids[i], NULL);
+
+	free(tids);
+	close(efd);
+	close(fd);
+	if (got < total) {
+		fprintf(stderr, " got only %ld of %ld messages (a producer failed?)\n",
+			got, total);
+		return -1;
+	}
+	return got / t;
+}
+
+int main(int argc, char **argv)
+{
+	int nprod;
+	double rate;
+
+	if (argc < 3 || argc > 5) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	devfile = argv[1];
+	nprod = atoi(argv[2]);
+	msgs_per_producer = (argc >= 4 ? atol(argv[3]) : 100000);
+	msgsz = (argc == 5 ? (size_t)atoi(argv[4]) : 64);
+	if (nprod <= 0 || msgs_per_producer <= 0 || !msgsz || msgsz > MAXBYTES) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%s: %ld messages of %zu bytes per producer\n",
+		argv[0], msgs_per_producer, msgsz);
+	rate = run(1);
+	if (rate < 0)
+		exit(EXIT_FAILURE);
+	printf(" %3d producer(s), 1 consumer: %12.0f msgs/s\n", 1, rate);
+	if (nprod > 1) {
+		rate = run(nprod);
+		if (rate < 0)
+			exit(EXIT_FAILURE);
+		printf(" %3d producer(s), 1 consumer: %12.0f msgs/s\n", nprod, rate);
+	}
+	exit(EXIT_SUCCESS);
+}
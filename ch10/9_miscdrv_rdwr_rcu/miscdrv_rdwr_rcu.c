@@ -0,0 +1,377 @@
+/*
+ * ch10/9_miscdrv_rdwr_rcu/miscdrv_rdwr_rcu.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 10 : Synchronization Primitives and How to Use Them
+ ****************************************************************
+ * Brief Description:
+ * This driver is built upon our previous ch10/5_miscdrv_rdwr_atomicint/
+ * misc driver.
+ * The key difference: we protect the 'secret' with RCU (Read-Copy-Update)
+ * instead of with locks. The secret now lives in a separately allocated object
+ * that's reached via an __rcu pointer in the driver context:
+ * - a reader (the read method) takes no lock at all; within an RCU read-side
+ *   critical section, it snapshots the current secret object into a local
+ *   buffer, and then copies that to userspace
+ * - a writer builds a brand new secret object, publishes it with
+ *   rcu_assign_pointer() (writers are serialized by a spinlock among
+ *   themselves, never against readers) and hands the old one to kfree_rcu(),
+ *   which frees it only after all pre-existing readers are done with it.
+ * The statistics are per-CPU counters (see ch10/6_percpuvar), so that readers
+ * don't have to write to any shared memory either.
+ * The functionality (the get and set of the 'secret') remains identical.
+ *
+ * For details, please refer the book, Ch 10.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/miscdevice.h>
+#include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
+#include <linux/fs.h>		// the fops structure
+
+// copy_[to|from]_user()
+#include <linux/version.h>
+#if LINUX_VERSION_CODE > KERNEL_VERSION(4,11,0)
+#include <linux/uaccess.h>
+#else
+#include <asm/uaccess.h>
+#endif
+
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+
+#define OURMODNAME   "miscdrv_rdwr_rcu"
+
+MODULE_AUTHOR("Kaiwan N Billimoria");
+MODULE_DESCRIPTION("LKDC book:ch10/9_miscdrv_rdwr_rcu: simple misc"
+		" char driver with an RCU-protected secret");
+MODULE_LICENSE("Dual MIT/GPL");
+MODULE_VERSION("0.1");
+
+static atomic_t ga, gb = ATOMIC_INIT(1); /* ga will be init to 0, gb to 1 */
+
+#define MAXBYTES    128
+/* The 'secret' object; a new one is allocated on every update */
+struct secret {
+	int len;
+	char data[MAXBYTES];
+	struct rcu_head rcu;  // for kfree_rcu()
+};
+
+/* Per-CPU statistics */
+struct drv_stats {
+	int tx, rx, err;
+};
+
+/* The driver 'context' data structure;
+ * all relevant 'state info' reg the driver is here.
+ */
+struct drv_ctx {
+	int myword;
+	u32 config1, config2;
+	u64 config3;
+	struct secret __rcu *oursecret; // readers: RCU; writers: + the spinlock
+	spinlock_t wrlock;  // serializes the writers (only)
+	struct drv_stats __percpu *stats;
+};
+static struct drv_ctx *ctx;
+
+static inline void display_stats(int show_stats)
+{
+	int cpu, tx = 0, rx = 0, err = 0;
+
+	if (1 != show_stats)
+		return;
+	/* Fold the per-CPU stats; the result is approximate, of course */
+	for_each_possible_cpu(cpu) {
+		tx += per_cpu_ptr(ctx->stats, cpu)->tx;
+		rx += per_cpu_ptr(ctx->stats, cpu)->rx;
+		err += per_cpu_ptr(ctx->stats, cpu)->err;
+	}
+	pr_info("%s: stats: tx=%d, rx=%d, err=%d\n", OURMODNAME, tx, rx, err);
+}
+
+/*--- The driver 'methods' follow ---*/
+/*
+ * open_miscdrv_rdwr()
+ * The driver's open 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is opened. Here, we simply print out some relevant info.
+ * The POSIX standard requires open() to return the file descriptor in success;
+ * note, though, that this is done within the kernel VFS (when we return). So,
+ * all we do here is return 0 indicating success.
+ */
+static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_inc(&ga);
+	atomic_dec(&gb);
+
+	vpr_info("%s:%s():\n"
+		" filename: \"%s\"\n"
+		" wrt open file: f_flags = 0x%x\n"
+		" ga = %d, gb = %d\n",
+	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+	       filp->f_flags,
+	       atomic_read(&ga), atomic_read(&gb));
+
+	display_stats(verbose);
+	trace_lkdc_open(OURMODNAME, filp);
+	return 0;
+}
+
+/*
+ * read_miscdrv_rdwr()
+ * The driver's read 'method'; it has effectively 'taken over' the read syscall
+ * functionality!
+ * The POSIX standard requires that the read() and write() system calls return
+ * the number of bytes read or written on success, 0 on EOF and -1 (-ve errno)
+ * on failure; here, we copy the 'secret' from our driver context structure
+ * to the userspace app.
+ */
+static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	struct secret *sp;
+	char snap[MAXBYTES];
+	int ret, secret_len;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes\n",
+			OURMODNAME, __func__, current->comm, count);
+
+	if (count < MAXBYTES) {
+		pr_warn("%s:%s(): request # of bytes (%zu) is < required size"
+			" (%d), aborting read\n",
+				OURMODNAME, __func__, count, MAXBYTES);
+		ret = -EINVAL;
+		goto out_notok;
+	}
+
+	/* The RCU read-side critical section: no lock, no atomic, no write to
+	 * shared memory. We must not sleep within it though; hence, we take a
+	 * snapshot here and do the (possibly sleeping) copy_to_user() after */
+	rcu_read_lock();
+	sp = rcu_dereference(ctx->oursecret);
+	secret_len = sp->len;
+	memcpy(snap, sp->data, secret_len);
+	rcu_read_unlock();
+
+	if (secret_len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		ret = -EINVAL;
+		goto out_notok;
+	}
+	if (copy_to_user(ubuf, snap, secret_len)) {
+		pr_warn("%s:%s(): copy_to_user() failed\n", OURMODNAME, __func__);
+		ret = -EFAULT;
+		goto out_notok;
+	}
+	ret = secret_len;
+
+	// Update stats
+	this_cpu_add(ctx->stats->tx, secret_len); // our 'transmit' is wrt userspace
+	vpr_info(" %d bytes read, returning...\n", secret_len);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+
+out_notok:
+	this_cpu_inc(ctx->stats->err);
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * write_miscdrv_rdwr()
+ * The driver's write 'method'; it has effectively 'taken over' the write syscall
+ * functionality!
+ * The POSIX standard requires that the read() and write() system calls return
+ * the number of bytes read or written on success, 0 on EOF and -1 (-ve errno)
+ * on failure; Here, we accept the string passed to us and make it the new
+ * 'secret'. This is the RCU 'update' side: we never modify the current secret
+ * object in place (readers may be looking at it); we allocate a new one,
+ * publish it, and defer the freeing of the old one.
+ */
+static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
+				size_t count, loff_t *off)
+{
+	size_t n = (count >= MAXBYTES ? MAXBYTES - 1 : count);
+	struct secret *new, *old;
+	ssize_t ret;
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %zu bytes\n",
+			OURMODNAME, __func__, current->comm, count);
+
+	/* As with our other drivers, a 0-byte write leaves the secret as is;
+	 * publishing an empty one would fail every read from then on */
+	if (!n) {
+		ret = 0;
+		goto out_ok;
+	}
+
+	/* Build the new object, copying the user data straight into it */
+	new = kzalloc(sizeof(struct secret), GFP_KERNEL);
+	if (unlikely(!new)) {
+		pr_warn("%s:%s(): kzalloc() failed!\n", OURMODNAME, __func__);
+		ret = -ENOMEM;
+		goto out_notok;
+	}
+	if (copy_from_user(new->data, ubuf, n)) {
+		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
+		kfree(new);
+		ret = -EFAULT;
+		goto out_notok;
+	}
+	/* As with our other drivers, the secret is a string (the data is
+	 * NULL-terminated by the kzalloc(); any embedded NULL ends it) */
+	new->len = strlen(new->data);
+	if (!new->len) {   // (a leading NULL); same as above
+		kfree(new);
+		ret = count;
+		goto out_ok;
+	}
+
+	/* Publish it; rcu_assign_pointer() ensures the object's content is
+	 * visible before the pointer to it is */
+	spin_lock(&ctx->wrlock);
+	old = rcu_dereference_protected(ctx->oursecret,
+					lockdep_is_held(&ctx->wrlock));
+	rcu_assign_pointer(ctx->oursecret, new);
+	spin_unlock(&ctx->wrlock);
+
+	/* Free the old object once all current readers are done with it */
+	kfree_rcu(old, rcu);
+
+	// Update stats
+	this_cpu_add(ctx->stats->rx, count); // our 'receive' is wrt userspace
+	vpr_info(" %zu bytes written, returning...\n", count);
+	ret = count;
+out_ok:
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+
+out_notok:
+	this_cpu_inc(ctx->stats->err);
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * close_miscdrv_rdwr()
+ * The driver's close 'method'; this 'hook' will get invoked by the kernel VFS
+ * when the device file is closed (technically, when the file ref count drops
+ * to 0). Here, we simply print out some info, and return 0 indicating success.
+ */
+static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
+{
+	VPRINT_CTX(); // displays process (or intr) context info
+
+	atomic_dec(&ga);
+	atomic_inc(&gb);
+
+	vpr_info("%s:%s(): filename: \"%s\"\n"
+		" ga = %d, gb = %d\n",
+			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
+			atomic_read(&ga), atomic_read(&gb));
+	display_stats(verbose);
+	trace_lkdc_release(OURMODNAME, filp);
+	return 0;
+}
+
+/* The driver 'functionality' is encoded via the fops */
+static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,   // an open fd pins the module (and the secret)
+	.open = open_miscdrv_rdwr,
+	.read = read_miscdrv_rdwr,
+	.write = write_miscdrv_rdwr,
+	.llseek = no_llseek,             // dummy, we don't support lseek(2)
+	.release = close_miscdrv_rdwr,
+};
+
+static struct miscdevice lkdc_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR, // kernel dynamically assigns a free minor#
+	.name = "lkdc_miscdrv_rdwr_rcu",
+	    // populated within /sys/class/misc/ and /sys/devices/virtual/misc/
+	.fops = &lkdc_misc_fops,     // connect to 'functionality'
+};
+
+static int __init miscdrv_init_rcu(void)
+{
+	struct secret *sp;
+	int ret;
+
+	/* Set up the context before registering the device; once registered,
+	 * it can be opened and used right away */
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	ret = -ENOMEM;
+	ctx->stats = alloc_percpu(struct drv_stats);
+	if (unlikely(!ctx->stats)) {
+		pr_notice("%s: alloc_percpu failed! aborting\n", OURMODNAME);
+		goto out_stats;
+	}
+	sp = kzalloc(sizeof(struct secret), GFP_KERNEL);
+	if (unlikely(!sp)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		goto out_secret;
+	}
+	strlcpy(sp->data, "initmsg", 8);
+	sp->len = strlen(sp->data);
+	spin_lock_init(&ctx->wrlock);
+	/* No readers can exist yet; a plain (non-ordered) store will do */
+	RCU_INIT_POINTER(ctx->oursecret, sp);
+
+	if ((ret = misc_register(&lkdc_miscdev))) {
+		pr_notice("%s: misc device registration failed, aborting\n",
+			       OURMODNAME);
+		goto out_misc;
+	}
+	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
+			OURMODNAME, lkdc_miscdev.minor);
+	/* For the (rather silly) way we retrieve the minor #, see the comment
+	 * in ch10/1_miscdrv_rdwr_mutexlock/ */
+	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
+	return 0;		/* success */
+
+out_misc:
+	kfree(sp);
+out_secret:
+	free_percpu(ctx->stats);
+out_stats:
+	kfree(ctx);
+	return ret;
+}
+
+static void __exit miscdrv_exit_rcu(void)
+{
+	misc_deregister(&lkdc_miscdev);
+	/* Wait for any in-flight kfree_rcu() callbacks to run before the
+	 * module (and thus the code they may refer to) goes away */
+	rcu_barrier();
+	/* No readers remain; we can simply free the current object */
+	kfree(rcu_dereference_protected(ctx->oursecret, 1));
+	free_percpu(ctx->stats);
+	kzfree(ctx);
+	pr_info("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
+}
+
+module_init(miscdrv_init_rcu);
+module_exit(miscdrv_exit_rcu);
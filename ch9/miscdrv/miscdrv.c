@@ -22,6 +22,9 @@
 #include <linux/miscdevice.h>
 #include <linux/fs.h>            /* the fops, file data structures */
 #include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
 
 #define OURMODNAME   "miscdrv"
 
@@ -40,14 +43,15 @@ MODULE_VERSION("0.1");
  */
 static int open_miscdrv(struct inode *inode, struct file *filp)
 {
-	PRINT_CTX(); // displays process (or intr) context info
+	VPRINT_CTX(); // displays process (or intr) context info
 
-	pr_info("%s:%s():\n"
+	vpr_info("%s:%s():\n"
 		" filename: \"%s\"\n"
 		" wrt open file: f_flags = 0x%x\n",
 	       OURMODNAME, __func__,
 	       filp->f_path.dentry->d_iname, filp->f_flags);
 
+	trace_lkdc_open(OURMODNAME, filp);
 	return 0;
 }
 
@@ -62,7 +66,8 @@ static int open_miscdrv(struct inode *inode, struct file *filp)
 static ssize_t read_miscdrv(struct file *filp, char __user *ubuf,
 				size_t count, loff_t *off)
 {
-	pr_info("%s:%s():\n", OURMODNAME, __func__);
+	vpr_info("%s:%s():\n", OURMODNAME, __func__);
+	trace_lkdc_read(OURMODNAME, count, count);
 	return count;
 }
 
@@ -77,7 +82,8 @@ static ssize_t read_miscdrv(struct file *filp, char __user *ubuf,
 static ssize_t write_miscdrv(struct file *filp, const char __user *ubuf,
 				size_t count, loff_t *off)
 {
-	pr_info("%s:%s():\n", OURMODNAME, __func__);
+	vpr_info("%s:%s():\n", OURMODNAME, __func__);
+	trace_lkdc_write(OURMODNAME, count, count);
 	return count;
 }
 
@@ -90,8 +96,9 @@ static ssize_t write_miscdrv(struct file *filp, const char __user *ubuf,
  */
 static int close_miscdrv(struct inode *inode, struct file *filp)
 {
-	pr_info("%s:%s(): filename: \"%s\"\n",
+	vpr_info("%s:%s(): filename: \"%s\"\n",
 	       OURMODNAME, __func__, filp->f_path.dentry->d_iname);
+	trace_lkdc_release(OURMODNAME, filp);
 	return 0;
 }
 
@@ -12,9 +12,19 @@
  ****************************************************************
  * Brief Description:
  * Generic read-write test bed for demo drivers.
+ * The 'batch' option (2) compares N gets/sets of the secret done as
+ * individual read(2)/write(2) syscalls against the same N done via the BATCH
+ * ioctl (see ch10/1_miscdrv_rdwr_mutexlock/); only that driver supports it.
+ * The 'load' option (3) turns it into a load generator, usable against any of
+ * the ch9 / ch10 misc drivers: <nworkers> threads (or processes), optionally
+ * pinned one per CPU, issue a mix of read(2)s and write(2)s of the secret for
+ * <seconds>, either on a persistent fd or with an open(2)/close(2) around every
+ * op; it reports the op rate and the latency percentiles (p50, p99, p99.9 and
+ * max), from per-worker HDR-style (log-linear) histograms.
  *
  * For details, please refer the book, Ch 9.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -22,18 +32,602 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <pthread.h>
+#include "../../ch10/1_miscdrv_rdwr_mutexlock/miscdrv_rdwr_ioctl.h"
 
 #define READ	0
 #define WRITE	1
+#define BATCH	2
+#define LOAD	3
+
+#define MAXBYTES	128	/* Must match the driver */
+#define BATCH_SZ	64	/* # of ops per BATCH ioctl */
 
 static int stay_alive = 0;
 
 static inline void usage(char *prg)
 {
-	fprintf(stderr,"Usage: %s opt=read/write device_file num_bytes_to_read\n"
+	fprintf(stderr,"Usage: %s opt=read/write/batch/load device_file num_bytes_to_read|num_ops|seconds\n"
+			"  [load options]\n"
 			" opt = '0'  => we shall issue the read(2)\n"
-			" opt = '1' => we shall issue the write(2)\n",
-		       prg);
+			" opt = '1' => we shall issue the write(2)\n"
+			" opt = '2' => batch: do <num_ops> alternating sets and gets of the secret,\n"
+			"  first via read(2)/write(2), then via BATCH ioctl(2)s of %d ops each,\n"
+			"  and compare the rates (overwrites the secret)\n"
+			" opt = '3' => load: generate load for <seconds>; the load options are:\n"
+			"  -t n : # of worker threads (default 1)\n"
+			"  -P   : the workers are processes, not threads\n"
+			"  -w n : percentage of the ops that are write(2)s (default 10)\n"
+			"  -s n : payload size, bytes (default %d; reads are at least %d)\n"
+			"  -c   : pin worker i to CPU i %% #CPUs\n"
+			"  -o   : open(2) and close(2) the device around every op\n"
+			"  -u n : also run it via io_uring, with n ops in flight per worker,\n"
+			"         and compare (not with -o)\n"
+			"  -S   : with -u, use an SQPOLL (kernel-side submission) thread;\n"
+			"         the device fd is registered (a 'fixed file'), as kernels\n"
+			"         before 5.11 require; needs root before 5.11, too\n"
+			"  -q   : terse: print just one line per run: ops/s, p50, p99,\n"
+			"         p99.9 and max latency (us), CPU time (s) and # of errors\n"
+			"  e.g. %s 3 /dev/miscdrv 5 -t 8 -w 20 -c\n",
+		       prg, BATCH_SZ, MAXBYTES, MAXBYTES, prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, long nops, double secs)
+{
+	printf(" %-24s: %9ld ops in %8.3f s = %12.0f ops/s (%8.1f ns/op)\n",
+		what, nops, secs, nops / secs, secs * 1e9 / nops);
+}
+
+/*
+ * Do 'nops' operations - alternately, set the secret and get it back - first
+ * with a syscall per op, then batched via the BATCH ioctl.
+ */
+static int batch_test(int fd, long nops)
+{
+	static const char msg[] = "batched-secret";
+	static char getbuf[BATCH_SZ][MAXBYTES];
+	struct lkdc_op ops[BATCH_SZ];
+	struct lkdc_batch batch;
+	long i, nerr = 0;
+	double t;
+	int j, n = 0;
+
+	t = now_sec();
+	for (i = 0; i < nops; i += 2) {
+		if (write(fd, msg, sizeof(msg)) < 0) {
+			perror("write failed");
+			return -1;
+		}
+		if (read(fd, getbuf[0], MAXBYTES) < 0) {
+			perror("read failed");
+			return -1;
+		}
+	}
+	report("read(2)/write(2)", i, now_sec() - t);
+
+	for (j = 0; j < BATCH_SZ; j++) {
+		memset(&ops[j], 0, sizeof(ops[j]));
+		if (j % 2 == 0) {
+			ops[j].op = LKDC_OP_SET;
+			ops[j].buf = (unsigned long)msg;
+			ops[j].len = sizeof(msg);
+		} else {
+			ops[j].op = LKDC_OP_GET;
+			ops[j].buf = (unsigned long)getbuf[j];
+			ops[j].len = MAXBYTES;
+		}
+	}
+	batch.ops = (unsigned long)ops;
+
+	t = now_sec();
+	for (i = 0; i < nops; i += n) {
+		n = (nops - i < BATCH_SZ ? nops - i : BATCH_SZ);
+		batch.nops = n;
+		if (ioctl(fd, LKDC_IOC_BATCH, &batch) < 0) {
+			perror("ioctl BATCH failed");
+			return -1;
+		}
+		nerr += batch.nerr;
+	}
+	report("BATCH ioctl(2)", i, now_sec() - t);
+
+	/* sanity: the last batch's ops must all have succeeded */
+	for (j = 0; j < n; j++) {
+		if (ops[j].status < 0) {
+			fprintf(stderr, " op #%d (type %u) failed, status %lld\n",
+				j, ops[j].op, (long long)ops[j].status);
+			return -1;
+		}
+	}
+	if (nerr) {
+		fprintf(stderr, " %ld batched op(s) failed\n", nerr);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The 'load' mode
+ * The latencies are recorded in HDR-style (log-linear) histograms: values
+ * below 2^HIST_SUB_BITS ns are counted exactly; beyond, each power-of-2 range
+ * is split into 2^HIST_SUB_BITS equal sub-buckets, so any value is off by at
+ * most 1/2^HIST_SUB_BITS (~1.6%), whatever it's magnitude; a fixed amount of
+ * memory covers 1 ns to 2^HIST_MAX_EXP ns (~18 min).
+ */
+#define HIST_SUB_BITS	6
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP	40
+#define HIST_NBUCKETS	(HIST_SUB + (HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct lg_worker {
+	int id;
+	long nrd, nwr, nerr;
+	unsigned long long max_ns;
+	unsigned long long hist[HIST_NBUCKETS];
+};
+
+/* Shared with the workers; mmap-ed MAP_SHARED, so that worker processes can
+ * report back too */
+struct lg_shared {
+	volatile int running;
+	pthread_barrier_t start_barrier;
+	struct lg_worker w[];
+};
+
+static struct {
+	const char *dev;
+	int nworkers, procs, write_pct, pin, open_per_op, secs, ncpus;
+	unsigned int qd;   /* > 0: io_uring, with this queue depth */
+	int sqpoll;
+	int terse;   /* print just one (machine-readable) line of results */
+	size_t payload;
+	struct lg_shared *sh;
+} lg = { .nworkers = 1, .write_pct = 10, .payload = MAXBYTES };
+
+static inline int hist_index(unsigned long long v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);   /* v is in [2^e, 2^(e+1)) */
+	if (e > HIST_MAX_EXP)
+		return HIST_NBUCKETS - 1;
+	return HIST_SUB + (e - HIST_SUB_BITS) * HIST_SUB +
+		((v >> (e - HIST_SUB_BITS)) - HIST_SUB);
+}
+
+/* The (lowest) value that bucket 'i' represents */
+static inline unsigned long long hist_value(int i)
+{
+	int e;
+
+	if (i < HIST_SUB)
+		return i;
+	e = (i - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+	return (unsigned long long)(HIST_SUB + (i - HIST_SUB) % HIST_SUB)
+		<< (e - HIST_SUB_BITS);
+}
+
+/* The value at percentile 'pct' (0..100) of the 'total' values in 'h' */
+static unsigned long long hist_percentile(const unsigned long long *h,
+					  unsigned long long total, double pct)
+{
+	unsigned long long want = (unsigned long long)(total * pct / 100.0), sum = 0;
+	int i;
+
+	for (i = 0; i < HIST_NBUCKETS; i++) {
+		sum += h[i];
+		if (sum > want)
+			return hist_value(i);
+	}
+	return hist_value(HIST_NBUCKETS - 1);
+}
+
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A small, fast PRNG (xorshift64); one state per worker */
+static inline unsigned long long xorshift64(unsigned long long *s)
+{
+	unsigned long long x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+/* Account one op, of latency 'dt' ns, that returned 'res' */
+static inline void lg_record(struct lg_worker *w, unsigned long long dt,
+			     int wr, long res)
+{
+	w->hist[hist_index(dt)]++;
+	if (dt > w->max_ns)
+		w->max_ns = dt;
+	if (res < 0)
+		w->nerr++;
+	else if (wr)
+		w->nwr++;
+	else
+		w->nrd++;
+}
+
+/*
+ * The io_uring flavour of the load: we use the raw io_uring_setup(2) and
+ * io_uring_enter(2) syscalls and the rings mmap-ed from the kernel directly
+ * (no liburing). Each worker keeps <qd> reads/writes in flight on it's ring,
+ * topping the submission queue (SQ) back up as completions arrive; the
+ * latency of an op is from when it's queued to when it's completion is
+ * reaped. With SQPOLL, a kernel thread polls the SQ, so - as long as it's
+ * awake - submitting costs no syscall at all; before 5.11, the SQ poll thread
+ * only accepts registered files, so (with SQPOLL) we always register the
+ * device fd and use it as fixed file index 0.
+ */
+struct lg_ring {
+	int fd;
+	unsigned int sq_mask, cq_mask, *sq_head, *sq_tail, *sq_flags, *sq_array;
+	unsigned int *cq_head, *cq_tail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+};
+
+static void ring_exit(struct lg_ring *r)
+{
+	munmap(r->sqes, r->sqes_sz);
+	munmap(r->cq_ptr, r->cq_sz);
+	munmap(r->sq_ptr, r->sq_sz);
+	close(r->fd);
+}
+
+static int ring_init(struct lg_ring *r, unsigned int qd, int fd)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	if (lg.sqpoll) {
+		p.flags = IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;   /* ms */
+	}
+	r->fd = syscall(__NR_io_uring_setup, qd, &p);
+	if (r->fd < 0) {
+		perror("worker: io_uring_setup");
+		return -1;
+	}
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED ||
+	    r->sqes == MAP_FAILED) {
+		perror("worker: mmap io_uring");
+		close(r->fd);
+		return -1;
+	}
+	r->sq_head = r->sq_ptr + p.sq_off.head;
+	r->sq_tail = r->sq_ptr + p.sq_off.tail;
+	r->sq_mask = *(unsigned int *)(r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_flags = r->sq_ptr + p.sq_off.flags;
+	r->sq_array = r->sq_ptr + p.sq_off.array;
+	r->cq_head = r->cq_ptr + p.cq_off.head;
+	r->cq_tail = r->cq_ptr + p.cq_off.tail;
+	r->cq_mask = *(unsigned int *)(r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = r->cq_ptr + p.cq_off.cqes;
+
+	if (lg.sqpoll &&
+	    syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, &fd, 1) < 0) {
+		perror("worker: io_uring_register (files)");
+		ring_exit(r);
+		return -1;
+	}
+	return 0;
+}
+
+static void lg_uring_loop(struct lg_worker *w, struct lg_ring *r, int fd,
+			  unsigned long long *seed)
+{
+	size_t rdlen = (lg.payload < MAXBYTES ? MAXBYTES : lg.payload);
+	unsigned int qd = lg.qd, inflight = 0, nfree = qd, tail, head, flags;
+	unsigned int *freelist = malloc(qd * sizeof(unsigned int));
+	unsigned long long *t0 = malloc(qd * sizeof(unsigned long long));
+	char *bufs = malloc(qd * rdlen);
+	unsigned char *wr = malloc(qd);
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned int i, slot, nsub;
+	long ret;
+
+	if (!freelist || !t0 || !bufs || !wr) {
+		fprintf(stderr, "worker: out of memory!\n");
+		w->nerr = -1;
+		goto out;
+	}
+	memset(bufs, 'x', qd * rdlen);
+	for (i = 0; i < qd; i++)
+		freelist[i] = i;   /* each slot: a buffer, a start time, an op type */
+
+	while (lg.sh->running || inflight) {
+		/* Top up the SQ: one op per free slot (while we're running) */
+		tail = *r->sq_tail;
+		nsub = 0;
+		while (lg.sh->running && nfree) {
+			slot = freelist[--nfree];
+			wr[slot] = ((int)(xorshift64(seed) % 100) < lg.write_pct);
+			sqe = &r->sqes[tail & r->sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = wr[slot] ? IORING_OP_WRITE : IORING_OP_READ;
+			if (lg.sqpoll) {
+				sqe->fd = 0;   /* index into the registered files */
+				sqe->flags = IOSQE_FIXED_FILE;
+			} else
+				sqe->fd = fd;
+			sqe->addr = (unsigned long)(bufs + slot * rdlen);
+			sqe->len = (wr[slot] ? lg.payload : rdlen);
+			sqe->off = 0;   /* our drivers ignore the offset */
+			sqe->user_data = slot;
+			r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+			t0[slot] = now_ns();
+			tail++;
+			nsub++;
+		}
+		if (nsub)   /* publish the new SQEs to the kernel */
+			__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+		inflight += nsub;
+		if (!inflight)   /* we stopped (just now); nothing to wait for */
+			break;
+
+		/* Submit (unless the SQ poll thread does so) and wait for (at
+		 * least) one completion */
+		flags = IORING_ENTER_GETEVENTS;
+		if (lg.sqpoll) {
+			/* The tail store must be visible before we check if the
+			 * poll thread sleeps, else it could miss our SQEs and we
+			 * not wake it: a full barrier (store -> load) */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) &
+			    IORING_SQ_NEED_WAKEUP)
+				flags |= IORING_ENTER_SQ_WAKEUP;
+			nsub = 0;
+		}
+		if (syscall(__NR_io_uring_enter, r->fd, nsub, 1, flags, NULL, 0) < 0) {
+			perror("worker: io_uring_enter");
+			w->nerr = -1;
+			goto out;
+		}
+
+		/* Reap the completions */
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & r->cq_mask];
+			slot = cqe->user_data;
+			ret = cqe->res;
+			lg_record(w, now_ns() - t0[slot], wr[slot], ret);
+			freelist[nfree++] = slot;
+			inflight--;
+			head++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+out:
+	free(wr);
+	free(bufs);
+	free(t0);
+	free(freelist);
+}
+
+static void *lg_worker(void *arg)
+{
+	struct lg_worker *w = arg;
+	unsigned long long seed = 0x9E3779B97F4A7C15ULL * (w->id + 1), t0;
+	size_t rdlen = (lg.payload < MAXBYTES ? MAXBYTES : lg.payload);
+	char *buf = malloc(rdlen);
+	int fd = -1, wr, ok;
+	struct lg_ring ring = { .fd = -1 };
+	cpu_set_t cpus;
+	ssize_t n;
+
+	if (lg.pin) {
+		CPU_ZERO(&cpus);
+		CPU_SET(w->id % lg.ncpus, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			perror("worker: sched_setaffinity");
+	}
+	if (buf)
+		memset(buf, 'x', rdlen);
+	if (!lg.open_per_op && (fd = open(lg.dev, O_RDWR)) < 0)
+		perror("worker: open");
+	ok = (buf && (lg.open_per_op || fd >= 0));
+	if (ok && lg.qd && ring_init(&ring, lg.qd, fd) < 0)
+		ok = 0;
+	pthread_barrier_wait(&lg.sh->start_barrier);
+	if (!ok) {
+		w->nerr = -1;
+		return NULL;
+	}
+
+	if (lg.qd) {
+		lg_uring_loop(w, &ring, fd, &seed);
+		ring_exit(&ring);
+		goto out;
+	}
+	while (lg.sh->running) {
+		wr = ((int)(xorshift64(&seed) % 100) < lg.write_pct);
+		t0 = now_ns();
+		if (lg.open_per_op && (fd = open(lg.dev, O_RDWR)) < 0)
+			n = -1;
+		else {
+			n = (wr ? write(fd, buf, lg.payload) : read(fd, buf, rdlen));
+			if (lg.open_per_op)
+				close(fd);
+		}
+		lg_record(w, now_ns() - t0, wr, n);
+	}
+out:
+	if (!lg.open_per_op)
+		close(fd);
+	free(buf);
+	return NULL;
+}
+
+/* The CPU time (user+sys, s) used by us - all our threads - and our reaped
+ * children; the driver code runs in our context, so it's included */
+static double cpu_sec(void)
+{
+	struct rusage self, kids;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &kids);
+	return self.ru_utime.tv_sec + self.ru_utime.tv_usec / 1e6 +
+		self.ru_stime.tv_sec + self.ru_stime.tv_usec / 1e6 +
+		kids.ru_utime.tv_sec + kids.ru_utime.tv_usec / 1e6 +
+		kids.ru_stime.tv_sec + kids.ru_stime.tv_usec / 1e6;
+}
+
+static int load_test(void)
+{
+	static unsigned long long hist[HIST_NBUCKETS];
+	unsigned long long total = 0, max_ns = 0;
+	long nrd = 0, nwr = 0, nerr = 0;
+	pthread_barrierattr_t battr;
+	pthread_t *tids = NULL;
+	pid_t *pids = NULL;
+	size_t shsz;
+	double t, cpu = cpu_sec();
+	int i, j;
+
+	memset(hist, 0, sizeof(hist));
+	shsz = sizeof(struct lg_shared) + lg.nworkers * sizeof(struct lg_worker);
+	lg.sh = mmap(NULL, shsz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (lg.sh == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	pthread_barrierattr_init(&battr);
+	pthread_barrierattr_setpshared(&battr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&lg.sh->start_barrier, &battr, lg.nworkers + 1);
+	lg.sh->running = 1;
+
+	if (lg.procs)
+		pids = calloc(lg.nworkers, sizeof(pid_t));
+	else
+		tids = calloc(lg.nworkers, sizeof(pthread_t));
+	if (!pids && !tids) {
+		fprintf(stderr, "out of memory!\n");
+		return -1;
+	}
+	for (i = 0; i < lg.nworkers; i++) {
+		lg.sh->w[i].id = i;
+		if (lg.procs) {
+			pids[i] = fork();
+			if (pids[i] < 0) {
+				perror("fork");
+				exit(EXIT_FAILURE);
+			}
+			if (!pids[i]) {
+				lg_worker(&lg.sh->w[i]);
+				_exit(0);
+			}
+		} else if (pthread_create(&tids[i], NULL, lg_worker, &lg.sh->w[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&lg.sh->start_barrier);
+	t = now_sec();
+	sleep(lg.secs);
+	lg.sh->running = 0;
+	for (i = 0; i < lg.nworkers; i++) {
+		if (lg.procs)
+			waitpid(pids[i], NULL, 0);
+		else
+			pthread_join(tids[i], NULL);
+	}
+	t = now_sec() - t;
+	cpu = cpu_sec() - cpu;
+
+	for (i = 0; i < lg.nworkers; i++) {
+		struct lg_worker *w = &lg.sh->w[i];
+
+		if (w->nerr < 0) {
+			fprintf(stderr, " worker %d failed to start\n", i);
+			return -1;
+		}
+		nrd += w->nrd;
+		nwr += w->nwr;
+		nerr += w->nerr;
+		if (w->max_ns > max_ns)
+			max_ns = w->max_ns;
+		for (j = 0; j < HIST_NBUCKETS; j++)
+			hist[j] += w->hist[j];
+	}
+	total = nrd + nwr + nerr;
+	free(pids);
+	free(tids);
+	pthread_barrier_destroy(&lg.sh->start_barrier);
+	munmap(lg.sh, shsz);
+	if (!total) {
+		fprintf(stderr, " no ops completed?\n");
+		return -1;
+	}
+
+	if (lg.terse) {
+		/* ops/s p50 p99 p99.9 max (us) cpu_s errors */
+		printf("%.0f %.2f %.2f %.2f %.2f %.3f %ld\n", total / t,
+			hist_percentile(hist, total, 50) / 1e3,
+			hist_percentile(hist, total, 99) / 1e3,
+			hist_percentile(hist, total, 99.9) / 1e3, max_ns / 1e3,
+			cpu, nerr);
+		return 0;
+	}
+	if (lg.qd)
+		printf(" [io_uring, qd %u%s]", lg.qd, lg.sqpoll ? ", SQPOLL" : "");
+	else
+		printf(" [read(2)/write(2)]");
+	printf(" %d %s%s, %d%% writes, %zu byte payload, %s fd, %.2f s\n",
+		lg.nworkers, lg.procs ? "process(es)" : "thread(s)",
+		lg.pin ? " (pinned)" : "", lg.write_pct, lg.payload,
+		lg.open_per_op ? "open-per-op" : "persistent", t);
+	printf(" ops: %llu (reads %ld, writes %ld, errors %ld) = %.0f ops/s\n",
+		total, nrd, nwr, nerr, total / t);
+	printf(" latency (us): p50 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+		hist_percentile(hist, total, 50) / 1e3,
+		hist_percentile(hist, total, 99) / 1e3,
+		hist_percentile(hist, total, 99.9) / 1e3, max_ns / 1e3);
+	printf(" CPU time (user+sys): %.3f s = %.2f us/op\n", cpu, cpu * 1e6 / total);
+	if (nerr)
+		fprintf(stderr, " warning: %ld op(s) failed; Tip: see kernel log\n",
+			nerr);
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -43,23 +637,86 @@ int main(int argc, char **argv)
 	char *buf = NULL;
 	size_t num = 0;
 	
+	if (argc >= 4 && atoi(argv[1]) == LOAD) {
+		lg.dev = argv[2];
+		lg.secs = atoi(argv[3]);
+		optind = 4;
+		while ((opt = getopt(argc, argv, "t:Pw:s:cou:Sq")) != -1) {
+			switch (opt) {
+			case 't': lg.nworkers = atoi(optarg); break;
+			case 'P': lg.procs = 1; break;
+			case 'w': lg.write_pct = atoi(optarg); break;
+			case 's': lg.payload = strtoul(optarg, NULL, 0); break;
+			case 'c': lg.pin = 1; break;
+			case 'o': lg.open_per_op = 1; break;
+			case 'u': lg.qd = atoi(optarg); break;
+			case 'S': lg.sqpoll = 1; break;
+			case 'q': lg.terse = 1; break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (optind != argc || lg.secs <= 0 || lg.nworkers <= 0 ||
+		    lg.write_pct < 0 || lg.write_pct > 100 || !lg.payload ||
+		    (lg.qd && lg.open_per_op) || (lg.sqpoll && !lg.qd)) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		lg.ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (!lg.terse)
+			printf("%s: load on %s:\n", argv[0], lg.dev);
+		if (lg.qd) {   /* first, the classic mode, for comparison */
+			unsigned int qd = lg.qd;
+
+			lg.qd = 0;
+			if (load_test() < 0)
+				exit(EXIT_FAILURE);
+			lg.qd = qd;
+		}
+		if (load_test() < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+
 	if( argc != 4 ) {
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
 	opt = atoi(argv[1]);
-	if (opt != 0 && opt != 1) {
+	if (opt != READ && opt != WRITE && opt != BATCH) {
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	if (1 == opt)
+	if (WRITE == opt)
 		flags = O_WRONLY;
+	else if (BATCH == opt)
+		flags = O_RDWR;
 
 	if( (fd=open(argv[2], flags, 0)) == -1)
 		perror("open"),exit(1);
 	printf("Device file %s opened (in %s mode): fd=%d\n",
-		       argv[2], (flags == O_RDONLY ? "read-only" : "write-only"), fd);
+		       argv[2], (flags == O_RDONLY ? "read-only" :
+		(flags == O_WRONLY ? "write-only" : "read-write")), fd);
+
+	if (BATCH == opt) {
+		long nops = atol(argv[3]);
+
+		if (nops <= 0) {
+			fprintf(stderr,"%s: number of ops '%s' invalid.\n",
+				argv[0], argv[3]);
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		if (batch_test(fd, nops) < 0) {
+			fprintf(stderr, "Tip: see kernel log\n");
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		exit(EXIT_SUCCESS);
+	}
 
 	num = atoi(argv[3]);
 	if ((num < 0) || (num > INT_MAX)) {
@@ -20,6 +20,21 @@
  * So, when a userpace process (or thread) opens the device file and issues a
  * read upon it, we pass back the 'secret' to it. When it writes data to us,
  * we consider that data to be the new 'secret' and update it here (in memory).
+ * The secret lives within a page of it's own; userspace may also mmap() this
+ * page (read-only) and retrieve the secret directly, without any syscall; see
+ * the layout (and the 'gen' count protocol) in miscdrv_rdwr.h .
+ * The vectored readv(2)/writev(2) are supported via the read_iter/write_iter
+ * methods; each segment of the I/O vector is treated as a separate request.
+ * Optionally (the 'bufsize' module parameter), the driver runs in 'store'
+ * mode instead: the device then is a large, page-backed (vmalloc-ed) data
+ * store that's read and written just like a (fixed size) file - partial
+ * reads, the file offset honoured, lseek(2), pread(2)/pwrite(2) - so that,
+ * for example, threads can work on different regions of it in parallel.
+ * In store mode, splice(2) (and thus sendfile(2)) is supported as well; data
+ * then moves between the store and a pipe without passing through userspace.
+ * Large write(2)s to the store (see the 'direct_thresh' module parameter) pin
+ * the user pages up front and copy from them under the lock; any page faults
+ * are thus taken before, and not while, holding off every reader.
  *
  * For details, please refer the book, Ch 9.
  */
@@ -27,8 +42,13 @@
 #include <linux/module.h>
 #include <linux/miscdevice.h>
 #include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
-#include <linux/mm.h>           // kvmalloc()
+#include <linux/mm.h>           // remap_pfn_range(), get_user_pages_fast()
+#include <linux/highmem.h>      // kmap(), kunmap()
+#include <linux/vmalloc.h>      // vzalloc(), vfree()
 #include <linux/fs.h>		// the fops
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/uio.h>		// struct iov_iter, copy_[to|from]_iter()
 
 // copy_[to|from]_user()
 #include <linux/version.h>
@@ -39,6 +59,11 @@
 #endif
 
 #include "../../convenient.h"
+#define CREATE_TRACE_POINTS
+#include "../../lkdc_misc_trace.h"
+#include "../../lkdc_misc_verbose.h"
+#include "../../lkdc_misc_iter.h"
+#include "miscdrv_rdwr.h"
 
 #define OURMODNAME   "miscdrv_rdwr"
 MODULE_AUTHOR("Kaiwan N Billimoria");
@@ -47,6 +72,19 @@ MODULE_DESCRIPTION("LKDC book:ch9/miscdrv_rdwr: simple misc char driver with"
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_VERSION("0.1");
 
+#define BUFSIZE_MAX	(64 << 20)	/* 64 MB */
+static int bufsize;
+module_param(bufsize, int, 0444);
+MODULE_PARM_DESC(bufsize,
+ "If > 0, run in 'store' mode: the device is a data store of this many bytes"
+ " (max 64 MB), read/written like a file; default 0 (the 'secret' mode)");
+
+static unsigned int direct_thresh = 256 * 1024;
+module_param(direct_thresh, uint, 0644);
+MODULE_PARM_DESC(direct_thresh,
+ "Store mode: write(2)s of at least this many bytes pin the user pages and copy"
+ " from them; 0 disables this (default 256 KB)");
+
 static int ga, gb = 1; /* ignore for now ... */
 
 /* The driver 'context' data structure;
@@ -56,12 +94,178 @@ struct drv_ctx {
 	int tx, rx, err, myword;
 	u32 config1, config2;
 	u64 config3;
-#define MAXBYTES    128   /* Must match the userspace app; we should actually
-			   * use a common header file for things like this */
-	char oursecret[MAXBYTES];
+	char *oursecret;      /* points into the secret page below */
+	struct lkdc_secret_page *spage; /* a page; can be mmap-ed by userspace */
+	struct mutex wrlock;  /* serializes writers to the secret page */
+	/* 'store' mode only: */
+	void *store;          /* 'bufsize' bytes, vmalloc-ed */
+	struct rw_semaphore store_rwsem; /* readers share it, writers don't */
 };
 static struct drv_ctx *ctx;
 
+/*
+ * The writer side of the 'gen' count protocol (see miscdrv_rdwr.h); the
+ * caller must hold ctx->wrlock, as two concurrent writers would otherwise
+ * leave the count in an inconsistent (possibly odd) state.
+ */
+static inline void secret_update_begin(struct lkdc_secret_page *sp)
+{
+	WRITE_ONCE(sp->gen, sp->gen + 1);  /* odd: update in progress */
+	smp_wmb();
+}
+
+static inline void secret_update_end(struct lkdc_secret_page *sp)
+{
+	smp_wmb();
+	WRITE_ONCE(sp->gen, sp->gen + 1);  /* even: stable */
+}
+
+/* Update the secret to the (kernel-space) string 'kbuf' of 'count' bytes */
+static void set_secret(const char *kbuf, size_t count)
+{
+	mutex_lock(&ctx->wrlock);
+	secret_update_begin(ctx->spage);
+	strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+	ctx->spage->len = strlen(ctx->oursecret);
+	secret_update_end(ctx->spage);
+	mutex_unlock(&ctx->wrlock);
+}
+
+/*--- 'store' mode ---*/
+/*
+ * In store mode, the device behaves like a fixed size file of 'bufsize'
+ * bytes: a read or write transfers whatever part of the request lies within
+ * the store, starting at the file offset, and advances the offset. Readers
+ * take the rwsem shared, so that they (of any region) can run in parallel;
+ * a writer excludes everyone else, so that a read never sees a half-done
+ * write. (As with our kfifo driver, there are no printk's on these paths.)
+ */
+static ssize_t store_read(char __user *ubuf, size_t count, loff_t *off)
+{
+	ssize_t ret;
+
+	down_read(&ctx->store_rwsem);
+	ret = simple_read_from_buffer(ubuf, count, off, ctx->store, bufsize);
+	up_read(&ctx->store_rwsem);
+	return ret;
+}
+
+static ssize_t store_write(const char __user *ubuf, size_t count, loff_t *off)
+{
+	ssize_t ret;
+
+	if (*off >= bufsize && count)
+		return -ENOSPC;   /* as with a full (fixed size) file */
+	down_write(&ctx->store_rwsem);
+	ret = simple_write_to_buffer(ctx->store, bufsize, off, ubuf, count);
+	up_write(&ctx->store_rwsem);
+	return ret;
+}
+
+/*
+ * The 'direct' (pinned page) write path, for large write(2)s.
+ * With the copy path above, copy_from_user() runs with the rwsem held for
+ * write; every page fault on the user buffer (it may not be resident yet, or
+ * be copy-on-write) is thus taken while all readers are held off, and the
+ * more so the larger the write. Here, we first pin the pages of the user
+ * buffer - faulting them in as required - without holding any lock, and only
+ * then take the rwsem and copy the data straight from those pages into the
+ * store. The cost: the pinning itself, and a (small) array of page pointers;
+ * so, it only pays off above some size - the 'direct_thresh' parameter.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+#define lkdc_pin_pages(start, nr, pages)  pin_user_pages_fast(start, nr, 0, pages)
+#define lkdc_unpin_pages(pages, nr)       unpin_user_pages(pages, nr)
+#else
+#define lkdc_pin_pages(start, nr, pages)  get_user_pages_fast(start, nr, 0, pages)
+static inline void lkdc_unpin_pages(struct page **pages, unsigned long nr)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr; i++)
+		put_page(pages[i]);
+}
+#endif
+
+static ssize_t store_write_pinned(const char __user *ubuf, size_t count,
+				  loff_t *off)
+{
+	unsigned long uaddr = (unsigned long)ubuf, pgoff = offset_in_page(uaddr);
+	struct page **pages;
+	size_t n, done = 0, len;
+	int nr, pinned, i;
+	char *kaddr;
+
+	if (*off >= bufsize)
+		return -ENOSPC;
+	n = min_t(size_t, count, bufsize - *off);
+	nr = DIV_ROUND_UP(pgoff + n, PAGE_SIZE);
+
+	pages = kvmalloc_array(nr, sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	pinned = lkdc_pin_pages(uaddr & PAGE_MASK, nr, pages);
+	if (pinned <= 0) {
+		kvfree(pages);
+		return pinned ? pinned : -EFAULT;
+	}
+	if (pinned < nr)   /* a short write then; only what we could pin */
+		n = (size_t)pinned * PAGE_SIZE - pgoff;
+
+	down_write(&ctx->store_rwsem);
+	for (i = 0; i < pinned; i++) {
+		len = min_t(size_t, n - done, PAGE_SIZE - pgoff);
+		kaddr = kmap(pages[i]);
+		memcpy(ctx->store + *off + done, kaddr + pgoff, len);
+		kunmap(pages[i]);
+		done += len;
+		pgoff = 0;
+	}
+	up_write(&ctx->store_rwsem);
+
+	lkdc_unpin_pages(pages, pinned);
+	kvfree(pages);
+	*off += done;
+	return done;
+}
+
+/* The vectored versions; the I/O vector is simply one contiguous request */
+static ssize_t store_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	size_t n, copied;
+
+	if (iocb->ki_pos >= bufsize)
+		return 0;   /* EOF */
+	n = min_t(size_t, iov_iter_count(to), bufsize - iocb->ki_pos);
+
+	down_read(&ctx->store_rwsem);
+	copied = copy_to_iter(ctx->store + iocb->ki_pos, n, to);
+	up_read(&ctx->store_rwsem);
+	if (!copied && n)
+		return -EFAULT;
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+static ssize_t store_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	size_t n, copied;
+
+	if (!iov_iter_count(from))
+		return 0;
+	if (iocb->ki_pos >= bufsize)
+		return -ENOSPC;
+	n = min_t(size_t, iov_iter_count(from), bufsize - iocb->ki_pos);
+
+	down_write(&ctx->store_rwsem);
+	copied = copy_from_iter(ctx->store + iocb->ki_pos, n, from);
+	up_write(&ctx->store_rwsem);
+	if (!copied)
+		return -EFAULT;
+	iocb->ki_pos += copied;
+	return copied;
+}
+
 /*--- The driver 'methods' follow ---*/
 /*
  * open_miscdrv_rdwr()
@@ -73,16 +277,17 @@ static struct drv_ctx *ctx;
  */
 static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-	PRINT_CTX(); // displays process (or intr) context info
+	VPRINT_CTX(); // displays process (or intr) context info
 
 	ga ++; gb --;
-	pr_info("%s:%s():\n"
+	vpr_info("%s:%s():\n"
 		" filename: \"%s\"\n"
 		" wrt open file: f_flags = 0x%x\n"
 		" ga = %d, gb = %d\n",
 	       OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 	       filp->f_flags, ga, gb);
 
+	trace_lkdc_open(OURMODNAME, filp);
 	return 0;
 }
 
@@ -100,8 +305,14 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 {
 	int ret = count, secret_len = strlen(ctx->oursecret);
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
+	if (bufsize) {
+		ret = store_read(ubuf, count, off);
+		trace_lkdc_read(OURMODNAME, count, ret);
+		return ret;
+	}
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
 	ret = -EINVAL;
@@ -138,9 +349,10 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 
 	// Update stats
 	ctx->tx += secret_len; // our 'transmit' is wrt this driver
-	pr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
+	vpr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
 			secret_len, ctx->tx, ctx->rx);
 out_notok:
+	trace_lkdc_read(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -157,44 +369,49 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 				size_t count, loff_t *off)
 {
 	int ret = count;
-	void *kbuf = NULL;
+	char kbuf[MAXBYTES + 1];
 
-	PRINT_CTX();
+	if (bufsize) {
+		if (direct_thresh && count >= direct_thresh)
+			ret = store_write_pinned(ubuf, count, off);
+		else
+			ret = store_write(ubuf, count, off);
+		trace_lkdc_write(OURMODNAME, count, ret);
+		return ret;
+	}
+
+	VPRINT_CTX();
 	if (unlikely(count > MAXBYTES)) {   /* paranoia */
 		pr_warn("%s:%s(): count %zu exceeds max # of bytes allowed, "
 			"aborting write\n", OURMODNAME, __func__, count);
-		goto out_nomem;
+		ret = -EINVAL;
+		goto out_notok;
 	}
-	pr_info("%s:%s():\n %s wants to write %ld bytes\n",
+	vpr_info("%s:%s():\n %s wants to write %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
-	ret = -ENOMEM;
-	kbuf = kvmalloc(count, GFP_KERNEL);
-	if (unlikely(!kbuf)) {
-		pr_warn("%s:%s(): kvmalloc() failed!\n", OURMODNAME, __func__);
-		goto out_nomem;
-	}
-	memset(kbuf, 0, count);
-
 	/* Copy in the user supplied buffer 'ubuf' - the data content to write -
 	 * via the copy_from_user() macro.
 	 * (FYI, the copy_from_user() macro is the *right* way to copy data from
 	 * kernel-space to userspace; the parameters are:
 	 *  'to-buffer', 'from-buffer', count
 	 *  Returns 0 on success, i.e., non-zero return implies an I/O fault).
+	 * The write is at most MAXBYTES, so we stage it in a small on-stack
+	 * buffer; there's no need to allocate (and free) memory on every write.
 	 */
 	ret = -EFAULT;
 	if (copy_from_user(kbuf, ubuf, count)) {
 		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
-		goto out_cfu;
+		goto out_notok;
 	}
+	kbuf[count] = '\0';
 
 	/* In a 'real' driver, we would now actually write (for 'count' bytes)
 	 * the content of the 'ubuf' buffer to the device hardware (or whatever),
 	 * and then return.
 	 * Here, we do nothing, we just pretend we've done everything :-)
 	 */
-	strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+	set_secret(kbuf, count);
 #if 0
 	/* Might be useful to actually see a hex dump of the driver 'context' */
 	print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
@@ -204,12 +421,106 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	ctx->rx += count; // our 'receive' is wrt this driver
 
 	ret = count;
-	pr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
+	vpr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
 		count, ctx->tx, ctx->rx);
 
-out_cfu:
-	kvfree(kbuf);
-out_nomem:
+out_notok:
+	trace_lkdc_write(OURMODNAME, count, ret);
+	return ret;
+}
+
+/*
+ * read_iter_miscdrv_rdwr()
+ * The driver's read_iter 'method'; the VFS invokes it for the vectored reads -
+ * readv(2), preadv[2](2) - (a plain read(2) still goes to our read method).
+ * Each segment of the I/O vector is treated as a separate read request: so,
+ * just as with the read(2), each must be at least MAXBYTES in size, and each
+ * receives a copy of the secret (see lkdc_misc_iter.h, shared with the ch10
+ * drivers). Thus, a single syscall can retrieve the secret into many buffers;
+ * we return the total number of bytes copied.
+ */
+static ssize_t read_iter_miscdrv_rdwr(struct kiocb *iocb, struct iov_iter *to)
+{
+	int secret_len = strlen(ctx->oursecret);
+	size_t count = iov_iter_count(to);
+	ssize_t ret = -EINVAL;
+	bool aborted;
+
+	if (bufsize) {
+		ret = store_read_iter(iocb, to);
+		goto out_notok;
+	}
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, to->nr_segs);
+
+	if (secret_len <= 0) {
+		pr_warn("%s:%s(): whoops, something's wrong, the 'secret' isn't"
+			" available..; aborting read\n",
+			OURMODNAME, __func__);
+		goto out_notok;
+	}
+
+	ret = lkdc_iter_read(to, ctx->oursecret, secret_len, MAXBYTES,
+			     OURMODNAME, &aborted);
+	if (ret <= 0)
+		goto out_notok;
+
+	// Update stats
+	ctx->tx += ret; // our 'transmit' is wrt this driver
+	vpr_info(" %zd bytes read, returning... (stats: tx=%d, rx=%d)\n",
+			ret, ctx->tx, ctx->rx);
+out_notok:
+	trace_lkdc_read(OURMODNAME, count, ret);
+	return ret;
+}
+
+/* write_iter: the lkdc_iter_write() callback; install a segment's secret */
+static void set_secret_seg(void *arg, const char *kbuf, size_t n, size_t seglen)
+{
+	set_secret(kbuf, n);
+}
+
+/*
+ * write_iter_miscdrv_rdwr()
+ * The driver's write_iter 'method'; the VFS invokes it for the vectored
+ * writes - writev(2), pwritev[2](2). As with the read_iter method, each
+ * segment of the I/O vector is treated as a separate write request, i.e., each
+ * one in turn becomes the new secret, in a single syscall. A segment longer
+ * than MAXBYTES is truncated to it (the rest is accepted but discarded), as
+ * all our misc drivers' write_iter methods do (see lkdc_misc_iter.h); (only)
+ * the write(2) method here rejects an oversized request. As we keep at most
+ * MAXBYTES of a segment, we stage it in a small on-stack buffer.
+ */
+static ssize_t write_iter_miscdrv_rdwr(struct kiocb *iocb,
+				       struct iov_iter *from)
+{
+	size_t count = iov_iter_count(from);
+	char kbuf[MAXBYTES + 1];
+	ssize_t ret = 0;
+	bool aborted;
+
+	if (bufsize) {
+		ret = store_write_iter(iocb, from);
+		goto out;
+	}
+
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %zu bytes in %lu segment(s)\n",
+		OURMODNAME, __func__, current->comm, count, from->nr_segs);
+
+	ret = lkdc_iter_write(from, kbuf, MAXBYTES, set_secret_seg, NULL,
+			      OURMODNAME, &aborted);
+	if (ret <= 0)
+		goto out;
+
+	// Update stats
+	ctx->rx += ret; // our 'receive' is wrt this driver
+	vpr_info(" %zd bytes written, returning... (stats: tx=%d, rx=%d)\n",
+		ret, ctx->tx, ctx->rx);
+out:
+	trace_lkdc_write(OURMODNAME, count, ret);
 	return ret;
 }
 
@@ -221,22 +532,100 @@ out_nomem:
  */
 static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-        PRINT_CTX(); // displays process (or intr) context info
+        VPRINT_CTX(); // displays process (or intr) context info
 
 	ga --; gb ++;
-        pr_info("%s:%s(): filename: \"%s\"\n"
+        vpr_info("%s:%s(): filename: \"%s\"\n"
 		" ga = %d, gb = %d\n",
 			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 			ga, gb);
+	trace_lkdc_release(OURMODNAME, filp);
 	return 0;
 }
 
+/*
+ * mmap_miscdrv_rdwr()
+ * The driver's mmap 'method'; we map the page holding the secret into the
+ * caller's virtual address space, read-only. Thereafter, the app can read
+ * the secret (and check the 'gen' count for updates) with plain loads; no
+ * syscall, no copy_to_user(), no lock.
+ */
+static int mmap_miscdrv_rdwr(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long len = vma->vm_end - vma->vm_start;
+
+	VPRINT_CTX();
+	if (bufsize)   /* only the secret page can be mapped */
+		return -ENODEV;
+	if (vma->vm_pgoff || len > PAGE_SIZE) {
+		pr_warn("%s:%s(): only a single page at offset 0 can be mapped\n",
+			OURMODNAME, __func__);
+		return -EINVAL;
+	}
+	/* The secret can only be changed via the write(2); disallow writable
+	 * mappings, now or later (via mprotect(2)) */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			virt_to_phys(ctx->spage) >> PAGE_SHIFT,
+			len, vma->vm_page_prot);
+}
+
+/*
+ * llseek_miscdrv_rdwr()
+ * The driver's llseek 'method'. In store mode, the device is a fixed size
+ * file, so all the usual 'whence' values make sense; in secret mode, there's
+ * nothing to seek in (as with no_llseek()).
+ */
+static loff_t llseek_miscdrv_rdwr(struct file *filp, loff_t off, int whence)
+{
+	if (!bufsize)
+		return -ESPIPE;
+	return fixed_size_llseek(filp, off, whence, bufsize);
+}
+
+/*
+ * splice_read_miscdrv_rdwr(), splice_write_miscdrv_rdwr()
+ * The driver's splice 'methods'; they back the splice(2) and sendfile(2)
+ * syscalls. In store mode, we just use the generic helpers: they drive our
+ * read_iter / write_iter methods with an iov_iter over the pipe's pages, so
+ * the data is copied directly between the store and the pipe buffers (no
+ * userspace buffer in between). The secret mode's record semantics (each
+ * 'segment' gets a whole secret) make no sense for a pipe; so, there, we
+ * don't support splicing.
+ */
+static ssize_t splice_read_miscdrv_rdwr(struct file *in, loff_t *ppos,
+			struct pipe_inode_info *pipe, size_t len,
+			unsigned int flags)
+{
+	if (!bufsize)
+		return -EINVAL;
+	return generic_file_splice_read(in, ppos, pipe, len, flags);
+}
+
+static ssize_t splice_write_miscdrv_rdwr(struct pipe_inode_info *pipe,
+			struct file *out, loff_t *ppos, size_t len,
+			unsigned int flags)
+{
+	if (!bufsize)
+		return -EINVAL;
+	return iter_file_splice_write(pipe, out, ppos, len, flags);
+}
+
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,   // an open fd or a mapping of the secret page pins the module
 	.open = open_miscdrv_rdwr,
 	.read = read_miscdrv_rdwr,
 	.write = write_miscdrv_rdwr,
-	.llseek = no_llseek,             // dummy, we don't support lseek(2)
+	.read_iter = read_iter_miscdrv_rdwr,
+	.write_iter = write_iter_miscdrv_rdwr,
+	.mmap = mmap_miscdrv_rdwr,
+	.splice_read = splice_read_miscdrv_rdwr,     // store mode only
+	.splice_write = splice_write_miscdrv_rdwr,   // store mode only
+	.llseek = llseek_miscdrv_rdwr,   // store mode only
 	.release = close_miscdrv_rdwr,
 	/* As you learn more reg device drivers, you'll realize that the
 	 * ioctl() would be a very useful method here. As an exercise,
@@ -256,13 +645,51 @@ static int __init miscdrv_init(void)
 {
 	int ret;
 
+	if (bufsize < 0 || bufsize > BUFSIZE_MAX) {
+		pr_notice("%s: bufsize %d invalid (must be 0..%d), aborting\n",
+			OURMODNAME, bufsize, BUFSIZE_MAX);
+		return -EINVAL;
+	}
+
+	/* Set up the context before registering the device; once registered,
+	 * it can be opened and used right away */
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	ret = -ENOMEM;
+	/* The secret lives in a page of it's own, so that it can be mmap-ed */
+	ctx->spage = (struct lkdc_secret_page *)get_zeroed_page(GFP_KERNEL);
+	if (unlikely(!ctx->spage)) {
+		pr_notice("%s: get_zeroed_page failed! aborting\n", OURMODNAME);
+		goto out_spage;
+	}
+	ctx->oursecret = ctx->spage->secret;
+	mutex_init(&ctx->wrlock);
+	strlcpy(ctx->oursecret, "initmsg", 8);
+	ctx->spage->len = strlen(ctx->oursecret);
+
+	if (bufsize) {   /* 'store' mode */
+		/* Possibly (very) large; it need not be physically contiguous */
+		ctx->store = vzalloc(bufsize);
+		if (unlikely(!ctx->store)) {
+			pr_notice("%s: vzalloc(%d) failed! aborting\n",
+				OURMODNAME, bufsize);
+			goto out_store;
+		}
+		init_rwsem(&ctx->store_rwsem);
+	}
+
 	if ((ret = misc_register(&lkdc_miscdev))) {
 		pr_notice("%s: misc device registration failed, aborting\n",
 			       OURMODNAME);
-		return ret;
+		goto out_misc;
 	}
 	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
 			OURMODNAME, lkdc_miscdev.minor);
+	if (bufsize)
+		pr_info("%s: 'store' mode, %d bytes\n", OURMODNAME, bufsize);
 
 	/* Now, for the purpose of creating the device node (file), we require
 	 * both the major and minor numbers. The major number will always be 10
@@ -278,20 +705,25 @@ static int __init miscdrv_init(void)
 	 */
 	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
 
-	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
-	if (unlikely(!ctx)) {
-		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
-		return -ENOMEM;
-	}
-	strlcpy(ctx->oursecret, "initmsg", 8);
-
 	return 0;		/* success */
+
+out_misc:
+	vfree(ctx->store);
+out_store:
+	mutex_destroy(&ctx->wrlock);
+	free_page((unsigned long)ctx->spage);
+out_spage:
+	kfree(ctx);
+	return ret;
 }
 
 static void __exit miscdrv_exit(void)
 {
-	kzfree(ctx);
 	misc_deregister(&lkdc_miscdev);
+	vfree(ctx->store);
+	mutex_destroy(&ctx->wrlock);
+	free_page((unsigned long)ctx->spage);
+	kzfree(ctx);
 	pr_debug("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
 }
 
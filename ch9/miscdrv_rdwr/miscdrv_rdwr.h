@@ -0,0 +1,43 @@
+/*
+ * ch9/miscdrv_rdwr/miscdrv_rdwr.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 9 : Writing a Simple Misc Character Device Driver
+ ****************************************************************
+ * Brief Description:
+ * The common header file shared by the miscdrv_rdwr driver and it's userspace
+ * app(s); things that both sides must agree upon live here.
+ *
+ * For details, please refer the book, Ch 9.
+ */
+#ifndef __MISCDRV_RDWR_H__
+#define __MISCDRV_RDWR_H__
+
+#include <linux/types.h>
+
+#define MAXBYTES    128   /* max size of the 'secret' (incl the NULL byte) */
+
+/*
+ * The layout of the page that holds the 'secret'. The driver allows userspace
+ * to mmap() this page (read-only); so, a reader can retrieve the secret with
+ * plain memory loads, without entering the kernel at all.
+ *
+ * 'gen' is a generation (sequence) count: the driver makes it odd just before
+ * it modifies the secret and even again once it's done. Thus, a consistent
+ * snapshot is had by:
+ *  read gen; if odd, retry; copy the secret; re-read gen; if changed, retry.
+ * (Much like the kernel's own seqcount; of course, there's no lock here).
+ */
+struct lkdc_secret_page {
+	__u32 gen;
+	__u32 len;            /* strlen() of the secret */
+	char secret[MAXBYTES];
+};
+
+#endif   /* #ifndef __MISCDRV_RDWR_H__ */
@@ -16,6 +16,9 @@
  * Also, again as a demo, we use the read(2) to retreive the 'secret' <eye-roll>
  * from the driver within kernel-space. Equivalently, one can use the write(2)
  * change the 'secret' (just plain text).
+ * The 'm' option retrieves the secret via mmap(2) instead (no syscall per
+ * retrieval), and the 'b' option benchmarks the various ways of doing so (and
+ * the write path).
  *
  * For details, please refer the book, Ch 9.
  */
@@ -27,18 +30,242 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "miscdrv_rdwr.h"	/* MAXBYTES, struct lkdc_secret_page */
+
+#define BENCH_DEF_ITERS	1000000
+#define BENCH_NSEGS	16	/* # of segments per readv(2)/writev(2) */
 
-#define MAXBYTES    128   /* Must match the driver; we should actually use a
-			   * common header file for things like this */
 static int stay_alive = 0;
 
 static inline void usage(char *prg)
 {
-	fprintf(stderr,"Usage: %s opt=read/write device_file [\"secret-msg\"]\n"
+	fprintf(stderr,"Usage: %s opt=read/write/mmap/bench device_file [\"secret-msg\"|test [iterations]]\n"
 			" opt = 'r' => we shall issue the read(2), retrieving the 'secret' form the driver\n"
 			" opt = 'w' => we shall issue the write(2), writing the secret message <secret-msg>\n"
-			"  (max %d bytes)\n",
-		       prg, MAXBYTES);
+			"  (max %d bytes)\n"
+			" opt = 'm' => we shall mmap(2) the driver's secret page and retrieve the 'secret' from it\n"
+			" opt = 'b' => benchmark: retrieve the secret <iterations> times (default %d) via:\n"
+			"  test = 'mmap' => read(2) versus loads from the mmap-ed secret page\n"
+			"  test = 'iov'  => looping read(2)/write(2) versus readv(2)/writev(2) of %d segments\n"
+			"                   (this test overwrites the secret; needs write permission)\n"
+			"  test = 'wrsz' => write(2)s of 16 B, %d B and 64 KiB payloads; the drivers keep\n"
+			"                   at most %d bytes of each (overwrites the secret)\n",
+		       prg, MAXBYTES, BENCH_DEF_ITERS, BENCH_NSEGS, MAXBYTES, MAXBYTES);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Take a consistent snapshot of the secret from the mmap-ed page, following
+ * the 'gen' count protocol (see miscdrv_rdwr.h). Returns the length of the
+ * secret copied into 'buf' (which must be at least MAXBYTES in size), and
+ * the generation it belongs to via 'genp'.
+ */
+static unsigned int mmap_snapshot(const volatile struct lkdc_secret_page *sp,
+				  char *buf, unsigned int *genp)
+{
+	unsigned int g1, g2, len;
+
+	do {
+		g1 = __atomic_load_n(&sp->gen, __ATOMIC_ACQUIRE);
+		if (g1 & 1)	/* the driver's updating it right now */
+			continue;
+		len = sp->len;
+		if (len >= MAXBYTES)
+			len = MAXBYTES - 1;
+		memcpy(buf, (const void *)sp->secret, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		g2 = __atomic_load_n(&sp->gen, __ATOMIC_RELAXED);
+	} while ((g1 & 1) || g1 != g2);
+
+	if (genp)
+		*genp = g1;
+	return len;
+}
+
+static void *map_secret(int fd, const char *prg)
+{
+	void *pg = mmap(NULL, sizeof(struct lkdc_secret_page), PROT_READ,
+			MAP_SHARED, fd, 0);
+
+	if (pg == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap(2) failed\n", prg);
+		perror("mmap");
+		fprintf(stderr, "Tip: see kernel log\n");
+		return NULL;
+	}
+	return pg;
+}
+
+static void report(const char *what, long iters, double secs)
+{
+	printf(" %-28s: %9ld ops in %8.3f s = %12.0f ops/s (%8.1f ns/op)\n",
+		what, iters, secs, iters / secs, secs * 1e9 / iters);
+}
+
+/* read(2) versus mmap-ed loads, for retrieving the secret 'iters' times */
+static int bench_mmap(int fd, long iters, const char *prg)
+{
+	char buf[MAXBYTES];
+	const struct lkdc_secret_page *sp;
+	double t;
+	long i;
+
+	t = now_sec();
+	for (i = 0; i < iters; i++) {
+		if (read(fd, buf, MAXBYTES) < 0) {
+			perror("read failed");
+			return -1;
+		}
+	}
+	report("read(2)", iters, now_sec() - t);
+
+	sp = map_secret(fd, prg);
+	if (!sp)
+		return -1;
+	t = now_sec();
+	for (i = 0; i < iters; i++)
+		mmap_snapshot(sp, buf, NULL);
+	report("mmap + gen count snapshot", iters, now_sec() - t);
+
+	munmap((void *)sp, sizeof(struct lkdc_secret_page));
+	return 0;
+}
+
+/*
+ * Looping read(2)/write(2) versus readv(2)/writev(2); the driver treats each
+ * segment as a separate request, so both move the same data. We count an 'op'
+ * as one segment's worth, i.e., one secret retrieved or set.
+ */
+static int bench_iov(int fd, long iters)
+{
+	static char bufs[BENCH_NSEGS][MAXBYTES];
+	static const char msg[] = "vectored-secret";
+	struct iovec iov[BENCH_NSEGS];
+	double t;
+	long i;
+	int j;
+
+	for (j = 0; j < BENCH_NSEGS; j++) {
+		iov[j].iov_base = bufs[j];
+		iov[j].iov_len = MAXBYTES;
+	}
+
+	t = now_sec();
+	for (i = 0; i < iters; i += BENCH_NSEGS) {
+		for (j = 0; j < BENCH_NSEGS; j++) {
+			if (read(fd, bufs[j], MAXBYTES) < 0) {
+				perror("read failed");
+				return -1;
+			}
+		}
+	}
+	report("read(2) loop", i, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < iters; i += BENCH_NSEGS) {
+		if (readv(fd, iov, BENCH_NSEGS) < 0) {
+			perror("readv failed");
+			return -1;
+		}
+	}
+	report("readv(2)", i, now_sec() - t);
+
+	/* Now the writes; every segment holds the same (new) secret */
+	for (j = 0; j < BENCH_NSEGS; j++) {
+		memcpy(bufs[j], msg, sizeof(msg));
+		iov[j].iov_len = sizeof(msg);
+	}
+
+	t = now_sec();
+	for (i = 0; i < iters; i += BENCH_NSEGS) {
+		for (j = 0; j < BENCH_NSEGS; j++) {
+			if (write(fd, bufs[j], sizeof(msg)) < 0) {
+				perror("write failed");
+				return -1;
+			}
+		}
+	}
+	report("write(2) loop", i, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < iters; i += BENCH_NSEGS) {
+		if (writev(fd, iov, BENCH_NSEGS) < 0) {
+			perror("writev failed");
+			return -1;
+		}
+	}
+	report("writev(2)", i, now_sec() - t);
+
+	return 0;
+}
+
+/*
+ * write(2) throughput for a few payload sizes; the large one shows what the
+ * driver's write path costs when it's handed (much) more than it keeps.
+ * Drivers that reject oversized writes (-EINVAL) simply have that size
+ * skipped.
+ */
+static int bench_wrsz(int fd, long iters)
+{
+	static const size_t sizes[] = { 16, MAXBYTES, 64 * 1024 };
+	char what[32], *buf;
+	unsigned int k;
+	double t;
+	long i;
+
+	buf = malloc(sizes[2]);
+	if (!buf) {
+		fprintf(stderr, "out of memory!\n");
+		return -1;
+	}
+	memset(buf, 'w', sizes[2]);
+
+	for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		snprintf(what, sizeof(what), "write(2) of %zu bytes", sizes[k]);
+		t = now_sec();
+		for (i = 0; i < iters; i++) {
+			if (write(fd, buf, sizes[k]) < 0)
+				break;
+		}
+		if (i < iters) {
+			if (errno == EINVAL && i == 0) {
+				printf(" %-28s: rejected by the driver, skipped\n",
+					what);
+				continue;
+			}
+			perror("write failed");
+			free(buf);
+			return -1;
+		}
+		report(what, iters, now_sec() - t);
+	}
+	free(buf);
+	return 0;
+}
+
+static int bench(int fd, const char *test, long iters, const char *prg)
+{
+	printf("%s: benchmark '%s', %ld iterations\n", prg, test, iters);
+	if (!strcmp(test, "mmap"))
+		return bench_mmap(fd, iters, prg);
+	if (!strcmp(test, "iov"))
+		return bench_iov(fd, iters);
+	if (!strcmp(test, "wrsz"))
+		return bench_wrsz(fd, iters);
+
+	fprintf(stderr, "%s: unknown benchmark test '%s'\n", prg, test);
+	return -1;
 }
 
 int main(int argc, char **argv)
@@ -55,12 +282,14 @@ int main(int argc, char **argv)
 	}
 
 	opt = argv[1][0];
-	if (opt != 'r' && opt != 'w') {
+	if (opt != 'r' && opt != 'w' && opt != 'm' && opt != 'b') {
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 	if( (opt == 'w' && argc != 4) ||
-	    (opt == 'r' && argc != 3)) {
+	    (opt == 'r' && argc != 3) ||
+	    (opt == 'm' && argc != 3) ||
+	    (opt == 'b' && (argc < 4 || argc > 5))) {
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
@@ -72,13 +301,57 @@ int main(int argc, char **argv)
 
 	if ('w' == opt)
 		flags = O_WRONLY;
+	else if ('b' == opt && strcmp(argv[3], "mmap"))
+		flags = O_RDWR;		/* the other tests write as well */
 	if ((fd=open(argv[2], flags, 0)) == -1) {
 		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[2]);
 		perror("open");
 		exit(EXIT_FAILURE);
 	}
 	printf("Device file %s opened (in %s mode): fd=%d\n",
-		       argv[2], (flags == O_RDONLY ? "read-only" : "write-only"), fd);
+		       argv[2], (flags == O_RDONLY ? "read-only" :
+		(flags == O_WRONLY ? "write-only" : "read-write")), fd);
+
+	if ('b' == opt) {
+		long iters = (argc == 5 ? atol(argv[4]) : BENCH_DEF_ITERS);
+
+		if (iters <= 0) {
+			fprintf(stderr, "%s: iterations '%s' invalid\n",
+				argv[0], argv[4]);
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		if (bench(fd, argv[3], iters, argv[0]) < 0) {
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		exit(EXIT_SUCCESS);
+	}
+	if ('m' == opt) {
+		const struct lkdc_secret_page *sp = map_secret(fd, argv[0]);
+		unsigned int gen, len;
+
+		if (!sp) {
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		buf = malloc(MAXBYTES);
+		if (!buf) {
+			fprintf(stderr,"%s: out of memory!\n", argv[0]);
+			munmap((void *)sp, sizeof(struct lkdc_secret_page));
+			close(fd);
+			exit(EXIT_FAILURE);
+		}
+		len = mmap_snapshot(sp, buf, &gen);
+		printf("%s: mmap-ed the secret page of %s (gen %u)\n",
+			argv[0], argv[2], gen);
+		printf("The 'secret' is:\n \"%.*s\"\n", (int)len, buf);
+		munmap((void *)sp, sizeof(struct lkdc_secret_page));
+		free(buf);
+		close(fd);
+		exit(EXIT_SUCCESS);
+	}
 
 	if ('w' == opt)
 		num = strlen(argv[3])+1; // IMP! +1 to include the NULL byte!
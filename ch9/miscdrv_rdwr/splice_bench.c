@@ -0,0 +1,186 @@
+/*
+ * ch9/miscdrv_rdwr/splice_bench.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 9 : Writing a Simple Misc Character Device Driver
+ ****************************************************************
+ * Brief Description:
+ * A throughput benchmark for the splice(2) support of the miscdrv_rdwr
+ * driver's 'store' mode (load it with bufsize=<n>).
+ * We copy the whole store out to a given file, and then that file back into
+ * the store, each <passes> times, in two ways:
+ *  - the 'classic' way: read(2) into a userspace buffer, write(2) it out
+ *  - via splice(2): device -> pipe -> file (and file -> pipe -> device); the
+ *    data never passes through userspace
+ * and report the MB/s achieved by each.
+ * Note: overwrites the given file and the store's content.
+ *
+ * For details, please refer the book, Ch 9.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file out_file [chunk_size [passes]]\n"
+			" The miscdrv_rdwr driver must be in 'store' mode (bufsize=<n>).\n"
+			" Copies the store to <out_file> and back, via read(2)+write(2) and via\n"
+			" splice(2), in <chunk_size> pieces (default 65536), <passes> times\n"
+			" (default 10), reporting the throughput of each.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copy 'size' bytes from the start of 'src' to the start of 'dst' */
+static int copy_rw(int src, int dst, off_t size, char *buf, size_t chunk)
+{
+	off_t done = 0;
+	ssize_t n;
+
+	if (lseek(src, 0, SEEK_SET) < 0 || lseek(dst, 0, SEEK_SET) < 0) {
+		perror("lseek failed");
+		return -1;
+	}
+	while (done < size) {
+		n = read(src, buf, chunk);
+		if (n <= 0) {
+			perror("read failed (or early EOF)");
+			return -1;
+		}
+		if (write(dst, buf, n) != n) {
+			perror("write failed");
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int copy_splice(int src, int dst, off_t size, int pfd[2], size_t chunk)
+{
+	off_t done = 0, in_off = 0, out_off = 0;
+	ssize_t n, m;
+
+	while (done < size) {
+		n = splice(src, &in_off, pfd[1], NULL, chunk, SPLICE_F_MOVE);
+		if (n <= 0) {
+			perror("splice (in) failed (or early EOF)");
+			return -1;
+		}
+		while (n > 0) {   /* drain the pipe */
+			m = splice(pfd[0], NULL, dst, &out_off, n, SPLICE_F_MOVE);
+			if (m <= 0) {
+				perror("splice (out) failed");
+				return -1;
+			}
+			n -= m;
+			done += m;
+		}
+	}
+	return 0;
+}
+
+static void report(const char *what, off_t bytes, double secs)
+{
+	printf(" %-34s: %10.1f MB/s\n", what, bytes / secs / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+	int dev, file, pfd[2], passes, i;
+	size_t chunk;
+	off_t size;
+	char *buf;
+	double t;
+
+	if (argc < 3 || argc > 5) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	chunk = (argc >= 4 ? (size_t)atol(argv[3]) : 65536);
+	passes = (argc == 5 ? atoi(argv[4]) : 10);
+	if (!chunk || passes <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((dev = open(argv[1], O_RDWR)) == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[1]);
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	size = lseek(dev, 0, SEEK_END);
+	if (size <= 0) {
+		perror("lseek failed");
+		fprintf(stderr, "Tip: is the driver in 'store' mode (bufsize=<n>)?\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((file = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[2]);
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	buf = malloc(chunk);
+	if (!buf || pipe(pfd) < 0) {
+		perror("malloc/pipe failed");
+		exit(EXIT_FAILURE);
+	}
+	/* A chunk must fit into the pipe; try and grow it accordingly */
+	if ((size_t)fcntl(pfd[1], F_SETPIPE_SZ, chunk) < chunk) {
+		fprintf(stderr, "%s: chunk size %zu exceeds the max pipe size\n",
+			argv[0], chunk);
+		exit(EXIT_FAILURE);
+	}
+	printf("%s: store of %lld bytes; chunk %zu bytes, %d passes\n",
+		argv[0], (long long)size, chunk, passes);
+
+	t = now_sec();
+	for (i = 0; i < passes; i++)
+		if (copy_rw(dev, file, size, buf, chunk) < 0)
+			exit(EXIT_FAILURE);
+	report("device -> file, read(2)+write(2)", size * passes, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < passes; i++)
+		if (copy_splice(dev, file, size, pfd, chunk) < 0)
+			exit(EXIT_FAILURE);
+	report("device -> file, splice(2)", size * passes, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < passes; i++)
+		if (copy_rw(file, dev, size, buf, chunk) < 0)
+			exit(EXIT_FAILURE);
+	report("file -> device, read(2)+write(2)", size * passes, now_sec() - t);
+
+	t = now_sec();
+	for (i = 0; i < passes; i++)
+		if (copy_splice(file, dev, size, pfd, chunk) < 0)
+			exit(EXIT_FAILURE);
+	report("file -> device, splice(2)", size * passes, now_sec() - t);
+
+	free(buf);
+	close(pfd[0]); close(pfd[1]);
+	close(file);
+	close(dev);
+	exit(EXIT_SUCCESS);
+}
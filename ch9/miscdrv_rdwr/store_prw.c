@@ -0,0 +1,231 @@
+/*
+ * ch9/miscdrv_rdwr/store_prw.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 9 : Writing a Simple Misc Character Device Driver
+ ****************************************************************
+ * Brief Description:
+ * A test bed for the 'store' mode of the miscdrv_rdwr driver (load it with
+ * bufsize=<n>). We find the store's size via lseek(2), fill it with a known
+ * pattern via pwrite(2)s and verify it via pread(2)s; then, 1 and then
+ * <nthreads> threads - each with it's own region of the store - pread(2)
+ * their region in <chunk> sized pieces for a few seconds, and we report the
+ * aggregate read throughput. As pread(2) doesn't touch the (shared) file
+ * offset, the threads can share the one open file.
+ *
+ * For details, please refer the book, Ch 9.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+static int fd;
+static size_t chunk;
+static volatile int running;
+static pthread_barrier_t start_barrier;
+
+struct reader {
+	pthread_t tid;
+	off_t start, len;   /* this thread's region of the store */
+	long long bytes;
+	int failed;
+};
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file nthreads [chunk_size [seconds]]\n"
+			" The miscdrv_rdwr driver must be in 'store' mode (bufsize=<n>).\n"
+			" Writes and verifies a pattern over the whole store, then has 1 and then\n"
+			" <nthreads> threads pread(2) their own region of it in <chunk_size> pieces\n"
+			" (default 4096) for <seconds> (default 3), reporting the read throughput.\n"
+			" Note: overwrites the store's content.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline char pattern(off_t off)
+{
+	return 'a' + (off % 26);
+}
+
+/* Fill the store with the pattern, then read it back and verify it */
+static int fill_and_verify(off_t size)
+{
+	char *buf = malloc(chunk);
+	off_t off, i;
+	ssize_t n;
+
+	if (!buf) {
+		fprintf(stderr, "out of memory!\n");
+		return -1;
+	}
+	for (off = 0; off < size; off += n) {
+		for (i = 0; i < (off_t)chunk; i++)
+			buf[i] = pattern(off + i);
+		n = pwrite(fd, buf, chunk, off);
+		if (n <= 0) {
+			perror("pwrite failed");
+			goto out_fail;
+		}
+	}
+	for (off = 0; off < size; off += n) {
+		n = pread(fd, buf, chunk, off);
+		if (n <= 0) {
+			perror("pread failed");
+			goto out_fail;
+		}
+		for (i = 0; i < n; i++) {
+			if (buf[i] != pattern(off + i)) {
+				fprintf(stderr, "verify failed at offset %lld\n",
+					(long long)(off + i));
+				goto out_fail;
+			}
+		}
+	}
+	free(buf);
+	return 0;
+
+out_fail:
+	free(buf);
+	return -1;
+}
+
+static void *reader(void *arg)
+{
+	struct reader *r = arg;
+	char *buf = malloc(chunk);
+	off_t off = r->start;
+	ssize_t n;
+
+	if (!buf)
+		r->failed = 1;
+	pthread_barrier_wait(&start_barrier);
+	if (!buf)
+		return NULL;
+
+	while (running) {
+		n = pread(fd, buf, chunk, off);
+		if (n < 0) {
+			perror("reader: pread");
+			r->failed = 1;
+			break;
+		}
+		r->bytes += n;
+		off += n;
+		if (!n || off >= r->start + r->len)
+			off = r->start;   /* wrap around within our region */
+	}
+	free(buf);
+	return NULL;
+}
+
+/* Run 'nthrds' readers for 'secs' seconds; returns the aggregate MB/s */
+static double run(int nthrds, int secs, off_t size)
+{
+	struct reader *rd = calloc(nthrds, sizeof(struct reader));
+	off_t region = size / nthrds;
+	long long total = 0;
+	double t;
+	int i;
+
+	if (!rd || region < (off_t)chunk) {
+		fprintf(stderr, "out of memory, or store too small for %d regions!\n",
+			nthrds);
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&start_barrier, NULL, nthrds + 1);
+	running = 1;
+	for (i = 0; i < nthrds; i++) {
+		rd[i].start = i * region;
+		rd[i].len = region;
+		if (pthread_create(&rd[i].tid, NULL, reader, &rd[i])) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	t = now_sec();
+	sleep(secs);
+	running = 0;
+	for (i = 0; i < nthrds; i++) {
+		pthread_join(rd[i].tid, NULL);
+		if (rd[i].failed)
+			exit(EXIT_FAILURE);
+		total += rd[i].bytes;
+	}
+	t = now_sec() - t;
+	pthread_barrier_destroy(&start_barrier);
+	free(rd);
+	return total / t / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+	int nthrds, secs;
+	off_t size;
+	double rate1, rate;
+
+	if (argc < 3 || argc > 5) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	nthrds = atoi(argv[2]);
+	chunk = (argc >= 4 ? (size_t)atol(argv[3]) : 4096);
+	secs = (argc == 5 ? atoi(argv[4]) : 3);
+	if (nthrds <= 0 || !chunk || secs <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((fd = open(argv[1], O_RDWR)) == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[1]);
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		perror("lseek failed");
+		fprintf(stderr, "Tip: is the driver in 'store' mode (bufsize=<n>)?\n");
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	printf("%s: %s: store of %lld bytes; chunk %zu bytes, %d s per run\n",
+		argv[0], argv[1], (long long)size, chunk, secs);
+
+	if (fill_and_verify(size) < 0) {
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	printf(" pwrite(2)/pread(2) pattern verified\n");
+
+	rate1 = run(1, secs, size);
+	printf(" %3d thread(s): %10.1f MB/s\n", 1, rate1);
+	if (nthrds > 1) {
+		rate = run(nthrds, secs, size);
+		printf(" %3d thread(s): %10.1f MB/s (speedup %.2f)\n",
+			nthrds, rate, rate / rate1);
+	}
+
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,165 @@
+/*
+ * ch9/miscdrv_rdwr/store_wrbench.c
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ * From: Ch 9 : Writing a Simple Misc Character Device Driver
+ ****************************************************************
+ * Brief Description:
+ * Finds the crossover point between the two write paths of the miscdrv_rdwr
+ * driver's 'store' mode (load it with bufsize=<n>): the copy path
+ * (copy_from_user() under the lock) and the 'direct' one (pin the user pages
+ * first, then copy from them under the lock).
+ * For each write size - 4 KB, 8 KB, ... upto the store's size - we pwrite(2)
+ * that many bytes for a second or so with each path, and report the MB/s of
+ * each; the driver's direct_thresh parameter is set to select the path (so,
+ * run this as root), and restored at the end. Set direct_thresh to (about)
+ * the size from where on the direct path wins.
+ * Each write is from a freshly mmap-ed (so, not yet faulted in) buffer when
+ * run with <fresh> = 1: this is where pinning outside the lock helps the
+ * most. Note: overwrites the store's content.
+ *
+ * For details, please refer the book, Ch 9.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PARAM	"/sys/module/miscdrv_rdwr/parameters/direct_thresh"
+
+static inline void usage(char *prg)
+{
+	fprintf(stderr,"Usage: %s device_file [fresh]\n"
+			" The miscdrv_rdwr driver must be in 'store' mode (bufsize=<n>); run as root.\n"
+			" For write sizes of 4 KB upto the store's size, reports the pwrite(2)\n"
+			" throughput of the copy and the direct (pinned page) write paths.\n"
+			" If <fresh> is 1, each write is from a freshly mmap-ed buffer.\n",
+		       prg);
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int set_thresh(unsigned long val)
+{
+	FILE *fp = fopen(PARAM, "w");
+
+	if (!fp) {
+		perror("fopen " PARAM);
+		return -1;
+	}
+	fprintf(fp, "%lu\n", val);
+	return fclose(fp);
+}
+
+/* pwrite 'sz' bytes to the start of the store for ~1s; returns the MB/s */
+static double bench(int fd, size_t sz, int fresh)
+{
+	static char *buf;
+	static size_t bufsz;
+	long long bytes = 0;
+	double t, t0 = now_sec();
+	char *p;
+
+	if (!fresh && bufsz < sz) {
+		free(buf);
+		buf = malloc(sz);
+		if (!buf) {
+			fprintf(stderr, "out of memory!\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(buf, 'x', sz);
+		bufsz = sz;
+	}
+	do {
+		p = buf;
+		if (fresh) {
+			p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED) {
+				perror("mmap");
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (pwrite(fd, p, sz, 0) != (ssize_t)sz) {
+			perror("pwrite failed (or short write)");
+			exit(EXIT_FAILURE);
+		}
+		if (fresh)
+			munmap(p, sz);
+		bytes += sz;
+		t = now_sec() - t0;
+	} while (t < 1.0);
+	return bytes / t / (1024 * 1024);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long orig_thresh;
+	double copy, direct;
+	off_t size;
+	size_t sz;
+	int fd, fresh;
+	FILE *fp;
+
+	if (argc < 2 || argc > 3) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	fresh = (argc == 3 ? atoi(argv[2]) : 0);
+
+	fp = fopen(PARAM, "r");
+	if (!fp || fscanf(fp, "%lu", &orig_thresh) != 1) {
+		perror("reading " PARAM);
+		fprintf(stderr, "Tip: is the miscdrv_rdwr driver loaded?\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(fp);
+
+	if ((fd = open(argv[1], O_RDWR)) == -1) {
+		fprintf(stderr, "%s: open(2) on %s failed\n", argv[0], argv[1]);
+		perror("open");
+		exit(EXIT_FAILURE);
+	}
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0) {
+		perror("lseek failed");
+		fprintf(stderr, "Tip: is the driver in 'store' mode (bufsize=<n>)?\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("%s: store of %lld bytes; %s buffers\n", argv[0], (long long)size,
+		fresh ? "fresh (mmap-ed per write)" : "reused (faulted in)");
+	printf("  write size   copy MB/s  direct MB/s   direct/copy\n");
+
+	for (sz = 4096; sz <= (size_t)size; sz *= 2) {
+		if (set_thresh(0) < 0)   /* the copy path */
+			exit(EXIT_FAILURE);
+		copy = bench(fd, sz, fresh);
+		if (set_thresh(1) < 0)   /* the direct path */
+			exit(EXIT_FAILURE);
+		direct = bench(fd, sz, fresh);
+		printf(" %10zu %11.1f %12.1f %13.2f\n", sz, copy, direct,
+			direct / copy);
+	}
+
+	set_thresh(orig_thresh);
+	close(fd);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,203 @@
+/*
+ * lkdc_misc_hist.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ ****************************************************************
+ * Brief Description:
+ * Latency and request size histograms for our ch9 / ch10 'misc' class
+ * character drivers.
+ * The open, read, write and release methods each record how long they took
+ * (in ns) and - read and write - the requested size (in bytes), in power-of-2
+ * (log2) buckets. The counters are per-CPU: recording costs two clock reads
+ * and two this_cpu_inc()'s, with no lock and no shared cache line; so, it's
+ * cheap enough to leave on. The histograms are folded (summed over all CPUs)
+ * only when read, via debugfs:
+ *  # cat /sys/kernel/debug/<drvname>/histograms
+ *  # echo 1 > /sys/kernel/debug/<drvname>/reset
+ *
+ * Usage (within a driver):
+ *  #include "../../lkdc_misc_hist.h"   (in the one .c file of the module)
+ *  static struct lkdc_hist hist;
+ *  init:    lkdc_hist_init(&hist, OURMODNAME);
+ *  method:  u64 t0 = lkdc_hist_start();
+ *           ...
+ *           lkdc_hist_record(&hist, LKDC_H_READ, t0, count);
+ *  cleanup: lkdc_hist_exit(&hist);
+ * The module Makefile must add the repo's top dir to the include path (as it
+ * already does for lkdc_misc_trace.h).
+ *
+ * For details, please refer the book, Ch 9 and 10.
+ */
+#ifndef _LKDC_MISC_HIST_H
+#define _LKDC_MISC_HIST_H
+
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/timekeeping.h>  // ktime_get_ns()
+#include <linux/bitops.h>       // fls64()
+
+enum lkdc_hist_op {
+	LKDC_H_OPEN,
+	LKDC_H_READ,
+	LKDC_H_WRITE,
+	LKDC_H_RELEASE,
+	LKDC_H_NOPS
+};
+
+static const char * const lkdc_hist_opname[LKDC_H_NOPS] = {
+	"open", "read", "write", "release"
+};
+
+/*
+ * Bucket 0 counts the value 0, bucket b (b >= 1) the values in
+ * [2^(b-1), 2^b); the last bucket also counts everything beyond.
+ */
+#define LKDC_HIST_BUCKETS	32
+
+struct lkdc_hist_pcpu {
+	u64 lat[LKDC_H_NOPS][LKDC_HIST_BUCKETS];   // latency, ns
+	u64 size[LKDC_H_NOPS][LKDC_HIST_BUCKETS];  // request size, bytes
+};
+
+struct lkdc_hist {
+	struct lkdc_hist_pcpu __percpu *pc;
+	struct dentry *dir;
+};
+
+static inline unsigned int lkdc_hist_bucket(u64 val)
+{
+	unsigned int b = fls64(val);
+
+	return (b < LKDC_HIST_BUCKETS ? b : LKDC_HIST_BUCKETS - 1);
+}
+
+static inline u64 lkdc_hist_start(void)
+{
+	return ktime_get_ns();
+}
+
+/* Record a call of method 'op' that began at 't0' and was for 'size' bytes */
+static inline void lkdc_hist_record(struct lkdc_hist *h, enum lkdc_hist_op op,
+				    u64 t0, size_t size)
+{
+	this_cpu_inc(h->pc->lat[op][lkdc_hist_bucket(ktime_get_ns() - t0)]);
+	if (op == LKDC_H_READ || op == LKDC_H_WRITE)
+		this_cpu_inc(h->pc->size[op][lkdc_hist_bucket(size)]);
+}
+
+/* Fold and print one histogram; only the non-empty buckets are shown */
+static void lkdc_hist_show_one(struct seq_file *m, struct lkdc_hist *h,
+			       enum lkdc_hist_op op, bool size)
+{
+	u64 sum[LKDC_HIST_BUCKETS] = { 0 }, total = 0;
+	const struct lkdc_hist_pcpu *pc;
+	const u64 *cnt;
+	int cpu, b;
+
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(h->pc, cpu);
+		cnt = (size ? pc->size[op] : pc->lat[op]);
+		for (b = 0; b < LKDC_HIST_BUCKETS; b++)
+			sum[b] += READ_ONCE(cnt[b]);
+	}
+	for (b = 0; b < LKDC_HIST_BUCKETS; b++)
+		total += sum[b];
+	if (!total)
+		return;
+
+	seq_printf(m, "%s %s (%llu calls):\n", lkdc_hist_opname[op],
+		size ? "size, bytes" : "latency, ns", total);
+	for (b = 0; b < LKDC_HIST_BUCKETS; b++) {
+		if (!sum[b])
+			continue;
+		if (!b)
+			seq_printf(m, "  %12s %12u : %llu\n", "", 0, sum[b]);
+		else if (b == LKDC_HIST_BUCKETS - 1)
+			seq_printf(m, "  %12llu -> %9s : %llu\n",
+				1ULL << (b - 1), "", sum[b]);
+		else
+			seq_printf(m, "  %12llu -> %9llu : %llu\n",
+				1ULL << (b - 1), (1ULL << b) - 1, sum[b]);
+	}
+}
+
+static int lkdc_hist_show(struct seq_file *m, void *v)
+{
+	struct lkdc_hist *h = m->private;
+	int op;
+
+	for (op = 0; op < LKDC_H_NOPS; op++) {
+		lkdc_hist_show_one(m, h, op, false);
+		lkdc_hist_show_one(m, h, op, true);
+	}
+	return 0;
+}
+
+static int lkdc_hist_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, lkdc_hist_show, inode->i_private);
+}
+
+static const struct file_operations lkdc_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = lkdc_hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Any write to the 'reset' file zeroes all the histograms */
+static ssize_t lkdc_hist_reset_write(struct file *filp, const char __user *ubuf,
+				     size_t count, loff_t *off)
+{
+	struct lkdc_hist *h = filp->private_data;
+	int cpu;
+
+	/* Racy wrt concurrent recording, but then, a reset's a reset */
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(h->pc, cpu), 0, sizeof(struct lkdc_hist_pcpu));
+	return count;
+}
+
+static const struct file_operations lkdc_hist_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = lkdc_hist_reset_write,
+	.llseek = no_llseek,
+};
+
+/*
+ * Set up the histograms and their debugfs files (under a directory 'name').
+ * Only a failure to allocate the counters is an error; if debugfs isn't
+ * available, the histograms are still recorded, just not visible.
+ */
+static int lkdc_hist_init(struct lkdc_hist *h, const char *name)
+{
+	h->pc = alloc_percpu(struct lkdc_hist_pcpu);
+	if (!h->pc)
+		return -ENOMEM;
+	h->dir = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(h->dir)) {
+		pr_warn("%s: debugfs dir creation failed; no histograms\n", name);
+		h->dir = NULL;
+		return 0;
+	}
+	debugfs_create_file("histograms", 0444, h->dir, h, &lkdc_hist_fops);
+	debugfs_create_file("reset", 0200, h->dir, h, &lkdc_hist_reset_fops);
+	return 0;
+}
+
+static void lkdc_hist_exit(struct lkdc_hist *h)
+{
+	debugfs_remove_recursive(h->dir);  // NULL is fine
+	free_percpu(h->pc);
+}
+
+#endif   /* _LKDC_MISC_HIST_H */
@@ -0,0 +1,102 @@
+/*
+ * lkdc_misc_iter.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ ****************************************************************
+ * Brief Description:
+ * The segment loops of the vectored read_iter / write_iter methods of our
+ * ch9 / ch10 'misc' class character drivers (readv(2), writev(2) and
+ * friends). Each segment of the I/O vector is treated as a separate request,
+ * just as if it had been a read(2) or write(2) of it's own:
+ * - read:  each segment must be at least 'minseg' (MAXBYTES) bytes, and each
+ *          receives a copy of the secret;
+ * - write: each segment in turn becomes the new secret; a segment longer than
+ *          'maxbytes' (MAXBYTES) is truncated to it - the rest is accepted but
+ *          discarded - and an empty one is rejected.
+ * Thus, a single syscall transfers the secret into (or from) many buffers.
+ * The drivers differ only in how they protect the secret; so, that's left to
+ * the caller (read: hold whatever lock you need across the call; write: the
+ * 'set' callback installs each segment, taking the lock it needs).
+ * Both return the total # of bytes transferred; if the very first segment
+ * fails, the -ve errno instead. '*aborted' is set if we stopped short.
+ *
+ * For details, please refer the book, Ch 9 and 10.
+ */
+#ifndef _LKDC_MISC_ITER_H
+#define _LKDC_MISC_ITER_H
+
+#include <linux/uio.h>		// struct iov_iter, copy_[to|from]_iter()
+#include <linux/kernel.h>	// min()
+
+static inline ssize_t lkdc_iter_read(struct iov_iter *to, const char *src,
+				     size_t len, size_t minseg,
+				     const char *name, bool *aborted)
+{
+	ssize_t ret = 0;
+	size_t seglen;
+
+	*aborted = false;
+	while (iov_iter_count(to)) {
+		seglen = iov_iter_single_seg_count(to);
+		if (seglen < minseg) {
+			pr_warn("%s:%s(): segment size (%zu) is < required size"
+				" (%zu), aborting read\n",
+				name, __func__, seglen, minseg);
+			*aborted = true;
+			return (ret ? ret : -EINVAL);
+		}
+		if (copy_to_iter(src, len, to) != len) {
+			pr_warn("%s:%s(): copy_to_iter() failed\n", name, __func__);
+			*aborted = true;
+			return (ret ? ret : -EFAULT);
+		}
+		/* skip the remainder of this segment; on to the next one */
+		iov_iter_advance(to, seglen - len);
+		ret += len;
+	}
+	return ret;
+}
+
+/* Install the (NUL-terminated) 'n' bytes of 'kbuf', of a 'seglen' segment */
+typedef void (*lkdc_iter_set_fn)(void *arg, const char *kbuf, size_t n,
+				 size_t seglen);
+
+/* 'kbuf' - a small staging buffer - must be of (at least) maxbytes + 1 */
+static inline ssize_t lkdc_iter_write(struct iov_iter *from, char *kbuf,
+				      size_t maxbytes, lkdc_iter_set_fn set,
+				      void *arg, const char *name, bool *aborted)
+{
+	ssize_t ret = 0;
+	size_t seglen, n;
+
+	*aborted = false;
+	while (iov_iter_count(from)) {
+		seglen = iov_iter_single_seg_count(from);
+		if (unlikely(!seglen)) {  /* we'd spin here forever */
+			pr_warn("%s:%s(): empty segment, aborting write\n",
+				name, __func__);
+			*aborted = true;
+			return (ret ? ret : -EINVAL);
+		}
+		n = min(seglen, maxbytes);
+		if (copy_from_iter(kbuf, n, from) != n) {
+			pr_warn("%s:%s(): copy_from_iter() failed\n", name, __func__);
+			*aborted = true;
+			return (ret ? ret : -EFAULT);
+		}
+		kbuf[n] = '\0';
+		/* whatever's beyond maxbytes is accepted but discarded */
+		iov_iter_advance(from, seglen - n);
+		set(arg, kbuf, n, seglen);
+		ret += seglen;
+	}
+	return ret;
+}
+
+#endif   /* #ifndef _LKDC_MISC_ITER_H */
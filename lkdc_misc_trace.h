@@ -0,0 +1,169 @@
+/*
+ * lkdc_misc_trace.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ ****************************************************************
+ * Brief Description:
+ * Tracepoints for our ch9 / ch10 'misc' class character drivers.
+ * The drivers' open, read, write and release methods fire these events; each
+ * records the driver name, the byte counts (requested and actually done, or
+ * the -ve errno) and a few 'context flags' (as PRINT_CTX() displays them).
+ * When disabled - the default - a tracepoint costs just a (patched-out)
+ * branch; when enabled, the event is written into the ftrace ring buffer,
+ * no printk, no console. To use:
+ *  # cd /sys/kernel/debug/tracing
+ *  # echo 1 > events/lkdc_misc/enable ; cat trace_pipe
+ * or
+ *  # perf stat -e 'lkdc_misc:*' <workload>
+ *
+ * Usage (within a driver):
+ * - exactly one .c file of the module must do:
+ *    #define CREATE_TRACE_POINTS
+ *    #include "../../lkdc_misc_trace.h"
+ * - the module Makefile must add the repo's top dir to the include path, so
+ *   that <trace/define_trace.h> can find this header:
+ *    EXTRA_CFLAGS += -I$(src)/../..
+ * (The printk side - the 'verbose' parameter, VPRINT_CTX() and vpr_info() -
+ * is in lkdc_misc_verbose.h.)
+ * Note: all our misc drivers define the one 'lkdc_misc' trace system, with the
+ * same event names; the tracing core can't register a second module's events
+ * under an existing system:event name, so load only one of them at a time.
+ *
+ * For details, please refer the book, Ch 9 and 10.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lkdc_misc
+
+#if !defined(_LKDC_MISC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LKDC_MISC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+#ifndef _LKDC_MISC_TRACE_HELPERS
+#define _LKDC_MISC_TRACE_HELPERS
+#include <linux/sched.h>
+#include <linux/hardirq.h>
+#include <linux/irqflags.h>
+
+/* The 'context flags'; pretty much what PRINT_CTX() shows */
+#define LKDC_CTX_KTHREAD	0x01	/* a kernel thread (no mm) */
+#define LKDC_CTX_IRQS_OFF	0x02	/* hardware interrupts disabled */
+#define LKDC_CTX_NEED_RESCHED	0x04
+#define LKDC_CTX_HARDIRQ	0x08
+#define LKDC_CTX_SOFTIRQ	0x10
+
+static inline unsigned int lkdc_ctx_flags(void)
+{
+	unsigned int flags = 0;
+
+	if (!current->mm)
+		flags |= LKDC_CTX_KTHREAD;
+	if (irqs_disabled())
+		flags |= LKDC_CTX_IRQS_OFF;
+	if (need_resched())
+		flags |= LKDC_CTX_NEED_RESCHED;
+	if (in_irq())
+		flags |= LKDC_CTX_HARDIRQ;
+	if (in_softirq())
+		flags |= LKDC_CTX_SOFTIRQ;
+	return flags;
+}
+#endif   /* #ifndef _LKDC_MISC_TRACE_HELPERS */
+
+#define show_lkdc_ctx_flags(flags)				\
+	__print_flags(flags, "|",				\
+		{ LKDC_CTX_KTHREAD,		"kthread" },	\
+		{ LKDC_CTX_IRQS_OFF,		"irqs-off" },	\
+		{ LKDC_CTX_NEED_RESCHED,	"need-resched" },	\
+		{ LKDC_CTX_HARDIRQ,		"hardirq" },	\
+		{ LKDC_CTX_SOFTIRQ,		"softirq" })
+
+/* open / release */
+DECLARE_EVENT_CLASS(lkdc_misc_file,
+
+	TP_PROTO(const char *drv, struct file *filp),
+
+	TP_ARGS(drv, filp),
+
+	TP_STRUCT__entry(
+		__string(drv, drv)
+		__field(unsigned int, f_flags)
+		__field(unsigned int, ctxflags)
+	),
+
+	TP_fast_assign(
+		__assign_str(drv, drv);
+		__entry->f_flags = filp->f_flags;
+		__entry->ctxflags = lkdc_ctx_flags();
+	),
+
+	TP_printk("%s f_flags=0x%x ctx=%s",
+		__get_str(drv), __entry->f_flags,
+		show_lkdc_ctx_flags(__entry->ctxflags))
+);
+
+DEFINE_EVENT(lkdc_misc_file, lkdc_open,
+	TP_PROTO(const char *drv, struct file *filp),
+	TP_ARGS(drv, filp)
+);
+
+DEFINE_EVENT(lkdc_misc_file, lkdc_release,
+	TP_PROTO(const char *drv, struct file *filp),
+	TP_ARGS(drv, filp)
+);
+
+/*
+ * read / write; also fired by the read_iter / write_iter methods, with the
+ * total over all the segments. 'ret' is what the method returns: the # of
+ * bytes transferred or a -ve errno.
+ */
+DECLARE_EVENT_CLASS(lkdc_misc_xfer,
+
+	TP_PROTO(const char *drv, size_t count, ssize_t ret),
+
+	TP_ARGS(drv, count, ret),
+
+	TP_STRUCT__entry(
+		__string(drv, drv)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+		__field(unsigned int, ctxflags)
+	),
+
+	TP_fast_assign(
+		__assign_str(drv, drv);
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->ctxflags = lkdc_ctx_flags();
+	),
+
+	TP_printk("%s count=%zu ret=%zd ctx=%s",
+		__get_str(drv), __entry->count, __entry->ret,
+		show_lkdc_ctx_flags(__entry->ctxflags))
+);
+
+DEFINE_EVENT(lkdc_misc_xfer, lkdc_read,
+	TP_PROTO(const char *drv, size_t count, ssize_t ret),
+	TP_ARGS(drv, count, ret)
+);
+
+DEFINE_EVENT(lkdc_misc_xfer, lkdc_write,
+	TP_PROTO(const char *drv, size_t count, ssize_t ret),
+	TP_ARGS(drv, count, ret)
+);
+
+#endif   /* _LKDC_MISC_TRACE_H */
+
+/* This part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lkdc_misc_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,54 @@
+/*
+ * lkdc_misc_verbose.h
+ ***************************************************************
+ * This program is part of the source code released for the book
+ *  "Linux Kernel Development Cookbook"
+ *  (c) Author: Kaiwan N Billimoria
+ *  Publisher:  Packt
+ *  GitHub repository:
+ *  https://github.com/PacktPublishing/Linux-Kernel-Development-Cookbook
+ *
+ ****************************************************************
+ * Brief Description:
+ * The 'verbose' module parameter of our ch9 / ch10 'misc' class character
+ * drivers, and the printk wrappers that honour it. With verbose=1 (the
+ * default), the driver methods printk as they run, as they always have; under
+ * load, set it to 0 (it's writable at runtime, via
+ * /sys/module/<drvname>/parameters/verbose) and use the lkdc_misc tracepoints
+ * (see lkdc_misc_trace.h) instead.
+ *
+ * Usage (within a driver):
+ *  #include "../../lkdc_misc_verbose.h"   (in the one .c file of the module)
+ *  method:  VPRINT_CTX();
+ *           vpr_info("%s:%s(): ...\n", OURMODNAME, __func__, ...);
+ * It defines the (static) 'verbose' parameter itself; so, include it in
+ * exactly one .c file of the module, and don't define another 'verbose'.
+ * The module Makefile must add the repo's top dir to the include path (as it
+ * already does for lkdc_misc_trace.h).
+ *
+ * For details, please refer the book, Ch 9 and 10.
+ */
+#ifndef _LKDC_MISC_VERBOSE_H
+#define _LKDC_MISC_VERBOSE_H
+
+#include <linux/moduleparam.h>
+#include <linux/printk.h>
+#include "convenient.h"		// PRINT_CTX()
+
+static bool verbose = true;
+module_param(verbose, bool, 0644);
+MODULE_PARM_DESC(verbose,
+ "If 1 (the default), the driver methods printk as they run; set to 0 under load"
+ " and use the lkdc_misc tracepoints instead");
+
+/* The (optional) printk's of the drivers' methods */
+#define VPRINT_CTX() do {			\
+	if (verbose)				\
+		PRINT_CTX();			\
+} while (0)
+#define vpr_info(fmt, ...) do {			\
+	if (verbose)				\
+		pr_info(fmt, ##__VA_ARGS__);	\
+} while (0)
+
+#endif   /* #ifndef _LKDC_MISC_VERBOSE_H */
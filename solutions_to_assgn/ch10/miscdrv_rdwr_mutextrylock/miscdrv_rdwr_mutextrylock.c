@@ -16,17 +16,40 @@
  * If the lock is not acquired, perform a hex dump of the driver 'context'
  * structure ('busy-loop' over this).
  *
+ * Going further: the 'trylock_policy' module parameter selects how the write
+ * method acquires the mutex:
+ *  0 : classic (the default): the assignment's solution, as described above;
+ *      keep trying, doing some 'work' in between, until we get it
+ *  1 : adaptive, sleep: try upto 1+'spin_tries' times, backing off (busy-
+ *      waiting) exponentially in between - 32 ns, 64 ns, ... upto
+ *      'backoff_max_ns' - and, if still contended, fall back to sleeping on
+ *      the mutex
+ *  2 : adaptive, -EAGAIN: as 1, but instead of sleeping, fail the write with
+ *      -EAGAIN, leaving it to userspace to retry (or not)
+ * The outcome of every trylock is counted in per-CPU counters - successes,
+ * failures and retries, plus the fallbacks to sleep and the -EAGAIN's - that
+ * are summed up and shown via debugfs:
+ *  # cat /sys/kernel/debug/miscdrv_rdwr_mutextrylock/trylock_stats
+ *  # echo 1 > /sys/kernel/debug/miscdrv_rdwr_mutextrylock/reset
+ * All three parameters can be changed at runtime (via sysfs), so as to tune
+ * them against the actual contention. Under load, also set verbose=0: the
+ * methods then don't printk at all.
+ *
  * For details, please refer the book, Ch 10.
  */
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/miscdevice.h>
 #include <linux/slab.h>         // k[m|z]alloc(), k[z]free(), ...
-#include <linux/mm.h>           // kvmalloc()
 #include <linux/fs.h>		// the fops structure
 #include <linux/uaccess.h>      // copy_to|from_user() macros
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/delay.h>        // ndelay()
 #include "../../../convenient.h"
+#include "../../../lkdc_misc_verbose.h"
 
 #define OURMODNAME   "miscdrv_rdwr_mutextrylock"
 
@@ -36,6 +59,59 @@ MODULE_DESCRIPTION("LKDC book:solutions_to_assgn/ch10/miscdrv_rdwr_mutextrylock:
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_VERSION("0.1");
 
+#define TL_CLASSIC		0
+#define TL_ADAPTIVE_SLEEP	1
+#define TL_ADAPTIVE_EAGAIN	2
+static int trylock_policy = TL_CLASSIC;
+
+/* trylock_policy is writable at runtime; so, validate it on every set */
+static int set_trylock_policy(const char *val, const struct kernel_param *kp)
+{
+	int ret, policy;
+
+	ret = kstrtoint(val, 0, &policy);
+	if (ret)
+		return ret;
+	if (policy < TL_CLASSIC || policy > TL_ADAPTIVE_EAGAIN)
+		return -EINVAL;
+	WRITE_ONCE(trylock_policy, policy);
+	return 0;
+}
+
+static const struct kernel_param_ops trylock_policy_ops = {
+	.set = set_trylock_policy,
+	.get = param_get_int,
+};
+module_param_cb(trylock_policy, &trylock_policy_ops, &trylock_policy, 0644);
+MODULE_PARM_DESC(trylock_policy,
+ "How write() acquires the mutex; 0: classic trylock loop (the default),"
+ " 1: adaptive - bounded spin with exponential backoff, then sleep,"
+ " 2: adaptive - bounded spin with exponential backoff, then fail with -EAGAIN");
+
+static uint spin_tries = 8;
+module_param(spin_tries, uint, 0644);
+MODULE_PARM_DESC(spin_tries,
+ "Adaptive policies: the # of retries of the trylock before giving up (default 8)");
+
+#define BACKOFF_MIN_NS	32
+#define BACKOFF_CAP_NS	20000   // ndelay() isn't meant for longer delays
+static uint backoff_max_ns = 4096;
+module_param(backoff_max_ns, uint, 0644);
+MODULE_PARM_DESC(backoff_max_ns,
+ "Adaptive policies: the backoff between retries doubles from 32 ns upto this"
+ " (default 4096, max 20000)");
+
+/* Per-CPU trylock statistics; summed up only when read (via debugfs) */
+struct trylock_stats {
+	u64 success;   // trylock acquired the mutex
+	u64 fail;      // trylock found it contended
+	u64 retries;   // ... and we (backed off and) retried
+	u64 slept;     // adaptive: gave up spinning, slept on the mutex
+	u64 eagain;    // adaptive: gave up, failed the write with -EAGAIN
+};
+static struct trylock_stats __percpu *tl_stats;
+static struct dentry *dbgfs_dir;
+
 static int ga, gb = 1;
 DEFINE_MUTEX(lock1); // protects the global integers ga and gb
 
@@ -63,13 +139,13 @@ static struct drv_ctx *ctx;
  */
 static int open_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-	PRINT_CTX(); // displays process (or intr) context info
+	VPRINT_CTX(); // displays process (or intr) context info
 
 	mutex_lock(&lock1);
 	ga ++; gb --;
 	mutex_unlock(&lock1);
 
-	pr_info("%s:%s():\n"
+	vpr_info("%s:%s():\n"
 		" filename: \"%s\"\n"
 		" wrt open file: f_flags = 0x%x\n"
 		" ga = %d, gb = %d\n",
@@ -97,8 +173,8 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 	secret_len = strlen(ctx->oursecret);
 	mutex_unlock(&ctx->lock);
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to read (upto) %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
 	ret = -EINVAL;
@@ -135,7 +211,7 @@ static ssize_t read_miscdrv_rdwr(struct file *filp, char __user *ubuf,
 
 	// Update stats
 	ctx->tx += secret_len; // our 'transmit' is wrt this driver
-	pr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
+	vpr_info(" %d bytes read, returning... (stats: tx=%d, rx=%d)\n",
 			secret_len, ctx->tx, ctx->rx);
 out_ctu:
 	mutex_unlock(&ctx->lock);
@@ -143,6 +219,45 @@ out_notok:
 	return ret;
 }
 
+/*
+ * lock_adaptive()
+ * The adaptive policies: try for the mutex, upto 1+spin_tries times, backing
+ * off exponentially in between; when contended, this gives the holder a
+ * chance to finish (our critical section is short) without us going to sleep
+ * or hammering the lock's cache line. If we still don't get it, either sleep
+ * on the mutex or give up with -EAGAIN, as per the policy. '*try' is set to
+ * the # of trylock attempts made. Returns 0 with the mutex held, else -errno.
+ */
+static int lock_adaptive(int *try)
+{
+	unsigned int backoff = BACKOFF_MIN_NS;
+	unsigned int max = min_t(uint, READ_ONCE(backoff_max_ns), BACKOFF_CAP_NS);
+	unsigned int i, ntries = READ_ONCE(spin_tries);
+
+	for (i = 0; i <= ntries; i++) {
+		*try = i + 1;
+		if (mutex_trylock(&ctx->lock)) {
+			this_cpu_inc(tl_stats->success);
+			return 0;
+		}
+		this_cpu_inc(tl_stats->fail);
+		if (i == ntries)
+			break;
+		this_cpu_inc(tl_stats->retries);
+		ndelay(backoff);
+		backoff = min(backoff * 2, max);
+	}
+
+	if (READ_ONCE(trylock_policy) == TL_ADAPTIVE_EAGAIN) {
+		this_cpu_inc(tl_stats->eagain);
+		return -EAGAIN;
+	}
+	this_cpu_inc(tl_stats->slept);
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+	return 0;
+}
+
 /*
  * write_miscdrv_rdwr()
  * The driver's write 'method'; it has effectively 'taken over' the write syscall
@@ -155,33 +270,30 @@ out_notok:
 static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 				size_t count, loff_t *off)
 {
-	int ret, tl = 0, try = 1;
-	void *kbuf = NULL;
+	int ret, tl = 0, try = 1, tx, rx;
+	size_t n = (count > MAXBYTES ? MAXBYTES : count);
+	char kbuf[MAXBYTES + 1];
 
-	PRINT_CTX();
-	pr_info("%s:%s():\n %s wants to write %ld bytes\n",
+	VPRINT_CTX();
+	vpr_info("%s:%s():\n %s wants to write %ld bytes\n",
 			OURMODNAME, __func__, current->comm, count);
 
-	ret = -ENOMEM;
-	kbuf = kvmalloc(count, GFP_KERNEL);
-	if (unlikely(!kbuf)) {
-		pr_warn("%s:%s(): kvmalloc() failed!\n", OURMODNAME, __func__);
-		goto out_nomem;
-	}
-	memset(kbuf, 0, count);
-
 	/* Copy in the user supplied buffer 'ubuf' - the data content to write -
 	 * via the copy_from_user() macro.
 	 * (FYI, the copy_from_user() macro is the *right* way to copy data from
 	 * kernel-space to userspace; the parameters are:
 	 *  'to-buffer', 'from-buffer', count
 	 *  Returns 0 on success, i.e., non-zero return implies an I/O fault).
+	 * We only ever keep (upto) MAXBYTES of it; so, that's all we copy in,
+	 * into a small on-stack buffer - there's no need to allocate (and free)
+	 * memory on every write.
 	 */
 	ret = -EFAULT;
-	if (copy_from_user(kbuf, ubuf, count)) {
+	if (copy_from_user(kbuf, ubuf, n)) {
 		pr_warn("%s:%s(): copy_from_user() failed\n", OURMODNAME, __func__);
 		goto out_cfu;
 	}
+	kbuf[n] = '\0';
 
 	/* In a 'real' driver, we would now actually write (for 'count' bytes)
 	 * the content of the 'ubuf' buffer to the device hardware (or whatever),
@@ -196,33 +308,52 @@ static ssize_t write_miscdrv_rdwr(struct file *filp, const char __user *ubuf,
 	 * don't really have many threads competing for it - unless you write
 	 * a test case for that); hence, we will likely acquire the mutex on
 	 * the first attempt.
+	 * (With the adaptive policies, lock_adaptive() does the trying.)
 	 */
+	if (READ_ONCE(trylock_policy) != TL_CLASSIC) {
+		ret = lock_adaptive(&try);
+		if (ret < 0) {
+			pr_debug("%s:%s(): gave up on the mutex after %d tries (%d)\n",
+				OURMODNAME, __func__, try, ret);
+			goto out_cfu;
+		}
+		tl = 1;
+		goto locked;
+	}
 	while (0 == (tl = mutex_trylock(&ctx->lock))) { // not acquired the lock
-		pr_info("%s:%s(): try #%d: mutex trylock NOT acquired ...\n",
-			OURMODNAME, __func__, try ++);
+		this_cpu_inc(tl_stats->fail);
+		this_cpu_inc(tl_stats->retries);
+		vpr_info("%s:%s(): try #%d: mutex trylock NOT acquired ...\n",
+			OURMODNAME, __func__, try);
+		try++;
 		DELAY_LOOP('L', 72);		// emulate 'work'
 #if 1
 		/* Pedantically wrong; we must have the lock when reading the
 		 * 'ctx' structure */
-		print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
-				ctx, sizeof(struct drv_ctx));
+		if (verbose)
+			print_hex_dump_bytes("ctx ", DUMP_PREFIX_OFFSET,
+					ctx, sizeof(struct drv_ctx));
 #endif
 	}
+	this_cpu_inc(tl_stats->success);
+locked:
 	if (1 == tl) {      // acquired the lock!
-		pr_info("%s:%s(): try #%d: mutex trylock acquired ...\n",
-			OURMODNAME, __func__, try ++);
-		strlcpy(ctx->oursecret, kbuf, (count > MAXBYTES ? MAXBYTES : count));
+		strlcpy(ctx->oursecret, kbuf, n);
 		// Update stats
 		ctx->rx += count; // our 'receive' is wrt this driver
+		tx = ctx->tx;
+		rx = ctx->rx;
+		mutex_unlock(&ctx->lock);
 
+		/* No printk's while holding the lock; they'd only lengthen the
+		 * critical section - and thus, the contention we measure */
 		ret = count;
-		pr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
-			count, ctx->tx, ctx->rx);
-		mutex_unlock(&ctx->lock);
+		vpr_info("%s:%s(): try #%d: mutex trylock acquired ...\n",
+			OURMODNAME, __func__, try);
+		vpr_info(" %ld bytes written, returning... (stats: tx=%d, rx=%d)\n",
+			count, tx, rx);
 	}
 out_cfu:
-	kvfree(kbuf);
-out_nomem:
 	return ret;
 }
 
@@ -234,7 +365,7 @@ out_nomem:
  */
 static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 {
-        PRINT_CTX(); // displays process (or intr) context info
+        VPRINT_CTX(); // displays process (or intr) context info
 
 	mutex_lock(&lock1);
 	ga --; gb ++;
@@ -242,15 +373,69 @@ static int close_miscdrv_rdwr(struct inode *inode, struct file *filp)
 
         /* REQD:: XXX : spin_lock(filp->f_lock); .. then unlock 
          *  do this for the CORRECT drv; miscdrv_enh.ko */
-        pr_info("%s:%s(): filename: \"%s\"\n"
+        vpr_info("%s:%s(): filename: \"%s\"\n"
 		" ga = %d, gb = %d\n",
 			OURMODNAME, __func__, filp->f_path.dentry->d_iname,
 			ga, gb);
         return 0;
 }
 
+/* debugfs: the trylock statistics, summed over all CPUs */
+static int trylock_stats_show(struct seq_file *m, void *v)
+{
+	struct trylock_stats sum = { 0 }, *s;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(tl_stats, cpu);
+		sum.success += READ_ONCE(s->success);
+		sum.fail += READ_ONCE(s->fail);
+		sum.retries += READ_ONCE(s->retries);
+		sum.slept += READ_ONCE(s->slept);
+		sum.eagain += READ_ONCE(s->eagain);
+	}
+	seq_printf(m, "policy=%d spin_tries=%u backoff_max_ns=%u\n"
+		"success %llu\nfail %llu\nretries %llu\nslept %llu\neagain %llu\n",
+		trylock_policy, spin_tries, backoff_max_ns,
+		sum.success, sum.fail, sum.retries, sum.slept, sum.eagain);
+	return 0;
+}
+
+static int trylock_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, trylock_stats_show, NULL);
+}
+
+static const struct file_operations trylock_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = trylock_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Any write to the 'reset' file zeroes the statistics */
+static ssize_t trylock_reset_write(struct file *filp, const char __user *ubuf,
+				   size_t count, loff_t *off)
+{
+	int cpu;
+
+	/* Not atomic wrt the writers: a trylock counted concurrently may survive
+	 * the reset, or be lost; fine for a counter that's only ever eyeballed */
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(tl_stats, cpu), 0, sizeof(struct trylock_stats));
+	return count;
+}
+
+static const struct file_operations trylock_reset_fops = {
+	.owner = THIS_MODULE,
+	.write = trylock_reset_write,
+	.llseek = no_llseek,
+};
+
 /* The driver 'functionality' is encoded via the fops */
 static const struct file_operations lkdc_misc_fops = {
+	.owner = THIS_MODULE,
 	.open = open_miscdrv_rdwr,
 	.read = read_miscdrv_rdwr,
 	.write = write_miscdrv_rdwr,
@@ -272,12 +457,47 @@ static struct miscdevice lkdc_miscdev = {
 
 static int __init miscdrv_init_mutextrylock(void)
 {
-	int ret;
+	int ret = -ENOMEM;
+
+	if (trylock_policy < TL_CLASSIC || trylock_policy > TL_ADAPTIVE_EAGAIN) {
+		pr_notice("%s: trylock_policy=%d invalid (must be 0, 1 or 2), aborting\n",
+			OURMODNAME, trylock_policy);
+		return -EINVAL;
+	}
+	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
+	if (unlikely(!ctx)) {
+		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
+		return -ENOMEM;
+	}
+	tl_stats = alloc_percpu(struct trylock_stats);
+	if (!tl_stats)
+		goto out_stats;
+	/* debugfs is optional; failure here isn't fatal */
+	dbgfs_dir = debugfs_create_dir(OURMODNAME, NULL);
+	if (IS_ERR_OR_NULL(dbgfs_dir)) {
+		pr_warn("%s: debugfs dir creation failed; no trylock stats\n",
+			OURMODNAME);
+		dbgfs_dir = NULL;
+	} else {
+		debugfs_create_file("trylock_stats", 0444, dbgfs_dir, NULL,
+				    &trylock_stats_fops);
+		debugfs_create_file("reset", 0200, dbgfs_dir, NULL,
+				    &trylock_reset_fops);
+	}
+	mutex_init(&ctx->lock);
+	strlcpy(ctx->oursecret, "initmsg", 8);
+		/* Why don't we protect the above strlcpy() with the mutex lock?
+		 * It's working on shared writable data, yes?
+		 * No; this is the init code; it's guaranteed to run in exactly
+		 * one context (typically the insmod(8) process), thus there is
+		 * no concurrency possible here (the device isn't registered yet).
+		 * The same goes for the cleanup code path.
+		 */
 
 	if ((ret = misc_register(&lkdc_miscdev))) {
 		pr_notice("%s: misc device registration failed, aborting\n",
 			       OURMODNAME);
-		return ret;
+		goto out_reg;
 	}
 	pr_info("%s: LKDC misc driver (major # 10) registered, minor# = %d\n",
 			OURMODNAME, lkdc_miscdev.minor);
@@ -296,30 +516,26 @@ static int __init miscdrv_init_mutextrylock(void)
 	 */
 	pr_info("%s:minor=%d\n", OURMODNAME, lkdc_miscdev.minor);
 
-	ctx = kzalloc(sizeof(struct drv_ctx), GFP_KERNEL);
-	if (unlikely(!ctx)) {
-		pr_notice("%s: kzalloc failed! aborting\n", OURMODNAME);
-		return -ENOMEM;
-	}
-	mutex_init(&ctx->lock);
-	strlcpy(ctx->oursecret, "initmsg", 8);
-		/* Why don't we protect the above strlcpy() with the mutex lock?
-		 * It's working on shared writable data, yes?
-		 * No; this is the init code; it's guaranteed to run in exactly
-		 * one context (typically the insmod(8) process), thus there is
-		 * no concurrency possible here. The same goes for the cleanup
-		 * code path.
-		 */
-
 	return 0;		/* success */
+
+out_reg:
+	mutex_destroy(&ctx->lock);
+	debugfs_remove_recursive(dbgfs_dir);
+	free_percpu(tl_stats);
+out_stats:
+	kfree(ctx);
+	return ret;
 }
 
 static void __exit miscdrv_exit_mutextrylock(void)
 {
+	/* Deregister first: no new opens from here on */
+	misc_deregister(&lkdc_miscdev);
 	mutex_destroy(&lock1);
 	mutex_destroy(&ctx->lock);
 	kzfree(ctx);
-	misc_deregister(&lkdc_miscdev);
+	debugfs_remove_recursive(dbgfs_dir);
+	free_percpu(tl_stats);
 	pr_debug("%s: LKDC misc driver deregistered, bye\n", OURMODNAME);
 }
 